@@ -0,0 +1,755 @@
+/*
+ * This code is licensed under the Attribution-NonCommercial-NoDerivatives 4.0 International license.
+ *
+ * Authors:
+ * D'Arcy Smith (ds@programming101.dev)
+ * Aryan Jand (aryan_jand@bcit.ca)
+ *
+ * You are free to:
+ *   - Share: Copy and redistribute the material in any medium or format.
+ *   - Under the following terms:
+ *       - Attribution: You must give appropriate credit, provide a link to the license, and indicate if changes were made.
+ *       - NonCommercial: You may not use the material for commercial purposes.
+ *       - NoDerivatives: If you remix, transform, or build upon the material, you may not distribute the modified material.
+ *
+ * For more details, please refer to the full license text at:
+ * https://creativecommons.org/licenses/by-nc-nd/4.0/
+ */
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "parser.h"
+#include "protocol.h"
+#include "text_statistics.h"
+#include "utf8.h"
+#include "word_table.h"
+
+// Microbenchmarks for the per-byte and per-word paths of the server, run on
+// synthetic corpora held in memory so nothing but the code itself is measured.
+// Every benchmark is warmed up, then timed over REPETITIONS samples of at least
+// SAMPLE_NS each, and the median sample is reported.
+
+typedef struct
+{
+    size_t offset;
+    size_t length;
+} Word;
+
+typedef struct
+{
+    const char *name;
+    uint8_t *text; // The words, one space between each
+    size_t text_len;
+    Word *words;
+    size_t word_count;
+    uint8_t *v1; // The words encoded as a v1 stream
+    size_t v1_len;
+    uint8_t *v2; // The words encoded as a v2 stream, hello included
+    size_t v2_len;
+    uint8_t reply[STATS_REPLY_MAX_SIZE]; // The stats reply for the words
+    size_t reply_len;
+} Corpus;
+
+typedef struct
+{
+    const char *name;
+    void (*run)(const Corpus *corpus, TextStatistics *stats);
+    size_t (*bytes)(const Corpus *corpus); // Input bytes one run processes
+    int per_word;                          // Whether cycles per word means anything
+} Benchmark;
+
+typedef struct
+{
+    double ns_per_run;
+    double cycles_per_run;
+} Sample;
+
+static void corpus_init(Corpus *corpus, const char *name);
+static void corpus_add_word(Corpus *corpus, const uint8_t *word, size_t length, size_t *capacity, size_t *word_capacity);
+static void corpus_encode(Corpus *corpus);
+static void build_english(Corpus *corpus, uint64_t *state);
+static void build_random(Corpus *corpus, uint64_t *state);
+static void build_long_tokens(Corpus *corpus, uint64_t *state);
+static void build_single_bytes(Corpus *corpus, uint64_t *state);
+static void build_multilingual(Corpus *corpus, uint64_t *state);
+static void corpus_free(Corpus *corpus);
+static uint64_t next_random(uint64_t *state);
+static void run_update_character_frequency(const Corpus *corpus, TextStatistics *stats);
+static void run_histogram_scalar(const Corpus *corpus, TextStatistics *stats);
+static void run_histogram(const Corpus *corpus, TextStatistics *stats);
+static void run_initialize_stats_zero(const Corpus *corpus, TextStatistics *stats);
+static void run_encode_stats(const Corpus *corpus, TextStatistics *stats);
+static void run_decode_stats(const Corpus *corpus, TextStatistics *stats);
+static void run_parse(const uint8_t *stream, size_t length, uint8_t protocol, TextStatistics *stats, WordTable *words, WordSketch *sketch, Utf8Stats *utf8);
+static void run_parse_v1(const Corpus *corpus, TextStatistics *stats);
+static void run_parse_v2(const Corpus *corpus, TextStatistics *stats);
+static void run_parse_v2_words(const Corpus *corpus, TextStatistics *stats);
+static void run_word_table_add(const Corpus *corpus, TextStatistics *stats);
+static void run_parse_v2_sketch(const Corpus *corpus, TextStatistics *stats);
+static void run_utf8_count(const Corpus *corpus, TextStatistics *stats);
+static void run_parse_v2_utf8(const Corpus *corpus, TextStatistics *stats);
+static size_t text_bytes(const Corpus *corpus);
+static size_t stats_bytes(const Corpus *corpus);
+static size_t reply_bytes(const Corpus *corpus);
+static size_t v1_bytes(const Corpus *corpus);
+static size_t v2_bytes(const Corpus *corpus);
+static Sample time_runs(const Benchmark *benchmark, const Corpus *corpus, TextStatistics *stats, size_t runs);
+static void measure(const Benchmark *benchmark, const Corpus *corpus);
+static int compare_samples(const void *a, const void *b);
+static uint64_t monotonic_ns(void);
+static uint64_t read_cycles(void);
+_Noreturn static void error_exit(const char *msg);
+
+#define CORPUS_SIZE (1 << 20)         // Bytes of words per corpus, small enough to stay in cache
+#define RX_BUFFER_SIZE 16384           // The server's receive buffer, which the parser is fed through
+#define FRAME_SIZE 65536               // Bytes of words per v2 frame, as the client sends them
+#define WARMUP_NS 100000000ULL         // Time each benchmark runs before it is measured
+#define SAMPLE_NS 20000000ULL          // Shortest timed sample
+#define REPETITIONS 15
+#define NANOSECONDS_IN_SECOND 1000000000ULL
+
+static const Benchmark benchmarks[] = {
+    {"update_character_frequency", run_update_character_frequency, text_bytes, 1},
+    {"histogram_count_scalar", run_histogram_scalar, text_bytes, 1},
+    {"histogram_count", run_histogram, text_bytes, 1},
+    {"initialize_stats_zero", run_initialize_stats_zero, stats_bytes, 0},
+    {"encode_stats", run_encode_stats, stats_bytes, 0},
+    {"decode_stats", run_decode_stats, reply_bytes, 0},
+    {"parse v1 stream", run_parse_v1, v1_bytes, 1},
+    {"parse v2 stream", run_parse_v2, v2_bytes, 1},
+    {"parse v2 + word table", run_parse_v2_words, v2_bytes, 1},
+    {"word_table_add", run_word_table_add, text_bytes, 1},
+    {"parse v2 + word sketch", run_parse_v2_sketch, v2_bytes, 1},
+    {"utf8_count", run_utf8_count, text_bytes, 1},
+    {"parse v2 + utf8", run_parse_v2_utf8, v2_bytes, 1},
+};
+
+// Written at the end so the compiler cannot drop work whose result is unused.
+static volatile unsigned long long sink;
+
+int main(void)
+{
+    Corpus corpora[5];
+    uint64_t state;
+
+    state = 0x2545f4914f6cdd1dULL;
+    build_english(&corpora[0], &state);
+    build_random(&corpora[1], &state);
+    build_long_tokens(&corpora[2], &state);
+    build_single_bytes(&corpora[3], &state);
+    build_multilingual(&corpora[4], &state);
+
+#if defined(__x86_64__) || defined(__i386__)
+    puts("Cycles are time stamp counter cycles.");
+#else
+    puts("No cycle counter on this platform; cycles are not reported.");
+#endif
+
+    for (size_t i = 0; i < sizeof(corpora) / sizeof(corpora[0]); i++)
+    {
+        printf("\nCorpus %s: %zu bytes, %zu words\n", corpora[i].name, corpora[i].text_len, corpora[i].word_count);
+        printf("  %-28s %14s %12s %14s\n", "benchmark", "ns/run", "ns/byte", "cycles/word");
+
+        for (size_t j = 0; j < sizeof(benchmarks) / sizeof(benchmarks[0]); j++)
+        {
+            measure(&benchmarks[j], &corpora[i]);
+        }
+
+        corpus_free(&corpora[i]);
+    }
+
+    printf("\n(checksum %llu)\n", sink);
+
+    return EXIT_SUCCESS;
+}
+
+static void corpus_init(Corpus *corpus, const char *name)
+{
+    memset(corpus, 0, sizeof(*corpus));
+    corpus->name = name;
+}
+
+static void corpus_add_word(Corpus *corpus, const uint8_t *word, size_t length, size_t *capacity, size_t *word_capacity)
+{
+    if (corpus->text_len + length + 1 > *capacity)
+    {
+        *capacity = (*capacity == 0 ? CORPUS_SIZE : *capacity * 2) + length + 1;
+        corpus->text = (uint8_t *)realloc(corpus->text, *capacity);
+    }
+
+    if (corpus->word_count == *word_capacity)
+    {
+        *word_capacity = *word_capacity == 0 ? 4096 : *word_capacity * 2;
+        corpus->words = (Word *)realloc(corpus->words, *word_capacity * sizeof(Word));
+    }
+
+    if (corpus->text == NULL || corpus->words == NULL)
+    {
+        error_exit("Error allocating corpus");
+    }
+
+    if (corpus->text_len > 0)
+    {
+        corpus->text[corpus->text_len++] = ' ';
+    }
+
+    corpus->words[corpus->word_count].offset = corpus->text_len;
+    corpus->words[corpus->word_count].length = length;
+    corpus->word_count++;
+    memcpy(corpus->text + corpus->text_len, word, length);
+    corpus->text_len += length;
+}
+
+// Encodes the words as the client would send them in each protocol, and the
+// reply the server would send back.
+static void corpus_encode(Corpus *corpus)
+{
+    TextStatistics stats;
+    size_t v2_capacity;
+    size_t frame_start;
+    uint64_t frame_words;
+
+    corpus->v1 = (uint8_t *)malloc(corpus->text_len + corpus->word_count);
+    v2_capacity = HELLO_SIZE + corpus->text_len + corpus->word_count * VARINT_MAX_LEN + (corpus->text_len / FRAME_SIZE + 2) * V2_FRAME_HEADER_MAX;
+    corpus->v2 = (uint8_t *)malloc(v2_capacity);
+
+    if (corpus->v1 == NULL || corpus->v2 == NULL)
+    {
+        error_exit("Error allocating corpus");
+    }
+
+    corpus->v1_len = 0;
+    corpus->v2_len = hello_encode(corpus->v2, PROTOCOL_V2);
+    frame_start = 0;
+    frame_words = 0;
+
+    for (size_t i = 0; i <= corpus->word_count; i++)
+    {
+        const Word *word;
+
+        // Close the current frame when it is full or the words have run out.
+        if (frame_words > 0 && (i == corpus->word_count || corpus->v2_len - frame_start - V2_FRAME_HEADER_MAX >= FRAME_SIZE))
+        {
+            uint8_t header[V2_FRAME_HEADER_MAX];
+            size_t header_len;
+            size_t words_len;
+
+            words_len = corpus->v2_len - frame_start - V2_FRAME_HEADER_MAX;
+            header_len = frame_header_encode(header, V2_FRAME_WORDS, frame_words, words_len);
+            memcpy(corpus->v2 + frame_start, header, header_len);
+            memmove(corpus->v2 + frame_start + header_len, corpus->v2 + frame_start + V2_FRAME_HEADER_MAX, words_len);
+            corpus->v2_len = frame_start + header_len + words_len;
+            frame_words = 0;
+        }
+
+        if (i == corpus->word_count)
+        {
+            break;
+        }
+
+        if (frame_words == 0)
+        {
+            frame_start = corpus->v2_len;
+            corpus->v2_len += V2_FRAME_HEADER_MAX;
+        }
+
+        word = &corpus->words[i];
+        corpus->v1[corpus->v1_len++] = (uint8_t)word->length;
+        memcpy(corpus->v1 + corpus->v1_len, corpus->text + word->offset, word->length);
+        corpus->v1_len += word->length;
+        corpus->v2_len += varint_encode(word->length, corpus->v2 + corpus->v2_len);
+        memcpy(corpus->v2 + corpus->v2_len, corpus->text + word->offset, word->length);
+        corpus->v2_len += word->length;
+        frame_words++;
+    }
+
+    initialize_stats_zero(&stats);
+    run_parse_v1(corpus, &stats);
+    corpus->reply_len = encode_stats(&stats, REPLY_STATS, corpus->reply);
+}
+
+// Common English words drawn with Zipf-like weights, some capitalised or
+// followed by punctuation.
+static void build_english(Corpus *corpus, uint64_t *state)
+{
+    static const char *vocabulary[] = {
+        "the", "of", "and", "to", "a", "in", "is", "it", "you", "that", "he", "was", "for", "on", "are", "with",
+        "as", "his", "they", "be", "at", "one", "have", "this", "from", "or", "had", "by", "word", "but", "what",
+        "some", "we", "can", "out", "other", "were", "all", "there", "when", "up", "use", "your", "how", "said",
+        "each", "which", "their", "time", "will", "about", "many", "then", "them", "write", "would", "like",
+        "these", "long", "make", "thing", "see", "him", "two", "look", "more", "could", "people", "number",
+        "through", "between", "statistics", "multiplexing", "connection", "understanding", "approximately"};
+    size_t capacity = 0;
+    size_t word_capacity = 0;
+    size_t count = sizeof(vocabulary) / sizeof(vocabulary[0]);
+
+    corpus_init(corpus, "english");
+
+    while (corpus->text_len < CORPUS_SIZE)
+    {
+        uint8_t word[32];
+        size_t rank;
+        size_t length;
+        uint64_t roll;
+
+        // Squaring a uniform draw favours the front of the list.
+        roll = next_random(state) % count;
+        rank = roll * roll / count;
+        length = strlen(vocabulary[rank]);
+        memcpy(word, vocabulary[rank], length);
+        roll = next_random(state) % 16;
+
+        if (roll == 0)
+        {
+            word[0] = (uint8_t)(word[0] - 'a' + 'A');
+        }
+        else if (roll == 1)
+        {
+            word[length++] = ',';
+        }
+        else if (roll == 2)
+        {
+            word[length++] = '.';
+        }
+
+        corpus_add_word(corpus, word, length, &capacity, &word_capacity);
+    }
+
+    corpus_encode(corpus);
+}
+
+// Words of 1 to 32 uniformly random bytes. Null bytes are left out, since
+// update_character_frequency reports every one it finds.
+static void build_random(Corpus *corpus, uint64_t *state)
+{
+    size_t capacity = 0;
+    size_t word_capacity = 0;
+
+    corpus_init(corpus, "random bytes");
+
+    while (corpus->text_len < CORPUS_SIZE)
+    {
+        uint8_t word[32];
+        size_t length;
+
+        length = 1 + next_random(state) % sizeof(word);
+
+        for (size_t i = 0; i < length; i++)
+        {
+            word[i] = (uint8_t)(1 + next_random(state) % UINT8_MAX);
+        }
+
+        corpus_add_word(corpus, word, length, &capacity, &word_capacity);
+    }
+
+    corpus_encode(corpus);
+}
+
+// Words of 255 letters, the longest a v1 frame holds.
+static void build_long_tokens(Corpus *corpus, uint64_t *state)
+{
+    size_t capacity = 0;
+    size_t word_capacity = 0;
+
+    corpus_init(corpus, "long tokens");
+
+    while (corpus->text_len < CORPUS_SIZE)
+    {
+        uint8_t word[V1_MAX_WORD_LEN];
+
+        for (size_t i = 0; i < sizeof(word); i++)
+        {
+            word[i] = (uint8_t)('a' + next_random(state) % 26);
+        }
+
+        corpus_add_word(corpus, word, sizeof(word), &capacity, &word_capacity);
+    }
+
+    corpus_encode(corpus);
+}
+
+// One-letter words, where per-word overhead dominates.
+static void build_single_bytes(Corpus *corpus, uint64_t *state)
+{
+    size_t capacity = 0;
+    size_t word_capacity = 0;
+
+    corpus_init(corpus, "single-byte tokens");
+
+    while (corpus->text_len < CORPUS_SIZE)
+    {
+        uint8_t letter;
+
+        letter = (uint8_t)('a' + next_random(state) % 26);
+        corpus_add_word(corpus, &letter, 1, &capacity, &word_capacity);
+    }
+
+    corpus_encode(corpus);
+}
+
+// Words in French, Greek, Russian, Chinese and Japanese, with the odd emoji:
+// every length of UTF-8 sequence, mixed with ASCII.
+static void build_multilingual(Corpus *corpus, uint64_t *state)
+{
+    static const char *vocabulary[] = {
+        "le", "de", "et", "été", "première", "où", "déjà", "français", "garçon", "Ça", "être", "naïve",
+        "και", "το", "είναι", "λόγος", "Αθήνα", "στατιστική",
+        "и", "в", "не", "что", "слово", "Москва", "статистика",
+        "的", "是", "不", "我们", "统计", "连接", "中华人民共和国",
+        "の", "に", "は", "日本語", "ひらがな", "カタカナ", "東京",
+        "🙂", "👍🏽", "🎉"};
+    size_t capacity = 0;
+    size_t word_capacity = 0;
+    size_t count = sizeof(vocabulary) / sizeof(vocabulary[0]);
+
+    corpus_init(corpus, "multilingual");
+
+    while (corpus->text_len < CORPUS_SIZE)
+    {
+        const char *word;
+
+        word = vocabulary[next_random(state) % count];
+        corpus_add_word(corpus, (const uint8_t *)word, strlen(word), &capacity, &word_capacity);
+    }
+
+    corpus_encode(corpus);
+}
+
+static void corpus_free(Corpus *corpus)
+{
+    free(corpus->text);
+    free(corpus->words);
+    free(corpus->v1);
+    free(corpus->v2);
+}
+
+// xorshift64*, enough to make corpora that are the same on every run.
+static uint64_t next_random(uint64_t *state)
+{
+    uint64_t x;
+
+    x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+static void run_update_character_frequency(const Corpus *corpus, TextStatistics *stats)
+{
+    for (size_t i = 0; i < corpus->word_count; i++)
+    {
+        const Word *word = &corpus->words[i];
+
+        update_character_frequency((const char *)corpus->text + word->offset, (uint8_t)word->length, stats->character_frequency);
+    }
+}
+
+static void run_histogram_scalar(const Corpus *corpus, TextStatistics *stats)
+{
+    histogram_count_scalar(corpus->text, corpus->text_len, stats->character_frequency);
+}
+
+static void run_histogram(const Corpus *corpus, TextStatistics *stats)
+{
+    histogram_count(corpus->text, corpus->text_len, stats->character_frequency);
+}
+
+static void run_initialize_stats_zero(const Corpus *corpus, TextStatistics *stats)
+{
+    (void)corpus;
+    initialize_stats_zero(stats);
+    sink += stats->character_frequency[0];
+}
+
+// Encodes the stats the corpus produces, as a connection's stats reply does.
+static void run_encode_stats(const Corpus *corpus, TextStatistics *stats)
+{
+    uint8_t reply[STATS_REPLY_MAX_SIZE];
+
+    (void)corpus;
+    sink += encode_stats(stats, REPLY_STATS, reply);
+}
+
+// Decodes the reply for the corpus's stats, as read_stats does.
+static void run_decode_stats(const Corpus *corpus, TextStatistics *stats)
+{
+    TextStatistics decoded;
+    uint8_t type;
+
+    (void)stats;
+
+    if (decode_stats(corpus->reply + REPLY_HEADER_SIZE, corpus->reply_len - REPLY_HEADER_SIZE, &decoded, &type) == -1)
+    {
+        error_exit("Reply did not decode");
+    }
+
+    sink += decoded.word_count;
+}
+
+// Feeds a stream through a receive buffer the size of the server's, parsing and
+// compacting after every fill as client_process_input does. Words are counted
+// into words and sketch, and their code points into utf8, unless they are NULL.
+static void run_parse(const uint8_t *stream, size_t length, uint8_t protocol, TextStatistics *stats, WordTable *words, WordSketch *sketch, Utf8Stats *utf8)
+{
+    static uint8_t rx_buffer[RX_BUFFER_SIZE];
+    WordParser parser;
+    size_t rx_len;
+    size_t position;
+
+    parser_init(&parser, stats, words, sketch, 0, 0);
+    parser.utf8 = utf8; // As a V2_FRAME_UTF8 request leaves it
+    rx_len = 0;
+    position = 0;
+
+    while (position < length)
+    {
+        size_t chunk;
+        size_t offset;
+
+        chunk = RX_BUFFER_SIZE - rx_len;
+
+        if (chunk > length - position)
+        {
+            chunk = length - position;
+        }
+
+        memcpy(rx_buffer + rx_len, stream + position, chunk);
+        rx_len += chunk;
+        position += chunk;
+        offset = 0;
+
+        if (parser_parse(&parser, protocol, rx_buffer, rx_len, &offset) == -1)
+        {
+            error_exit("Stream did not parse");
+        }
+
+        rx_len -= offset;
+        memmove(rx_buffer, rx_buffer + offset, rx_len);
+    }
+
+    parser_finish(&parser);
+}
+
+static void run_parse_v1(const Corpus *corpus, TextStatistics *stats)
+{
+    run_parse(corpus->v1, corpus->v1_len, PROTOCOL_V1, stats, NULL, NULL, NULL);
+}
+
+static void run_parse_v2(const Corpus *corpus, TextStatistics *stats)
+{
+    run_parse(corpus->v2 + HELLO_SIZE, corpus->v2_len - HELLO_SIZE, PROTOCOL_V2, stats, NULL, NULL, NULL);
+}
+
+// Parses as a v3 connection does, building a fresh word table each run.
+static void run_parse_v2_words(const Corpus *corpus, TextStatistics *stats)
+{
+    WordTable words;
+
+    word_table_init(&words);
+    run_parse(corpus->v2 + HELLO_SIZE, corpus->v2_len - HELLO_SIZE, PROTOCOL_V3, stats, &words, NULL, NULL);
+    sink += words.size;
+    word_table_free(&words);
+}
+
+static void run_word_table_add(const Corpus *corpus, TextStatistics *stats)
+{
+    WordTable words;
+
+    (void)stats;
+    word_table_init(&words);
+
+    for (size_t i = 0; i < corpus->word_count; i++)
+    {
+        word_table_add(&words, corpus->text + corpus->words[i].offset, corpus->words[i].length);
+    }
+
+    sink += words.size;
+    word_table_free(&words);
+}
+
+// Parses as every connection does, into a sketch that keeps filling from run to
+// run as a reactor's does.
+static void run_parse_v2_sketch(const Corpus *corpus, TextStatistics *stats)
+{
+    static WordSketch *sketch;
+
+    if (sketch == NULL && (sketch = word_sketch_create(1, 0)) == NULL)
+    {
+        error_exit("Error allocating word sketch");
+    }
+
+    run_parse(corpus->v2 + HELLO_SIZE, corpus->v2_len - HELLO_SIZE, PROTOCOL_V2, stats, NULL, sketch, NULL);
+    sink += atomic_load_explicit(&sketch->current->words, memory_order_relaxed);
+}
+
+static void run_utf8_count(const Corpus *corpus, TextStatistics *stats)
+{
+    Utf8Stats utf8;
+
+    (void)stats;
+    utf8_stats_init(&utf8);
+
+    for (size_t i = 0; i < corpus->word_count; i++)
+    {
+        utf8_count(&utf8, corpus->text + corpus->words[i].offset, corpus->words[i].length);
+        utf8_end_word(&utf8);
+    }
+
+    sink += utf8.code_points;
+    utf8_stats_free(&utf8);
+}
+
+// Parses as a v7 connection that asked for code points does.
+static void run_parse_v2_utf8(const Corpus *corpus, TextStatistics *stats)
+{
+    Utf8Stats utf8;
+
+    utf8_stats_init(&utf8);
+    run_parse(corpus->v2 + HELLO_SIZE, corpus->v2_len - HELLO_SIZE, PROTOCOL_V7, stats, NULL, NULL, &utf8);
+    sink += utf8.code_points;
+    utf8_stats_free(&utf8);
+}
+
+static size_t text_bytes(const Corpus *corpus)
+{
+    return corpus->text_len;
+}
+
+static size_t stats_bytes(const Corpus *corpus)
+{
+    (void)corpus;
+
+    return sizeof(TextStatistics);
+}
+
+static size_t reply_bytes(const Corpus *corpus)
+{
+    return corpus->reply_len;
+}
+
+static size_t v1_bytes(const Corpus *corpus)
+{
+    return corpus->v1_len;
+}
+
+static size_t v2_bytes(const Corpus *corpus)
+{
+    return corpus->v2_len - HELLO_SIZE;
+}
+
+static Sample time_runs(const Benchmark *benchmark, const Corpus *corpus, TextStatistics *stats, size_t runs)
+{
+    Sample sample;
+    uint64_t start_ns;
+    uint64_t start_cycles;
+
+    start_ns = monotonic_ns();
+    start_cycles = read_cycles();
+
+    for (size_t i = 0; i < runs; i++)
+    {
+        benchmark->run(corpus, stats);
+    }
+
+    sample.cycles_per_run = (double)(read_cycles() - start_cycles) / (double)runs;
+    sample.ns_per_run = (double)(monotonic_ns() - start_ns) / (double)runs;
+
+    return sample;
+}
+
+static void measure(const Benchmark *benchmark, const Corpus *corpus)
+{
+    TextStatistics stats;
+    Sample samples[REPETITIONS];
+    Sample median;
+    uint64_t started;
+    size_t runs;
+    double bytes;
+
+    // The stats benchmarks work on what the corpus produces, so the reply has the
+    // entries it would have for real.
+    initialize_stats_zero(&stats);
+    run_parse_v1(corpus, &stats);
+
+    started = monotonic_ns();
+    runs = 1;
+
+    // Warm up caches, branch predictors and the CPU clock, and find how many runs
+    // make a sample long enough to time reliably.
+    while (monotonic_ns() - started < WARMUP_NS)
+    {
+        if (time_runs(benchmark, corpus, &stats, runs).ns_per_run * (double)runs < SAMPLE_NS)
+        {
+            runs *= 2;
+        }
+    }
+
+    for (size_t i = 0; i < REPETITIONS; i++)
+    {
+        samples[i] = time_runs(benchmark, corpus, &stats, runs);
+    }
+
+    qsort(samples, REPETITIONS, sizeof(Sample), compare_samples);
+    median = samples[REPETITIONS / 2];
+    bytes = (double)benchmark->bytes(corpus);
+    sink += stats.word_count;
+
+    printf("  %-28s %14.1f %12.4f", benchmark->name, median.ns_per_run, median.ns_per_run / bytes);
+
+    if (benchmark->per_word && median.cycles_per_run > 0)
+    {
+        printf(" %14.2f\n", median.cycles_per_run / (double)corpus->word_count);
+    }
+    else
+    {
+        printf(" %14s\n", "-");
+    }
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+    double left;
+    double right;
+
+    left = ((const Sample *)a)->ns_per_run;
+    right = ((const Sample *)b)->ns_per_run;
+
+    return (left > right) - (left < right);
+}
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * NANOSECONDS_IN_SECOND + (uint64_t)now.tv_nsec;
+}
+
+static uint64_t read_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+_Noreturn static void error_exit(const char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+    exit(EXIT_FAILURE);
+}
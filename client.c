@@ -18,36 +18,109 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <sys/un.h>
 #include <time.h>
 
 #include "text_statistics.h"
+#include "utf8.h"
+#include "word_table.h"
 
-static void parse_arguments(int argc, char *argv[], char **ip_address, char **port, char **file_path);
-static void handle_arguments(const char *binary_name, const char *ip_address, const char *port_str, in_port_t *port, const char *file_path);
+// Length-prefixed words waiting to be sent with one write. In v2 they make up one
+// frame, whose header is written in front of the words once their count is
+// known, into the room reserved at the start of data.
+typedef struct
+{
+    uint8_t *data;
+    size_t length; // Bytes of words after the reserved header room
+    uint64_t words;
+    uint64_t started_ms; // When the oldest unsent word was added
+    uint8_t version;
+    int verbose;
+    uint64_t progress_ms; // How often to ask the server for a snapshot, or 0 for never
+    uint64_t snapshot_ms; // When the last snapshot was asked for
+    TextStatistics progress; // The snapshots so far, added up
+} WordBatch;
+
+// One connection's share of the input and the stats the server sent back for it.
+typedef struct
+{
+    struct sockaddr_storage *addr;
+    in_port_t port;
+    uint8_t max_version;
+    int verbose;
+    unsigned progress_seconds; // How often to print the server's count so far, or 0 for never
+    const char *session_key; // The session to add the upload to, or NULL
+    const char *data; // Words to send, unless fd is set
+    size_t length;
+    int fd; // Input to read words from when it could not be mapped, or -1
+    TextStatistics stats;
+    TopWords top_words;
+    int has_top_words; // The server speaks version 3 and sent its top words
+    int request_totals; // Ask for the server's totals after the words
+    TextStatistics totals;
+    int count_code_points; // Ask the server to count UTF-8 code points
+    Utf8Stats code_points;
+} Upload;
+
+static void parse_arguments(int argc, char *argv[], char **ip_address, char **port, char **unix_path, char **file_path, char **version, char **jobs, char **progress, char **session_key, int *verbose, int *totals, int *code_points);
+static void handle_arguments(const char *binary_name, const char *ip_address, const char *port_str, const char *unix_path, in_port_t *port, const char *file_path, const char *version_str, uint8_t *version, const char *jobs_str, size_t *jobs, const char *progress_str, unsigned *progress_seconds, const char *session_key);
 static in_port_t parse_in_port_t(const char *binary_name, const char *port_str);
+static uint8_t parse_protocol_version(const char *binary_name, const char *str);
+static size_t parse_jobs(const char *binary_name, const char *str);
+static unsigned parse_progress_seconds(const char *binary_name, const char *str);
 _Noreturn static void usage(const char *program_name, int exit_code, const char *message);
 static void convert_address(const char *address, struct sockaddr_storage *addr);
+static void convert_unix_address(const char *path, struct sockaddr_un *addr);
 static int socket_create(int domain, int type, int protocol);
 static void socket_connect(int sockfd, struct sockaddr_storage *addr, in_port_t port);
+static void socket_connect_unix(int sockfd, const struct sockaddr_un *addr);
 static void socket_close(int sockfd);
 // poll
-static void send_word(int sockfd, const char *word, uint8_t length);
+static uint8_t negotiate_protocol(int sockfd, uint8_t max_version);
+static void batch_init(WordBatch *batch, uint8_t version, int verbose, unsigned progress_seconds);
+static void batch_add(int sockfd, WordBatch *batch, const char *word, size_t length);
+static void batch_flush(int sockfd, WordBatch *batch);
+static void batch_snapshot(int sockfd, WordBatch *batch);
+static void send_long_word(int sockfd, const char *word, size_t length);
+static const char *next_word(const char *data, size_t length, size_t *offset, size_t *word_len);
+static void send_words(int sockfd, const char *data, size_t length, WordBatch *batch);
+static int map_input(int fd, const char **data, size_t *length);
+static void batch_wait_input(int sockfd, int fd, WordBatch *batch);
+static void send_streamed_file(int sockfd, int fd, WordBatch *batch);
+static void split_input(const char *data, size_t length, Upload *uploads, size_t jobs);
+static void *run_upload(void *arg);
+static int receive_top_words(int sockfd, TopWords *top);
+static int receive_totals(int sockfd, TextStatistics *totals);
+static int receive_code_points(int sockfd, Utf8Stats *code_points);
+static void print_top_words(const TopWords *top);
+static uint64_t monotonic_ms(void);
 _Noreturn static void error_exit(const char *msg);
 
 
 #define UNKNOWN_OPTION_MESSAGE_LEN 24
 #define BASE_TEN 10
 #define UNKNOWN_OPTION_MESSAGE_LEN 24
-#define LINE_LEN 1024
+#define BATCH_SIZE 65536 // Bytes of words per write
+#define BATCH_FLUSH_MS 50 // Longest a word waits in a batch that is not full
+#define BATCH_CLOCK_INTERVAL 256 // Words added between checks of the batch age
+#define STREAM_READ_SIZE 65536 // Bytes read at a time from input that cannot be mapped
+#define MAX_JOBS 256
+#define MAX_PROGRESS_SECONDS 3600
 #define MILLISECONDS_IN_NANOSECONDS 1000000
 #define MIN_DELAY_MILLISECONDS 500
 #define MAX_ADDITIONAL_NANOSECONDS 1000000000
@@ -56,72 +129,243 @@ int main(int argc, char *argv[])
 {
     char *address;
     char *port_str;
+    char *unix_path;
+    char *version_str;
+    char *jobs_str;
+    char *progress_str;
+    char *session_key;
     in_port_t port;
-    int sockfd;
     struct sockaddr_storage addr;
     char *file_path;
-    FILE *file;
-    char line[LINE_LEN];
-    char *saveptr;
+    int fd;
+    uint8_t max_version;
+    int verbose;
+    int totals;
+    int code_points;
+    size_t jobs;
+    unsigned progress_seconds;
+    const char *data;
+    size_t length;
+    int mapped;
+    Upload *uploads;
+    pthread_t *threads;
+    TextStatistics total;
+    TopWords top_words;
+    int has_top_words;
+    Utf8Stats total_code_points;
 
     address = NULL;
     port_str = NULL;
+    unix_path = NULL;
     file_path = NULL;
+    version_str = NULL;
+    jobs_str = NULL;
+    progress_str = NULL;
+    session_key = NULL;
+    verbose = 0;
+    totals = 0;
+    code_points = 0;
+
+    parse_arguments(argc, argv, &address, &port_str, &unix_path, &file_path, &version_str, &jobs_str, &progress_str, &session_key, &verbose, &totals, &code_points);
+    handle_arguments(argv[0], address, port_str, unix_path, &port, file_path, version_str, &max_version, jobs_str, &jobs, progress_str, &progress_seconds, session_key);
+
+    if (totals && max_version < PROTOCOL_V4)
+    {
+        usage(argv[0], EXIT_FAILURE, "Totals need protocol version 4.");
+    }
+
+    if (progress_seconds > 0 && max_version < PROTOCOL_V5)
+    {
+        usage(argv[0], EXIT_FAILURE, "Progress needs protocol version 5.");
+    }
+
+    if (session_key != NULL && max_version < PROTOCOL_V6)
+    {
+        usage(argv[0], EXIT_FAILURE, "Session keys need protocol version 6.");
+    }
+
+    if (code_points && max_version < PROTOCOL_V7)
+    {
+        usage(argv[0], EXIT_FAILURE, "Code points need protocol version 7.");
+    }
+
+    fd = open(file_path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1)
+    {
+        error_exit("Error opening file");
+    }
+
+    if (unix_path != NULL)
+    {
+        convert_unix_address(unix_path, (struct sockaddr_un *)&addr);
+    }
+    else
+    {
+        convert_address(address, &addr);
+    }
+
+    mapped = map_input(fd, &data, &length) == 0;
 
-    parse_arguments(argc, argv, &address, &port_str, &file_path);
-    handle_arguments(argv[0], address, port_str, &port, file_path);
-    file = fopen(file_path, "re");
+    if (!mapped && jobs > 1)
+    {
+        fprintf(stderr, "Input cannot be mapped, uploading it over one connection\n");
+        jobs = 1;
+    }
 
-    convert_address(address, &addr);
-    sockfd = socket_create(addr.ss_family, SOCK_STREAM, 0);
-    socket_connect(sockfd, &addr, port);
+    uploads = (Upload *)calloc(jobs, sizeof(Upload));
+    threads = (pthread_t *)calloc(jobs, sizeof(pthread_t));
+
+    if (uploads == NULL || threads == NULL)
+    {
+        error_exit("Error allocating uploads");
+    }
 
-    while (fgets(line, sizeof(line), file) != NULL)
+    for (size_t i = 0; i < jobs; i++)
     {
-        const char *word;
+        uploads[i].addr = &addr;
+        uploads[i].port = port;
+        uploads[i].max_version = max_version;
+        uploads[i].verbose = verbose;
+        uploads[i].progress_seconds = progress_seconds;
+        uploads[i].session_key = session_key;
+        uploads[i].count_code_points = code_points;
+        uploads[i].fd = mapped ? -1 : fd;
+    }
 
-        word = strtok_r(line, " \t\n", &saveptr);
+    split_input(data, length, uploads, jobs);
 
-        while (word != NULL)
+    if (jobs == 1)
+    {
+        run_upload(&uploads[0]);
+    }
+    else
+    {
+        for (size_t i = 0; i < jobs; i++)
         {
-            uint8_t size;
-            size_t word_len;
+            int result;
 
-            word_len = strlen(word);
+            result = pthread_create(&threads[i], NULL, run_upload, &uploads[i]);
 
-            if (word_len > UINT8_MAX)
+            if (result != 0)
             {
-                fprintf(stderr, "Word exceeds maximum length\n");
-                fclose(file);
-                close(sockfd);
-                exit(EXIT_FAILURE);
+                errno = result;
+                error_exit("Error creating upload thread");
             }
+        }
 
-            size = (uint8_t)word_len;
-            send_word(sockfd, word, size);
-            word = strtok_r(NULL, " \t\n", &saveptr);
+        for (size_t i = 0; i < jobs; i++)
+        {
+            pthread_join(threads[i], NULL);
         }
     }
 
-    fclose(file);
-    shutdown(sockfd, SHUT_WR); // Shutdown the write.
-    read_stats(sockfd);
+    // Each word went over exactly one connection, so the sums match a single upload.
+    initialize_stats_zero(&total);
+    top_words = (TopWords){0};
+    has_top_words = 1;
+    utf8_stats_init(&total_code_points);
 
-    socket_close(sockfd);
+    for (size_t i = 0; i < jobs; i++)
+    {
+        merge_stats(&total, &uploads[i].stats);
+        merge_top_words(&top_words, &uploads[i].top_words);
+        has_top_words = has_top_words && uploads[i].has_top_words;
+        utf8_merge(&total_code_points, &uploads[i].code_points);
+        utf8_stats_free(&uploads[i].code_points);
+    }
+
+    print_stats(&total);
+
+    if (has_top_words)
+    {
+        print_top_words(&top_words);
+    }
+
+    if (code_points)
+    {
+        print_code_points(&total_code_points);
+        utf8_stats_free(&total_code_points);
+    }
+
+    // Asked for over a connection of its own once every upload is in, so the
+    // totals include all of them.
+    if (totals)
+    {
+        Upload query = {0};
+
+        query.addr = &addr;
+        query.port = port;
+        query.max_version = max_version;
+        query.fd = -1;
+        query.request_totals = 1;
+        run_upload(&query);
+        printf("Server Totals\n");
+        print_stats(&query.totals);
+    }
+
+    if (mapped && length > 0)
+    {
+        munmap((void *)data, length);
+    }
+
+    free(threads);
+    free(uploads);
+    close(fd);
 
     return EXIT_SUCCESS;
 }
 
-static void parse_arguments(int argc, char *argv[], char **ip_address, char **port, char **file_path)
+static void parse_arguments(int argc, char *argv[], char **ip_address, char **port, char **unix_path, char **file_path, char **version, char **jobs, char **progress, char **session_key, int *verbose, int *totals, int *code_points)
 {
     int opt;
 
     opterr = 0;
 
-    while ((opt = getopt(argc, argv, "h")) != -1)
+    while ((opt = getopt(argc, argv, "hj:k:P:s:TUu:v")) != -1)
     {
         switch (opt)
         {
+        case 'T':
+        {
+            *totals = 1;
+            break;
+        }
+        case 'U':
+        {
+            *code_points = 1;
+            break;
+        }
+        case 'j':
+        {
+            *jobs = optarg;
+            break;
+        }
+        case 'k':
+        {
+            *session_key = optarg;
+            break;
+        }
+        case 'P':
+        {
+            *version = optarg;
+            break;
+        }
+        case 's':
+        {
+            *progress = optarg;
+            break;
+        }
+        case 'u':
+        {
+            *unix_path = optarg;
+            break;
+        }
+        case 'v':
+        {
+            *verbose = 1;
+            break;
+        }
         case 'h':
         {
             usage(argv[0], EXIT_SUCCESS, NULL);
@@ -140,6 +384,23 @@ static void parse_arguments(int argc, char *argv[], char **ip_address, char **po
         }
     }
 
+    // With -u the file is the only argument.
+    if (*unix_path != NULL)
+    {
+        if (optind >= argc)
+        {
+            usage(argv[0], EXIT_FAILURE, "Too few arguments.");
+        }
+
+        if (optind < argc - 1)
+        {
+            usage(argv[0], EXIT_FAILURE, "Too many arguments.");
+        }
+
+        *file_path = argv[optind];
+        return;
+    }
+
     if (optind + 1 >= argc)
     {
         usage(argv[0], EXIT_FAILURE, "Too few arguments.");
@@ -155,14 +416,22 @@ static void parse_arguments(int argc, char *argv[], char **ip_address, char **po
     *file_path = argv[optind + 2];
 }
 
-static void handle_arguments(const char *binary_name, const char *ip_address, const char *port_str, in_port_t *port, const char *file_path)
+static void handle_arguments(const char *binary_name, const char *ip_address, const char *port_str, const char *unix_path, in_port_t *port, const char *file_path, const char *version_str, uint8_t *version, const char *jobs_str, size_t *jobs, const char *progress_str, unsigned *progress_seconds, const char *session_key)
 {
-    if (ip_address == NULL)
+    if (unix_path != NULL)
+    {
+        size_t length = strlen(unix_path);
+
+        if (length == 0 || length >= sizeof(((struct sockaddr_un *)NULL)->sun_path) || strcmp(unix_path, "@") == 0)
+        {
+            usage(binary_name, EXIT_FAILURE, "The Unix socket path is empty or too long.");
+        }
+    }
+    else if (ip_address == NULL)
     {
         usage(binary_name, EXIT_FAILURE, "The ip address is required.");
     }
-
-    if (port_str == NULL)
+    else if (port_str == NULL)
     {
         usage(binary_name, EXIT_FAILURE, "The port is required.");
     }
@@ -172,7 +441,15 @@ static void handle_arguments(const char *binary_name, const char *ip_address, co
         usage(binary_name, EXIT_FAILURE, "The file path is required.");
     }
 
-    *port = parse_in_port_t(binary_name, port_str);
+    if (session_key != NULL && (strlen(session_key) == 0 || strlen(session_key) > SESSION_KEY_MAX))
+    {
+        usage(binary_name, EXIT_FAILURE, "The session key must be 1 to 32 bytes.");
+    }
+
+    *port = unix_path == NULL ? parse_in_port_t(binary_name, port_str) : 0;
+    *version = version_str == NULL ? PROTOCOL_MAX_VERSION : parse_protocol_version(binary_name, version_str);
+    *jobs = jobs_str == NULL ? 1 : parse_jobs(binary_name, jobs_str);
+    *progress_seconds = progress_str == NULL ? 0 : parse_progress_seconds(binary_name, progress_str);
 }
 
 static in_port_t parse_in_port_t(const char *binary_name, const char *str)
@@ -204,6 +481,72 @@ static in_port_t parse_in_port_t(const char *binary_name, const char *str)
     return (in_port_t)parsed_value;
 }
 
+static uint8_t parse_protocol_version(const char *binary_name, const char *str)
+{
+    char *endptr;
+    uintmax_t parsed_value;
+
+    errno = 0;
+    parsed_value = strtoumax(str, &endptr, BASE_TEN);
+
+    if (errno != 0)
+    {
+        perror("Error parsing protocol version");
+        exit(EXIT_FAILURE);
+    }
+
+    if (*endptr != '\0' || parsed_value < PROTOCOL_V1 || parsed_value > PROTOCOL_MAX_VERSION)
+    {
+        usage(binary_name, EXIT_FAILURE, "Unsupported protocol version.");
+    }
+
+    return (uint8_t)parsed_value;
+}
+
+static size_t parse_jobs(const char *binary_name, const char *str)
+{
+    char *endptr;
+    uintmax_t parsed_value;
+
+    errno = 0;
+    parsed_value = strtoumax(str, &endptr, BASE_TEN);
+
+    if (errno != 0)
+    {
+        perror("Error parsing connection count");
+        exit(EXIT_FAILURE);
+    }
+
+    if (*endptr != '\0' || parsed_value < 1 || parsed_value > MAX_JOBS)
+    {
+        usage(binary_name, EXIT_FAILURE, "Connection count must be 1 to 256.");
+    }
+
+    return (size_t)parsed_value;
+}
+
+static unsigned parse_progress_seconds(const char *binary_name, const char *str)
+{
+    char *endptr;
+    uintmax_t parsed_value;
+
+    errno = 0;
+    parsed_value = strtoumax(str, &endptr, BASE_TEN);
+
+    if (errno != 0)
+    {
+        perror("Error parsing progress interval");
+        exit(EXIT_FAILURE);
+    }
+
+    if (*endptr != '\0' || parsed_value < 1 || parsed_value > MAX_PROGRESS_SECONDS)
+    {
+        usage(binary_name, EXIT_FAILURE, "Progress interval must be 1 to 3600 seconds.");
+    }
+
+    return (unsigned)parsed_value;
+}
+
 _Noreturn static void usage(const char *program_name, int exit_code, const char *message)
 {
     if (message)
@@ -211,9 +554,17 @@ _Noreturn static void usage(const char *program_name, int exit_code, const char
         fprintf(stderr, "%s\n", message);
     }
 
-    fprintf(stderr, "Usage: %s [-h] <ip address> <port>\n", program_name);
+    fprintf(stderr, "Usage: %s [-h] [-v] [-j <connections>] [-k <key>] [-P <version>] [-s <seconds>] [-T] [-U] (<ip address> <port> | -u <path>) <file>\n", program_name);
     fputs("Options:\n", stderr);
     fputs("  -h  Display this help message\n", stderr);
+    fputs("  -v  Print every word as it is sent\n", stderr);
+    fputs("  -j <connections> the number of connections to split the file over (default 1)\n", stderr);
+    fputs("  -k <key> add the upload to this session's statistics on the server, up to 32 bytes (version 6)\n", stderr);
+    fputs("  -P <version> the highest protocol version to offer (default 7), lower for servers that predate it\n", stderr);
+    fputs("  -s <seconds> print how much the server has counted so far this often (version 5)\n", stderr);
+    fputs("  -T  Print the server's totals over every finished upload as well (version 4)\n", stderr);
+    fputs("  -U  Count UTF-8 code points as well as bytes (version 7)\n", stderr);
+    fputs("  -u <path> connect to the server's Unix socket instead, @name for an abstract one\n", stderr);
     exit(exit_code);
 }
 
@@ -236,6 +587,20 @@ static void convert_address(const char *address, struct sockaddr_storage *addr)
     }
 }
 
+// Fills addr for a filesystem socket path, or for an abstract socket if the path
+// starts with '@'.
+static void convert_unix_address(const char *path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, path, strlen(path));
+
+    if (path[0] == '@')
+    {
+        addr->sun_path[0] = '\0';
+    }
+}
+
 static int socket_create(int domain, int type, int protocol)
 {
     int sockfd;
@@ -300,6 +665,28 @@ static void socket_connect(int sockfd, struct sockaddr_storage *addr, in_port_t
     printf("Connected to: %s:%u\n", addr_str, port);
 }
 
+static void socket_connect_unix(int sockfd, const struct sockaddr_un *addr)
+{
+    int abstract = addr->sun_path[0] == '\0';
+    const char *name = abstract ? addr->sun_path + 1 : addr->sun_path;
+    socklen_t addr_len;
+
+    // An abstract name is exactly as long as the address says; it is not terminated.
+    addr_len = abstract ? (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + strlen(name)) : (socklen_t)sizeof(*addr);
+    printf("Connecting to: %s%s\n", abstract ? "@" : "", name);
+
+    if (connect(sockfd, (const struct sockaddr *)addr, addr_len) == -1)
+    {
+        const char *msg;
+
+        msg = strerror(errno);
+        fprintf(stderr, "Error: connect (%d): %s\n", errno, msg);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Connected to: %s%s\n", abstract ? "@" : "", name);
+}
+
 static void socket_close(int client_fd)
 {
     if (close(client_fd) == -1)
@@ -309,28 +696,638 @@ static void socket_close(int client_fd)
     }
 }
 
-static void send_word(int sockfd, const char *word, uint8_t length)
+// Offers protocol versions up to max_version and returns the one the server
+// picked. Version 1 needs no negotiation.
+static uint8_t negotiate_protocol(int sockfd, uint8_t max_version)
+{
+    uint8_t hello[HELLO_SIZE];
+    uint8_t reply[HELLO_REPLY_SIZE];
+    size_t reply_len;
+
+    if (max_version < PROTOCOL_V2)
+    {
+        return PROTOCOL_V1;
+    }
+
+    if (write_fully(sockfd, hello, hello_encode(hello, max_version)) != HELLO_SIZE)
+    {
+        error_exit("Error writing hello to socket");
+    }
+
+    if (read_reply(sockfd, reply, sizeof(reply), &reply_len) == -1)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    if (reply_len != 3 || reply[0] != REPLY_VERSION || reply[1] != REPLY_HELLO || reply[2] < PROTOCOL_V1 || reply[2] > max_version)
+    {
+        fprintf(stderr, "Malformed hello reply\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Using protocol version %u\n", reply[2]);
+
+    return reply[2];
+}
+
+static void batch_init(WordBatch *batch, uint8_t version, int verbose, unsigned progress_seconds)
 {
-    ssize_t written_bytes;
+    batch->data = (uint8_t *)malloc(V2_FRAME_HEADER_MAX + BATCH_SIZE);
+    batch->length = 0;
+    batch->words = 0;
+    batch->started_ms = 0;
+    batch->version = version;
+    batch->verbose = verbose;
+    batch->progress_ms = (uint64_t)progress_seconds * 1000;
+    batch->snapshot_ms = monotonic_ms();
+    initialize_stats_zero(&batch->progress);
+
+    if (batch->data == NULL)
+    {
+        error_exit("Error allocating word batch");
+    }
+}
+
+// Adds a word to the batch, sending the batch first if the word does not fit.
+// A v2 word that is longer than a whole batch goes out in a frame of its own. The
+// batch is also sent once its oldest word has waited BATCH_FLUSH_MS, so slow input
+// still reaches the server promptly.
+static void batch_add(int sockfd, WordBatch *batch, const char *word, size_t length)
+{
+    uint8_t prefix[VARINT_MAX_LEN];
+    size_t prefix_len;
+
+    if (batch->verbose)
+    {
+        printf("Client: sending word of length %zu: %.*s\n", length, (int)(length < INT_MAX ? length : INT_MAX), word);
+    }
 
-    printf("Client: sending word of length %u: %s\n", length, word);
-    written_bytes = send(sockfd, &length, sizeof(uint8_t), 0);
+    if (batch->version >= PROTOCOL_V2)
+    {
+        prefix_len = varint_encode(length, prefix);
+    }
+    else if (length > V1_MAX_WORD_LEN)
+    {
+        fprintf(stderr, "Word exceeds maximum length\n");
+        close(sockfd);
+        exit(EXIT_FAILURE);
+    }
+    else
+    {
+        prefix[0] = (uint8_t)length;
+        prefix_len = 1;
+    }
 
-    if (written_bytes < 0)
+    if (prefix_len + length > BATCH_SIZE)
     {
-        error_exit("Error writing word length to socket");
+        batch_flush(sockfd, batch);
+        send_long_word(sockfd, word, length);
+        return;
     }
 
-    if (length > 0)
+    if (batch->length + prefix_len + length > BATCH_SIZE)
     {
-        written_bytes = send(sockfd, word, length, 0);
+        batch_flush(sockfd, batch);
+    }
+
+    if (batch->words == 0)
+    {
+        batch->started_ms = monotonic_ms();
+    }
+
+    memcpy(batch->data + V2_FRAME_HEADER_MAX + batch->length, prefix, prefix_len);
+    memcpy(batch->data + V2_FRAME_HEADER_MAX + batch->length + prefix_len, word, length);
+    batch->length += prefix_len + length;
+    batch->words++;
 
-        if (written_bytes < 0)
+    if (batch->words % BATCH_CLOCK_INTERVAL == 0 && monotonic_ms() - batch->started_ms >= BATCH_FLUSH_MS)
+    {
+        batch_flush(sockfd, batch);
+    }
+}
+
+// Sends the batched words with one write, as one frame in v2, and asks for a
+// snapshot if one is due.
+static void batch_flush(int sockfd, WordBatch *batch)
+{
+    uint8_t header[V2_FRAME_HEADER_MAX];
+    size_t header_len;
+    uint8_t *frame;
+
+    if (batch->words == 0)
+    {
+        return;
+    }
+
+    header_len = 0;
+
+    if (batch->version >= PROTOCOL_V2)
+    {
+        header_len = frame_header_encode(header, V2_FRAME_WORDS, batch->words, batch->length);
+    }
+
+    frame = batch->data + V2_FRAME_HEADER_MAX - header_len;
+    memcpy(frame, header, header_len);
+
+    if (write_fully(sockfd, frame, header_len + batch->length) < 0)
+    {
+        error_exit("Error writing words to socket");
+    }
+
+    batch->length = 0;
+    batch->words = 0;
+
+    if (batch->progress_ms > 0 && monotonic_ms() - batch->snapshot_ms >= batch->progress_ms)
+    {
+        batch_snapshot(sockfd, batch);
+    }
+}
+
+// Asks the server what it has counted since the last snapshot and prints the
+// running total. The server answers once it has parsed every word sent so far,
+// so the reply is read straight away.
+static void batch_snapshot(int sockfd, WordBatch *batch)
+{
+    uint8_t request[V2_REQUEST_SIZE];
+    uint8_t body[STATS_REPLY_MAX_BODY];
+    size_t body_len;
+    TextStatistics delta;
+    uint8_t type;
+
+    if (write_fully(sockfd, request, request_encode(request, V2_FRAME_SNAPSHOT)) < 0)
+    {
+        error_exit("Error writing snapshot request to socket");
+    }
+
+    if (read_reply(sockfd, body, sizeof(body), &body_len) == -1)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    if (decode_stats(body, body_len, &delta, &type) == -1 || type != REPLY_SNAPSHOT)
+    {
+        fprintf(stderr, "Malformed snapshot reply\n");
+        exit(EXIT_FAILURE);
+    }
+
+    merge_stats(&batch->progress, &delta);
+    batch->snapshot_ms = monotonic_ms();
+    printf("Progress: %llu words, %llu characters counted\n", batch->progress.word_count, batch->progress.character_count);
+    fflush(stdout);
+}
+
+static void send_long_word(int sockfd, const char *word, size_t length)
+{
+    uint8_t header[V2_FRAME_HEADER_MAX + VARINT_MAX_LEN];
+    size_t header_len;
+    size_t prefix_len;
+
+    if (length > UINT32_MAX - V2_FRAME_HEADER_MAX - VARINT_MAX_LEN)
+    {
+        fprintf(stderr, "Word exceeds maximum length\n");
+        exit(EXIT_FAILURE);
+    }
+
+    prefix_len = varint_encode(length, header + V2_FRAME_HEADER_MAX);
+    header_len = frame_header_encode(header, V2_FRAME_WORDS, 1, prefix_len + length);
+    memmove(header + header_len, header + V2_FRAME_HEADER_MAX, prefix_len);
+
+    if (write_fully(sockfd, header, header_len + prefix_len) < 0 || write_fully(sockfd, word, length) < 0)
+    {
+        error_exit("Error writing word to socket");
+    }
+}
+
+static int is_word_delimiter(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n';
+}
+
+// Returns the next word at or after *offset as a view into data, storing its
+// length and moving *offset past it, or NULL when only delimiters are left.
+static const char *next_word(const char *data, size_t length, size_t *offset, size_t *word_len)
+{
+    size_t start;
+
+    while (*offset < length && is_word_delimiter(data[*offset]))
+    {
+        (*offset)++;
+    }
+
+    if (*offset == length)
+    {
+        return NULL;
+    }
+
+    start = *offset;
+
+    while (*offset < length && !is_word_delimiter(data[*offset]))
+    {
+        (*offset)++;
+    }
+
+    *word_len = *offset - start;
+
+    return data + start;
+}
+
+static void send_words(int sockfd, const char *data, size_t length, WordBatch *batch)
+{
+    const char *word;
+    size_t word_len;
+    size_t offset;
+
+    offset = 0;
+
+    while ((word = next_word(data, length, &offset, &word_len)) != NULL)
+    {
+        batch_add(sockfd, batch, word, word_len);
+    }
+}
+
+// Maps a regular file so it can be tokenized in place, without copying words or
+// splitting them, however large the file. An empty file gives a NULL view of
+// length 0. Returns -1 if the file cannot be mapped and has to be read instead.
+static int map_input(int fd, const char **data, size_t *length)
+{
+    struct stat file_stat;
+    void *mapping;
+
+    *data = NULL;
+    *length = 0;
+
+    if (fstat(fd, &file_stat) == -1)
+    {
+        error_exit("Error reading file status");
+    }
+
+    if (!S_ISREG(file_stat.st_mode))
+    {
+        return -1;
+    }
+
+    if (file_stat.st_size == 0)
+    {
+        return 0;
+    }
+
+    mapping = mmap(NULL, (size_t)file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (mapping == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    // Readahead can be aggressive since the file is read once, front to back.
+    madvise(mapping, (size_t)file_stat.st_size, MADV_SEQUENTIAL);
+    *data = (const char *)mapping;
+    *length = (size_t)file_stat.st_size;
+
+    return 0;
+}
+
+// Sends the batch if its oldest word would otherwise wait on input for longer
+// than BATCH_FLUSH_MS.
+static void batch_wait_input(int sockfd, int fd, WordBatch *batch)
+{
+    struct pollfd input;
+    uint64_t waited;
+
+    if (batch->words == 0)
+    {
+        return;
+    }
+
+    input.fd = fd;
+    input.events = POLLIN;
+    waited = monotonic_ms() - batch->started_ms;
+
+    if (waited >= BATCH_FLUSH_MS || poll(&input, 1, (int)(BATCH_FLUSH_MS - waited)) == 0)
+    {
+        batch_flush(sockfd, batch);
+    }
+}
+
+// Reads input that cannot be mapped, such as a pipe, as it arrives. Words are
+// sent up to the last delimiter read so far and the rest is kept, growing the
+// buffer as needed, so words are not split here either. Batched words are sent
+// before waiting long on more input, so a slow writer's words are not held up.
+static void send_streamed_file(int sockfd, int fd, WordBatch *batch)
+{
+    char *buffer;
+    size_t capacity;
+    size_t length;
+
+    capacity = STREAM_READ_SIZE;
+    length = 0;
+    buffer = (char *)malloc(capacity);
+
+    if (buffer == NULL)
+    {
+        error_exit("Error allocating read buffer");
+    }
+
+    for (;;)
+    {
+        ssize_t bytes_read;
+        size_t end;
+
+        if (length == capacity)
+        {
+            char *grown = (char *)realloc(buffer, capacity * 2);
+
+            if (grown == NULL)
+            {
+                error_exit("Error allocating read buffer");
+            }
+
+            buffer = grown;
+            capacity *= 2;
+        }
+
+        batch_wait_input(sockfd, fd, batch);
+        bytes_read = read(fd, buffer + length, capacity - length);
+
+        if (bytes_read == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            error_exit("Error reading file");
+        }
+
+        if (bytes_read == 0)
+        {
+            break;
+        }
+
+        // What was kept from before holds no delimiter, so only new bytes are searched.
+        end = length + (size_t)bytes_read;
+
+        while (end > length && !is_word_delimiter(buffer[end - 1]))
+        {
+            end--;
+        }
+
+        length += (size_t)bytes_read;
+
+        if (end > 0 && is_word_delimiter(buffer[end - 1]))
+        {
+            send_words(sockfd, buffer, end, batch);
+            memmove(buffer, buffer + end, length - end);
+            length -= end;
+        }
+    }
+
+    send_words(sockfd, buffer, length, batch);
+    free(buffer);
+}
+
+static uint64_t monotonic_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+// Cuts the input into one range per upload. Each cut is moved forward to the next
+// delimiter so no word is split between two connections.
+static void split_input(const char *data, size_t length, Upload *uploads, size_t jobs)
+{
+    size_t start;
+
+    start = 0;
+
+    for (size_t i = 0; i < jobs; i++)
+    {
+        size_t end;
+
+        end = i + 1 == jobs ? length : length / jobs * (i + 1);
+
+        if (end < start)
+        {
+            end = start;
+        }
+
+        while (end < length && !is_word_delimiter(data[end]))
+        {
+            end++;
+        }
+
+        uploads[i].data = data + start;
+        uploads[i].length = end - start;
+        start = end;
+    }
+}
+
+// Sends one upload's words over a connection of its own and reads back its stats.
+static void *run_upload(void *arg)
+{
+    Upload *upload;
+    WordBatch batch;
+    int sockfd;
+    uint8_t version;
+
+    upload = (Upload *)arg;
+    sockfd = socket_create(upload->addr->ss_family, SOCK_STREAM, 0);
+
+    if (upload->addr->ss_family == AF_UNIX)
+    {
+        socket_connect_unix(sockfd, (const struct sockaddr_un *)upload->addr);
+    }
+    else
+    {
+        socket_connect(sockfd, upload->addr, upload->port);
+    }
+    version = negotiate_protocol(sockfd, upload->max_version);
+
+    if (upload->progress_seconds > 0 && version < PROTOCOL_V5)
+    {
+        fprintf(stderr, "The server does not report progress\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (upload->session_key != NULL)
+    {
+        uint8_t frame[V2_REQUEST_SIZE + SESSION_KEY_MAX];
+
+        if (version < PROTOCOL_V6)
+        {
+            fprintf(stderr, "The server does not keep sessions\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if (write_fully(sockfd, frame, session_encode(frame, upload->session_key, strlen(upload->session_key))) < 0)
+        {
+            error_exit("Error writing session key to socket");
+        }
+    }
+
+    if (upload->count_code_points)
+    {
+        uint8_t request[V2_REQUEST_SIZE];
+
+        if (version < PROTOCOL_V7)
+        {
+            fprintf(stderr, "The server does not count code points\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if (write_fully(sockfd, request, request_encode(request, V2_FRAME_UTF8)) < 0)
+        {
+            error_exit("Error writing code points request to socket");
+        }
+    }
+
+    batch_init(&batch, version, upload->verbose, upload->progress_seconds);
+
+    if (upload->fd != -1)
+    {
+        send_streamed_file(sockfd, upload->fd, &batch);
+    }
+    else
+    {
+        send_words(sockfd, upload->data, upload->length, &batch);
+    }
+
+    batch_flush(sockfd, &batch);
+    free(batch.data);
+
+    if (upload->request_totals)
+    {
+        uint8_t request[V2_REQUEST_SIZE];
+
+        if (version < PROTOCOL_V4)
+        {
+            fprintf(stderr, "The server does not report totals\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if (write_fully(sockfd, request, request_encode(request, V2_FRAME_TOTALS)) < 0)
+        {
+            error_exit("Error writing totals request to socket");
+        }
+    }
+
+    shutdown(sockfd, SHUT_WR); // Shutdown the write.
+
+    if (receive_stats(sockfd, &upload->stats) == -1)
+    {
+        close(sockfd);
+        exit(EXIT_FAILURE);
+    }
+
+    if (version >= PROTOCOL_V3)
+    {
+        if (receive_top_words(sockfd, &upload->top_words) == -1)
         {
-            error_exit("Error writing word to socket");
+            close(sockfd);
+            exit(EXIT_FAILURE);
         }
+
+        upload->has_top_words = 1;
+    }
+
+    if (upload->count_code_points && receive_code_points(sockfd, &upload->code_points) == -1)
+    {
+        close(sockfd);
+        exit(EXIT_FAILURE);
+    }
+
+    if (upload->request_totals && receive_totals(sockfd, &upload->totals) == -1)
+    {
+        close(sockfd);
+        exit(EXIT_FAILURE);
     }
 
+    socket_close(sockfd);
+
+    return NULL;
+}
+
+// Reads a top words reply into top. Returns 0, or -1 if the connection fails or
+// the reply is malformed.
+static int receive_top_words(int sockfd, TopWords *top)
+{
+    uint8_t body[TOP_WORDS_REPLY_MAX_BODY];
+    size_t body_len;
+
+    if (read_reply(sockfd, body, sizeof(body), &body_len) == -1)
+    {
+        return -1;
+    }
+
+    if (decode_top_words(body, body_len, top) == -1)
+    {
+        fprintf(stderr, "Malformed top words reply\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Reads a totals reply into totals. Returns 0, or -1 if the connection fails or
+// the reply is malformed.
+static int receive_totals(int sockfd, TextStatistics *totals)
+{
+    uint8_t body[STATS_REPLY_MAX_BODY];
+    size_t body_len;
+    uint8_t type;
+
+    if (read_reply(sockfd, body, sizeof(body), &body_len) == -1)
+    {
+        return -1;
+    }
+
+    if (decode_stats(body, body_len, totals, &type) == -1 || type != REPLY_TOTALS)
+    {
+        fprintf(stderr, "Malformed totals reply\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Reads a code points reply and adds it to code_points. Returns 0, or -1 if the
+// connection fails or the reply is malformed.
+static int receive_code_points(int sockfd, Utf8Stats *code_points)
+{
+    uint8_t body[CODE_POINTS_REPLY_MAX_BODY];
+    size_t body_len;
+
+    if (read_reply(sockfd, body, sizeof(body), &body_len) == -1)
+    {
+        return -1;
+    }
+
+    if (decode_code_points(body, body_len, code_points) == -1)
+    {
+        fprintf(stderr, "Malformed code points reply\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void print_top_words(const TopWords *top)
+{
+    printf("Top Words (%" PRIu64 " distinct", top->distinct);
+
+    if (top->untracked > 0)
+    {
+        printf(", %" PRIu64 " not tracked", top->untracked);
+    }
+
+    printf(")\n");
+
+    for (size_t i = 0; i < top->count; i++)
+    {
+        printf("Word: %.*s Count: %" PRIu64 "\n", (int)top->words[i].length, top->words[i].word, top->words[i].count);
+    }
 }
 
 _Noreturn static void error_exit(const char *msg)
@@ -0,0 +1,199 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Case-folded byte histogram over whole buffers.
+//
+// Counting a byte into a single table is a load, an increment and a store to the
+// same slot, so a run of repeated letters serialises on store-to-load forwarding.
+// The kernel spreads consecutive bytes over HISTOGRAM_LANES tables of 32-bit
+// counters and sums them into the caller's 64-bit table at the end. Case folding
+// is done a block at a time before counting, with AVX2 or SSE2 where the CPU has
+// them and with a lookup table otherwise.
+
+#define HISTOGRAM_LANES 4
+#define HISTOGRAM_BLOCK 1024        // Bytes folded per pass, kept hot in L1
+#define HISTOGRAM_SMALL_INPUT 512   // Below this, clearing and merging the lanes costs more than it saves
+#define HISTOGRAM_FLUSH (1UL << 30) // Bytes counted before the lanes are merged, far from 32-bit overflow
+
+// Maps every byte to tolower() of it in the "C" locale, which neither program changes.
+static const uint8_t case_fold_table[256] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f,
+    0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f,
+    0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f,
+    0x40, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f,
+    0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x5b, 0x5c, 0x5d, 0x5e, 0x5f,
+    0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f,
+    0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x7b, 0x7c, 0x7d, 0x7e, 0x7f,
+    0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x8b, 0x8c, 0x8d, 0x8e, 0x8f,
+    0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0x9b, 0x9c, 0x9d, 0x9e, 0x9f,
+    0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xab, 0xac, 0xad, 0xae, 0xaf,
+    0xb0, 0xb1, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xbb, 0xbc, 0xbd, 0xbe, 0xbf,
+    0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xcb, 0xcc, 0xcd, 0xce, 0xcf,
+    0xd0, 0xd1, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xdb, 0xdc, 0xdd, 0xde, 0xdf,
+    0xe0, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xeb, 0xec, 0xed, 0xee, 0xef,
+    0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff,
+};
+
+typedef void (*HistogramFold)(const uint8_t *source, uint8_t *folded, size_t length);
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+
+// Reference path: folds and counts one byte at a time straight into frequency.
+static void histogram_count_scalar(const uint8_t *data, size_t length, unsigned long long *frequency)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        frequency[case_fold_table[data[i]]]++;
+    }
+}
+
+static void histogram_fold_table(const uint8_t *source, uint8_t *folded, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        folded[i] = case_fold_table[source[i]];
+    }
+}
+
+#if defined(__x86_64__)
+// 'A'..'Z' are the only bytes tolower() changes. Shifting them to 0x80..0x99 lets
+// one signed compare pick them out; those bytes get 0x20 added by setting bit 5.
+static void histogram_fold_sse2(const uint8_t *source, uint8_t *folded, size_t length)
+{
+    const __m128i shift = _mm_set1_epi8((char)(0x80 - 'A'));
+    const __m128i limit = _mm_set1_epi8((char)(0x80 + 26));
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(source + i));
+        __m128i upper = _mm_cmplt_epi8(_mm_add_epi8(bytes, shift), limit);
+
+        _mm_storeu_si128((__m128i *)(folded + i), _mm_or_si128(bytes, _mm_and_si128(upper, case_bit)));
+    }
+
+    histogram_fold_table(source + i, folded + i, length - i);
+}
+
+__attribute__((target("avx2"))) static void histogram_fold_avx2(const uint8_t *source, uint8_t *folded, size_t length)
+{
+    const __m256i shift = _mm256_set1_epi8((char)(0x80 - 'A'));
+    const __m256i limit = _mm256_set1_epi8((char)(0x80 + 26));
+    const __m256i case_bit = _mm256_set1_epi8(0x20);
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)(source + i));
+        __m256i upper = _mm256_cmpgt_epi8(limit, _mm256_add_epi8(bytes, shift));
+
+        _mm256_storeu_si256((__m256i *)(folded + i), _mm256_or_si256(bytes, _mm256_and_si256(upper, case_bit)));
+    }
+
+    histogram_fold_sse2(source + i, folded + i, length - i);
+}
+#endif
+
+// Picks the widest fold the CPU supports.
+static HistogramFold histogram_select_fold(void)
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return histogram_fold_avx2;
+    }
+
+    return histogram_fold_sse2;
+#else
+    return histogram_fold_table;
+#endif
+}
+
+// Counts already folded bytes, eight at a time, into the interleaved lanes.
+static void histogram_count_lanes(const uint8_t *folded, size_t length, uint32_t lanes[HISTOGRAM_LANES][256])
+{
+    size_t i = 0;
+
+    for (; i + 8 <= length; i += 8)
+    {
+        uint64_t bytes;
+
+        memcpy(&bytes, folded + i, sizeof(bytes));
+        lanes[0][bytes & 0xff]++;
+        lanes[1][(bytes >> 8) & 0xff]++;
+        lanes[2][(bytes >> 16) & 0xff]++;
+        lanes[3][(bytes >> 24) & 0xff]++;
+        lanes[0][(bytes >> 32) & 0xff]++;
+        lanes[1][(bytes >> 40) & 0xff]++;
+        lanes[2][(bytes >> 48) & 0xff]++;
+        lanes[3][bytes >> 56]++;
+    }
+
+    for (; i < length; i++)
+    {
+        lanes[i % HISTOGRAM_LANES][folded[i]]++;
+    }
+}
+
+static void histogram_merge_lanes(uint32_t lanes[HISTOGRAM_LANES][256], unsigned long long *frequency)
+{
+    for (int i = 0; i < 256; i++)
+    {
+        frequency[i] += (unsigned long long)lanes[0][i] + lanes[1][i] + lanes[2][i] + lanes[3][i];
+    }
+
+    memset(lanes, 0, sizeof(uint32_t) * HISTOGRAM_LANES * 256);
+}
+
+// Adds the case-folded byte counts of data to frequency. Gives exactly the same
+// counts as histogram_count_scalar.
+static void histogram_count(const uint8_t *data, size_t length, unsigned long long *frequency)
+{
+    uint32_t lanes[HISTOGRAM_LANES][256];
+    uint8_t folded[HISTOGRAM_BLOCK];
+    HistogramFold fold;
+    size_t unmerged = 0;
+
+    if (length < HISTOGRAM_SMALL_INPUT)
+    {
+        histogram_count_scalar(data, length, frequency);
+        return;
+    }
+
+    fold = histogram_select_fold();
+    memset(lanes, 0, sizeof(lanes));
+
+    while (length > 0)
+    {
+        size_t chunk = length < HISTOGRAM_BLOCK ? length : HISTOGRAM_BLOCK;
+
+        fold(data, folded, chunk);
+        histogram_count_lanes(folded, chunk, lanes);
+        data += chunk;
+        length -= chunk;
+        unmerged += chunk;
+
+        if (unmerged >= HISTOGRAM_FLUSH)
+        {
+            histogram_merge_lanes(lanes, frequency);
+            unmerged = 0;
+        }
+    }
+
+    histogram_merge_lanes(lanes, frequency);
+}
+
+#pragma GCC diagnostic pop
+
+#endif
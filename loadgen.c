@@ -0,0 +1,1080 @@
+/*
+ * This code is licensed under the Attribution-NonCommercial-NoDerivatives 4.0 International license.
+ *
+ * Authors:
+ * D'Arcy Smith (ds@programming101.dev)
+ * Aryan Jand (aryan_jand@bcit.ca)
+ *
+ * You are free to:
+ *   - Share: Copy and redistribute the material in any medium or format.
+ *   - Under the following terms:
+ *       - Attribution: You must give appropriate credit, provide a link to the license, and indicate if changes were made.
+ *       - NonCommercial: You may not use the material for commercial purposes.
+ *       - NoDerivatives: If you remix, transform, or build upon the material, you may not distribute the modified material.
+ *
+ * For more details, please refer to the full license text at:
+ * https://creativecommons.org/licenses/by-nc-nd/4.0/
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "text_statistics.h"
+
+// Load generator for the server. Each thread keeps its share of the connections
+// open at once on an epoll loop. Every connection uploads a freshly drawn set of
+// words, shuts down its write side and waits for the stats reply, which is
+// checked against the words sent. When a connection finishes, another one takes
+// its place, until the run is over.
+
+typedef enum
+{
+    WORD_SIZES_FIXED,
+    WORD_SIZES_UNIFORM,
+    WORD_SIZES_EXPONENTIAL
+} WordSizeKind;
+
+typedef struct
+{
+    WordSizeKind kind;
+    size_t min;
+    size_t max;
+    double mean;
+} WordSizes;
+
+typedef struct
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    size_t connections;
+    size_t threads;
+    unsigned int duration;
+    size_t words;
+    WordSizes sizes;
+    unsigned int abort_percent;
+    uint8_t version;
+    const char *text; // Random word bytes that words are cut from
+    size_t text_len;
+} LoadConfig;
+
+typedef enum
+{
+    CONNECTION_IDLE,
+    CONNECTION_CONNECTING,
+    CONNECTION_SENDING,
+    CONNECTION_READING
+} ConnectionState;
+
+typedef struct
+{
+    int fd;
+    ConnectionState state;
+    uint8_t *payload;
+    size_t payload_len;
+    size_t payload_capacity;
+    size_t sent;
+    size_t abort_at; // Bytes sent before the connection is reset, or 0 to finish
+    uint8_t rx[HELLO_REPLY_SIZE + STATS_REPLY_MAX_SIZE];
+    size_t rx_len;
+    uint64_t words;
+    uint64_t shutdown_ns;
+} Connection;
+
+typedef struct
+{
+    const LoadConfig *config;
+    size_t connection_count;
+    uint64_t random_state;
+    uint64_t deadline_ns;
+    uint64_t established;
+    uint64_t completed;
+    uint64_t aborted;
+    uint64_t failed;
+    uint64_t words;
+    uint64_t bytes;
+    uint64_t *latencies; // Shutdown to stats reply, in nanoseconds
+    size_t latency_count;
+    size_t latency_capacity;
+} Worker;
+
+static void parse_arguments(int argc, char *argv[], LoadConfig *config, char **address, char **port);
+static size_t parse_count(const char *binary_name, const char *str, size_t max, const char *message);
+static void parse_word_sizes(const char *binary_name, const char *str, WordSizes *sizes);
+_Noreturn static void usage(const char *program_name, int exit_code, const char *message);
+static void convert_address(const char *address, const char *port_str, LoadConfig *config);
+static void raise_fd_limit(size_t connections);
+static char *generate_text(size_t length);
+static uint64_t next_random(uint64_t *state);
+static size_t draw_word_size(const WordSizes *sizes, uint64_t *state);
+static void payload_reserve(Connection *connection, size_t extra);
+static void payload_append(Connection *connection, const void *data, size_t length);
+static void build_payload(Worker *worker, Connection *connection);
+static int connection_start(Worker *worker, int epoll_fd, Connection *connection);
+static int connection_handle(Worker *worker, int epoll_fd, Connection *connection, uint32_t events);
+static int connection_send(Worker *worker, int epoll_fd, Connection *connection);
+static int connection_receive(Worker *worker, Connection *connection);
+static void connection_reset(Connection *connection);
+static void connection_close(Connection *connection);
+static void record_latency(Worker *worker, uint64_t latency);
+static void *run_worker(void *arg);
+static int compare_u64(const void *a, const void *b);
+static double percentile_us(const uint64_t *sorted, size_t count, double fraction);
+static uint64_t monotonic_ns(void);
+_Noreturn static void error_exit(const char *msg);
+
+#define UNKNOWN_OPTION_MESSAGE_LEN 24
+#define BASE_TEN 10
+#define DEFAULT_CONNECTIONS 1000
+#define DEFAULT_THREADS 4
+#define DEFAULT_DURATION 10
+#define DEFAULT_WORDS 100
+#define MAX_THREADS 256
+#define MAX_CONNECTIONS 1000000
+#define TEXT_SIZE (1 << 20) // Random bytes that words are cut from, and the longest word
+#define FRAME_SIZE 65536 // Bytes of words per v2 frame
+#define MAX_EPOLL_EVENTS 256
+#define EPOLL_TIMEOUT_MS 100
+#define DRAIN_TIMEOUT_NS (5ULL * 1000000000ULL) // How long in-flight uploads get after the run
+#define NANOSECONDS_IN_SECOND 1000000000ULL
+
+#define CONNECTION_BUSY 0
+#define CONNECTION_DONE 1
+#define CONNECTION_ABORTED 2
+#define CONNECTION_FAILED 3
+
+int main(int argc, char *argv[])
+{
+    LoadConfig config;
+    char *address;
+    char *port;
+    Worker *workers;
+    pthread_t *threads;
+    uint64_t started_ns;
+    double elapsed;
+    Worker total;
+    uint64_t *latencies;
+
+    address = NULL;
+    port = NULL;
+    memset(&config, 0, sizeof(config));
+    config.connections = DEFAULT_CONNECTIONS;
+    config.threads = DEFAULT_THREADS;
+    config.duration = DEFAULT_DURATION;
+    config.words = DEFAULT_WORDS;
+    config.sizes.kind = WORD_SIZES_UNIFORM;
+    config.sizes.min = 1;
+    config.sizes.max = 12;
+    config.version = PROTOCOL_MAX_VERSION;
+
+    parse_arguments(argc, argv, &config, &address, &port);
+    convert_address(address, port, &config);
+
+    if (config.version < PROTOCOL_V2 && config.sizes.max > V1_MAX_WORD_LEN)
+    {
+        usage(argv[0], EXIT_FAILURE, "Protocol version 1 cannot send words longer than 255 bytes.");
+    }
+
+    if (config.threads > config.connections)
+    {
+        config.threads = config.connections;
+    }
+
+    raise_fd_limit(config.connections);
+    config.text_len = TEXT_SIZE;
+    config.text = generate_text(config.text_len);
+    workers = (Worker *)calloc(config.threads, sizeof(Worker));
+    threads = (pthread_t *)calloc(config.threads, sizeof(pthread_t));
+
+    if (workers == NULL || threads == NULL)
+    {
+        error_exit("Error allocating workers");
+    }
+
+    printf("Running %zu connections on %zu threads for %u s, %zu words each, protocol %u\n", config.connections, config.threads, config.duration, config.words, config.version);
+    started_ns = monotonic_ns();
+
+    for (size_t i = 0; i < config.threads; i++)
+    {
+        int result;
+
+        workers[i].config = &config;
+        workers[i].connection_count = config.connections / config.threads + (i < config.connections % config.threads);
+        workers[i].random_state = started_ns ^ ((uint64_t)(i + 1) * 0x9e3779b97f4a7c15ULL);
+        workers[i].deadline_ns = started_ns + (uint64_t)config.duration * NANOSECONDS_IN_SECOND;
+        result = pthread_create(&threads[i], NULL, run_worker, &workers[i]);
+
+        if (result != 0)
+        {
+            errno = result;
+            error_exit("Error creating worker thread");
+        }
+    }
+
+    memset(&total, 0, sizeof(total));
+
+    for (size_t i = 0; i < config.threads; i++)
+    {
+        pthread_join(threads[i], NULL);
+        total.established += workers[i].established;
+        total.completed += workers[i].completed;
+        total.aborted += workers[i].aborted;
+        total.failed += workers[i].failed;
+        total.words += workers[i].words;
+        total.bytes += workers[i].bytes;
+        total.latency_count += workers[i].latency_count;
+    }
+
+    elapsed = (double)(monotonic_ns() - started_ns) / NANOSECONDS_IN_SECOND;
+    latencies = (uint64_t *)malloc((total.latency_count + 1) * sizeof(uint64_t));
+
+    if (latencies == NULL)
+    {
+        error_exit("Error allocating latencies");
+    }
+
+    total.latency_count = 0;
+
+    for (size_t i = 0; i < config.threads; i++)
+    {
+        memcpy(latencies + total.latency_count, workers[i].latencies, workers[i].latency_count * sizeof(uint64_t));
+        total.latency_count += workers[i].latency_count;
+        free(workers[i].latencies);
+    }
+
+    qsort(latencies, total.latency_count, sizeof(uint64_t), compare_u64);
+
+    printf("Elapsed: %.2f s\n", elapsed);
+    printf("Connections: %" PRIu64 " established, %" PRIu64 " completed, %" PRIu64 " aborted, %" PRIu64 " failed\n", total.established, total.completed, total.aborted, total.failed);
+    printf("Connection rate: %.0f/s\n", (double)total.established / elapsed);
+    printf("Words: %.0f/s\n", (double)total.words / elapsed);
+    printf("Bytes: %.2f MB/s\n", (double)total.bytes / elapsed / 1e6);
+    printf("Reply latency: p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us\n",
+           percentile_us(latencies, total.latency_count, 0.5),
+           percentile_us(latencies, total.latency_count, 0.99),
+           percentile_us(latencies, total.latency_count, 0.999),
+           percentile_us(latencies, total.latency_count, 1.0));
+
+    free(latencies);
+    free(threads);
+    free(workers);
+    free((void *)config.text);
+
+    return total.failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void parse_arguments(int argc, char *argv[], LoadConfig *config, char **address, char **port)
+{
+    int opt;
+
+    opterr = 0;
+
+    while ((opt = getopt(argc, argv, "hc:t:d:w:s:a:P:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+        {
+            config->connections = parse_count(argv[0], optarg, MAX_CONNECTIONS, "Connection count must be 1 to 1000000.");
+            break;
+        }
+        case 't':
+        {
+            config->threads = parse_count(argv[0], optarg, MAX_THREADS, "Thread count must be 1 to 256.");
+            break;
+        }
+        case 'd':
+        {
+            config->duration = (unsigned int)parse_count(argv[0], optarg, UINT32_MAX, "Duration must be at least 1 second.");
+            break;
+        }
+        case 'w':
+        {
+            config->words = parse_count(argv[0], optarg, SIZE_MAX, "Words per connection must be at least 1.");
+            break;
+        }
+        case 's':
+        {
+            parse_word_sizes(argv[0], optarg, &config->sizes);
+            break;
+        }
+        case 'a':
+        {
+            config->abort_percent = (unsigned int)parse_count(argv[0], optarg, 100, "Abort percentage must be 1 to 100.");
+            break;
+        }
+        case 'P':
+        {
+            config->version = (uint8_t)parse_count(argv[0], optarg, PROTOCOL_MAX_VERSION, "Unsupported protocol version.");
+            break;
+        }
+        case 'h':
+        {
+            usage(argv[0], EXIT_SUCCESS, NULL);
+        }
+        case '?':
+        {
+            char message[UNKNOWN_OPTION_MESSAGE_LEN];
+
+            snprintf(message, sizeof(message), "Unknown option '-%c'.", optopt);
+            usage(argv[0], EXIT_FAILURE, message);
+        }
+        default:
+        {
+            usage(argv[0], EXIT_FAILURE, NULL);
+        }
+        }
+    }
+
+    if (optind + 1 >= argc)
+    {
+        usage(argv[0], EXIT_FAILURE, "Too few arguments.");
+    }
+
+    if (optind < argc - 2)
+    {
+        usage(argv[0], EXIT_FAILURE, "Too many arguments.");
+    }
+
+    *address = argv[optind];
+    *port = argv[optind + 1];
+}
+
+static size_t parse_count(const char *binary_name, const char *str, size_t max, const char *message)
+{
+    char *endptr;
+    uintmax_t parsed_value;
+
+    errno = 0;
+    parsed_value = strtoumax(str, &endptr, BASE_TEN);
+
+    if (errno != 0 || *endptr != '\0' || parsed_value < 1 || parsed_value > max)
+    {
+        usage(binary_name, EXIT_FAILURE, message);
+    }
+
+    return (size_t)parsed_value;
+}
+
+// Accepts fixed:<size>, uniform:<min>:<max> or exp:<mean>.
+static void parse_word_sizes(const char *binary_name, const char *str, WordSizes *sizes)
+{
+    unsigned long min;
+    unsigned long max;
+    double mean;
+    int consumed;
+
+    consumed = 0;
+
+    if (sscanf(str, "fixed:%lu%n", &min, &consumed) == 1 && str[consumed] == '\0' && min >= 1)
+    {
+        sizes->kind = WORD_SIZES_FIXED;
+        sizes->min = min;
+        sizes->max = min;
+    }
+    else if (sscanf(str, "uniform:%lu:%lu%n", &min, &max, &consumed) == 2 && str[consumed] == '\0' && min >= 1 && min <= max)
+    {
+        sizes->kind = WORD_SIZES_UNIFORM;
+        sizes->min = min;
+        sizes->max = max;
+    }
+    else if (sscanf(str, "exp:%lf%n", &mean, &consumed) == 1 && str[consumed] == '\0' && mean >= 1.0)
+    {
+        sizes->kind = WORD_SIZES_EXPONENTIAL;
+        sizes->min = 1;
+        sizes->max = TEXT_SIZE;
+        sizes->mean = mean;
+    }
+    else
+    {
+        usage(binary_name, EXIT_FAILURE, "Word sizes must be fixed:<size>, uniform:<min>:<max> or exp:<mean>.");
+    }
+
+    if (sizes->max > TEXT_SIZE)
+    {
+        usage(binary_name, EXIT_FAILURE, "Words can be at most 1 MiB.");
+    }
+}
+
+_Noreturn static void usage(const char *program_name, int exit_code, const char *message)
+{
+    if (message)
+    {
+        fprintf(stderr, "%s\n", message);
+    }
+
+    fprintf(stderr, "Usage: %s [-h] [-c <connections>] [-t <threads>] [-d <seconds>] [-w <words>] [-s <sizes>] [-a <percent>] [-P <version>] <ip address> <port>\n", program_name);
+    fputs("Options:\n", stderr);
+    fputs("  -h  Display this help message\n", stderr);
+    fputs("  -c <connections> the number of connections kept open at once (default 1000)\n", stderr);
+    fputs("  -t <threads> the number of threads the connections are spread over (default 4)\n", stderr);
+    fputs("  -d <seconds> how long to keep starting new connections (default 10)\n", stderr);
+    fputs("  -w <words> the number of words each connection uploads (default 100)\n", stderr);
+    fputs("  -s <sizes> the word size distribution: fixed:<size>, uniform:<min>:<max> or exp:<mean> (default uniform:1:12)\n", stderr);
+    fputs("  -a <percent> the share of connections reset halfway through their upload (default 0)\n", stderr);
+    fputs("  -P <version> the protocol version to use (default 7)\n", stderr);
+    exit(exit_code);
+}
+
+static void convert_address(const char *address, const char *port_str, LoadConfig *config)
+{
+    struct sockaddr_storage *addr;
+    in_port_t port;
+
+    port = (in_port_t)parse_count("loadgen", port_str, UINT16_MAX, "Port must be 1 to 65535.");
+    addr = &config->addr;
+    memset(addr, 0, sizeof(*addr));
+
+    if (inet_pton(AF_INET, address, &(((struct sockaddr_in *)addr)->sin_addr)) == 1)
+    {
+        addr->ss_family = AF_INET;
+        ((struct sockaddr_in *)addr)->sin_port = htons(port);
+        config->addr_len = sizeof(struct sockaddr_in);
+    }
+    else if (inet_pton(AF_INET6, address, &(((struct sockaddr_in6 *)addr)->sin6_addr)) == 1)
+    {
+        addr->ss_family = AF_INET6;
+        ((struct sockaddr_in6 *)addr)->sin6_port = htons(port);
+        config->addr_len = sizeof(struct sockaddr_in6);
+    }
+    else
+    {
+        fprintf(stderr, "%s is not an IPv4 or an IPv6 address\n", address);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Thousands of connections need more descriptors than the usual soft limit.
+static void raise_fd_limit(size_t connections)
+{
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1)
+    {
+        error_exit("Error reading the file descriptor limit");
+    }
+
+    if (limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+
+        if (setrlimit(RLIMIT_NOFILE, &limit) == -1)
+        {
+            perror("Error raising the file descriptor limit");
+        }
+    }
+
+    if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < connections + 64)
+    {
+        fprintf(stderr, "Warning: the file descriptor limit of %llu is too low for %zu connections\n", (unsigned long long)limit.rlim_cur, connections);
+    }
+}
+
+// Words are cut from a block of random letters, digits and punctuation. It holds
+// no delimiters, like the words the client sends.
+static char *generate_text(size_t length)
+{
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789.,;:'!?-";
+    uint64_t state;
+    char *text;
+
+    text = (char *)malloc(length);
+    state = monotonic_ns() | 1;
+
+    if (text == NULL)
+    {
+        error_exit("Error allocating word text");
+    }
+
+    for (size_t i = 0; i < length; i++)
+    {
+        text[i] = alphabet[next_random(&state) % (sizeof(alphabet) - 1)];
+    }
+
+    return text;
+}
+
+// xorshift64*, which is plenty for picking word sizes and offsets.
+static uint64_t next_random(uint64_t *state)
+{
+    uint64_t x;
+
+    x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+static size_t draw_word_size(const WordSizes *sizes, uint64_t *state)
+{
+    double uniform;
+    double size;
+
+    switch (sizes->kind)
+    {
+    case WORD_SIZES_FIXED:
+    {
+        return sizes->min;
+    }
+    case WORD_SIZES_UNIFORM:
+    {
+        return sizes->min + next_random(state) % (sizes->max - sizes->min + 1);
+    }
+    case WORD_SIZES_EXPONENTIAL:
+    default:
+    {
+        // Inverse transform of a uniform draw in (0, 1].
+        uniform = (double)((next_random(state) >> 11) + 1) / (double)(1ULL << 53);
+        size = 1.0 - sizes->mean * log(uniform);
+
+        return size >= (double)sizes->max ? sizes->max : (size_t)size;
+    }
+    }
+}
+
+static void payload_reserve(Connection *connection, size_t extra)
+{
+    size_t capacity;
+    uint8_t *payload;
+
+    if (connection->payload_len + extra <= connection->payload_capacity)
+    {
+        return;
+    }
+
+    capacity = connection->payload_capacity == 0 ? 4096 : connection->payload_capacity;
+
+    while (capacity < connection->payload_len + extra)
+    {
+        capacity *= 2;
+    }
+
+    payload = (uint8_t *)realloc(connection->payload, capacity);
+
+    if (payload == NULL)
+    {
+        error_exit("Error allocating payload");
+    }
+
+    connection->payload = payload;
+    connection->payload_capacity = capacity;
+}
+
+static void payload_append(Connection *connection, const void *data, size_t length)
+{
+    payload_reserve(connection, length);
+    memcpy(connection->payload + connection->payload_len, data, length);
+    connection->payload_len += length;
+}
+
+// Draws the words for one upload and encodes them the way the client would: a
+// hello and frames of up to FRAME_SIZE bytes in v2, length-prefixed words in v1.
+static void build_payload(Worker *worker, Connection *connection)
+{
+    const LoadConfig *config;
+    size_t frame_start;
+    uint64_t frame_words;
+
+    config = worker->config;
+    connection->payload_len = 0;
+    connection->words = config->words;
+    frame_start = 0;
+    frame_words = 0;
+
+    if (config->version >= PROTOCOL_V2)
+    {
+        uint8_t hello[HELLO_SIZE];
+
+        payload_append(connection, hello, hello_encode(hello, config->version));
+    }
+
+    for (size_t i = 0; i <= config->words; i++)
+    {
+        size_t word_len;
+        const char *word;
+        uint8_t prefix[VARINT_MAX_LEN];
+        size_t prefix_len;
+
+        // Close the current frame when it is full or the words have run out.
+        if (config->version >= PROTOCOL_V2 && frame_words > 0 && (i == config->words || connection->payload_len - frame_start - V2_FRAME_HEADER_MAX >= FRAME_SIZE))
+        {
+            uint8_t header[V2_FRAME_HEADER_MAX];
+            size_t header_len;
+            size_t words_len;
+
+            words_len = connection->payload_len - frame_start - V2_FRAME_HEADER_MAX;
+            header_len = frame_header_encode(header, V2_FRAME_WORDS, frame_words, words_len);
+            memcpy(connection->payload + frame_start, header, header_len);
+            memmove(connection->payload + frame_start + header_len, connection->payload + frame_start + V2_FRAME_HEADER_MAX, words_len);
+            connection->payload_len = frame_start + header_len + words_len;
+            frame_words = 0;
+        }
+
+        if (i == config->words)
+        {
+            break;
+        }
+
+        if (config->version >= PROTOCOL_V2 && frame_words == 0)
+        {
+            frame_start = connection->payload_len;
+            payload_reserve(connection, V2_FRAME_HEADER_MAX);
+            connection->payload_len += V2_FRAME_HEADER_MAX;
+        }
+
+        word_len = draw_word_size(&config->sizes, &worker->random_state);
+        word = config->text + next_random(&worker->random_state) % (config->text_len - word_len + 1);
+
+        if (config->version >= PROTOCOL_V2)
+        {
+            prefix_len = varint_encode(word_len, prefix);
+        }
+        else
+        {
+            prefix[0] = (uint8_t)word_len;
+            prefix_len = 1;
+        }
+
+        payload_append(connection, prefix, prefix_len);
+        payload_append(connection, word, word_len);
+        frame_words++;
+    }
+}
+
+// Opens a non-blocking connection for a new upload. Returns 0, or -1 if no socket
+// could be started, in which case the slot is tried again later.
+static int connection_start(Worker *worker, int epoll_fd, Connection *connection)
+{
+    struct epoll_event event;
+
+    connection_reset(connection);
+    connection->fd = socket(worker->config->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (connection->fd == -1)
+    {
+        return -1;
+    }
+
+    build_payload(worker, connection);
+
+    if (worker->config->abort_percent > 0 && next_random(&worker->random_state) % 100 < worker->config->abort_percent)
+    {
+        connection->abort_at = connection->payload_len / 2 + 1;
+    }
+
+    if (connect(connection->fd, (const struct sockaddr *)&worker->config->addr, worker->config->addr_len) == -1 && errno != EINPROGRESS)
+    {
+        connection_close(connection);
+        return -1;
+    }
+
+    connection->state = CONNECTION_CONNECTING;
+    event.events = EPOLLOUT;
+    event.data.ptr = connection;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connection->fd, &event) == -1)
+    {
+        error_exit("Error adding connection to epoll");
+    }
+
+    return 0;
+}
+
+// Moves a connection along. Returns CONNECTION_BUSY while it has more to do.
+static int connection_handle(Worker *worker, int epoll_fd, Connection *connection, uint32_t events)
+{
+    if (connection->state == CONNECTION_CONNECTING)
+    {
+        int error;
+        socklen_t error_len;
+
+        error = 0;
+        error_len = sizeof(error);
+
+        if (getsockopt(connection->fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == -1 || error != 0)
+        {
+            return CONNECTION_FAILED;
+        }
+
+        worker->established++;
+        connection->state = CONNECTION_SENDING;
+    }
+
+    if (connection->state == CONNECTION_SENDING)
+    {
+        return connection_send(worker, epoll_fd, connection);
+    }
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+    {
+        return connection_receive(worker, connection);
+    }
+
+    return CONNECTION_BUSY;
+}
+
+static int connection_send(Worker *worker, int epoll_fd, Connection *connection)
+{
+    struct epoll_event event;
+    size_t limit;
+
+    limit = connection->abort_at != 0 ? connection->abort_at : connection->payload_len;
+
+    while (connection->sent < limit)
+    {
+        ssize_t sent;
+
+        sent = send(connection->fd, connection->payload + connection->sent, limit - connection->sent, MSG_NOSIGNAL);
+
+        if (sent == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return CONNECTION_BUSY;
+            }
+
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return CONNECTION_FAILED;
+        }
+
+        connection->sent += (size_t)sent;
+    }
+
+    if (connection->abort_at != 0)
+    {
+        struct linger linger;
+
+        // A zero linger time makes close() send a reset, as a crashed client would.
+        linger.l_onoff = 1;
+        linger.l_linger = 0;
+        setsockopt(connection->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+
+        return CONNECTION_ABORTED;
+    }
+
+    shutdown(connection->fd, SHUT_WR);
+    connection->shutdown_ns = monotonic_ns();
+    connection->state = CONNECTION_READING;
+    event.events = EPOLLIN;
+    event.data.ptr = connection;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->fd, &event) == -1)
+    {
+        error_exit("Error modifying connection in epoll");
+    }
+
+    worker->bytes += connection->payload_len;
+
+    return CONNECTION_BUSY;
+}
+
+// Reads replies until the stats reply is complete, then checks it against the
+// upload. In v2 a hello reply comes first.
+static int connection_receive(Worker *worker, Connection *connection)
+{
+    for (;;)
+    {
+        ssize_t received;
+
+        received = recv(connection->fd, connection->rx + connection->rx_len, sizeof(connection->rx) - connection->rx_len, 0);
+
+        if (received == -1)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return CONNECTION_BUSY;
+            }
+
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return CONNECTION_FAILED;
+        }
+
+        if (received == 0)
+        {
+            return CONNECTION_FAILED;
+        }
+
+        connection->rx_len += (size_t)received;
+
+        while (connection->rx_len >= REPLY_HEADER_SIZE)
+        {
+            TextStatistics stats;
+            size_t reply_len;
+            uint8_t type;
+
+            reply_len = REPLY_HEADER_SIZE + get_u32_be(connection->rx);
+
+            if (reply_len > sizeof(connection->rx))
+            {
+                return CONNECTION_FAILED;
+            }
+
+            if (connection->rx_len < reply_len)
+            {
+                break;
+            }
+
+            if (reply_len >= REPLY_HEADER_SIZE + 2 && connection->rx[REPLY_HEADER_SIZE + 1] == REPLY_HELLO)
+            {
+                memmove(connection->rx, connection->rx + reply_len, connection->rx_len - reply_len);
+                connection->rx_len -= reply_len;
+                continue;
+            }
+
+            if (decode_stats(connection->rx + REPLY_HEADER_SIZE, reply_len - REPLY_HEADER_SIZE, &stats, &type) == -1 || type != REPLY_STATS || stats.word_count != connection->words)
+            {
+                return CONNECTION_FAILED;
+            }
+
+            record_latency(worker, monotonic_ns() - connection->shutdown_ns);
+            worker->words += connection->words;
+
+            return CONNECTION_DONE;
+        }
+    }
+}
+
+static void connection_reset(Connection *connection)
+{
+    connection->fd = -1;
+    connection->state = CONNECTION_IDLE;
+    connection->payload_len = 0;
+    connection->sent = 0;
+    connection->abort_at = 0;
+    connection->rx_len = 0;
+    connection->words = 0;
+    connection->shutdown_ns = 0;
+}
+
+// Closing the socket also takes it out of the epoll set.
+static void connection_close(Connection *connection)
+{
+    if (connection->fd != -1)
+    {
+        close(connection->fd);
+    }
+
+    connection->fd = -1;
+    connection->state = CONNECTION_IDLE;
+}
+
+static void record_latency(Worker *worker, uint64_t latency)
+{
+    if (worker->latency_count == worker->latency_capacity)
+    {
+        size_t capacity;
+        uint64_t *latencies;
+
+        capacity = worker->latency_capacity == 0 ? 1024 : worker->latency_capacity * 2;
+        latencies = (uint64_t *)realloc(worker->latencies, capacity * sizeof(uint64_t));
+
+        if (latencies == NULL)
+        {
+            error_exit("Error allocating latencies");
+        }
+
+        worker->latencies = latencies;
+        worker->latency_capacity = capacity;
+    }
+
+    worker->latencies[worker->latency_count++] = latency;
+}
+
+static void *run_worker(void *arg)
+{
+    Worker *worker;
+    Connection *connections;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int epoll_fd;
+    size_t active;
+    size_t idle;
+
+    worker = (Worker *)arg;
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    connections = (Connection *)calloc(worker->connection_count, sizeof(Connection));
+
+    if (epoll_fd == -1 || connections == NULL)
+    {
+        error_exit("Error setting up worker");
+    }
+
+    active = 0;
+    idle = worker->connection_count;
+
+    for (size_t i = 0; i < worker->connection_count; i++)
+    {
+        connection_reset(&connections[i]);
+    }
+
+    for (;;)
+    {
+        uint64_t now;
+        int ready;
+
+        now = monotonic_ns();
+
+        // Slots whose connection finished, or could not be started, get a new one
+        // until the run is over.
+        if (idle > 0 && now < worker->deadline_ns)
+        {
+            for (size_t i = 0; i < worker->connection_count && idle > 0; i++)
+            {
+                if (connections[i].state == CONNECTION_IDLE)
+                {
+                    if (connection_start(worker, epoll_fd, &connections[i]) == -1)
+                    {
+                        worker->failed++;
+                        break;
+                    }
+
+                    active++;
+                    idle--;
+                }
+            }
+        }
+
+        if (active == 0 && now >= worker->deadline_ns)
+        {
+            break;
+        }
+
+        if (now >= worker->deadline_ns + DRAIN_TIMEOUT_NS)
+        {
+            // Uploads still open this long after the run count as failures.
+            for (size_t i = 0; i < worker->connection_count; i++)
+            {
+                if (connections[i].state != CONNECTION_IDLE)
+                {
+                    connection_close(&connections[i]);
+                    worker->failed++;
+                }
+            }
+
+            break;
+        }
+
+        ready = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, EPOLL_TIMEOUT_MS);
+
+        if (ready == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            error_exit("Error waiting for events");
+        }
+
+        for (int i = 0; i < ready; i++)
+        {
+            Connection *connection;
+            int result;
+
+            connection = (Connection *)events[i].data.ptr;
+            result = connection_handle(worker, epoll_fd, connection, events[i].events);
+
+            if (result == CONNECTION_BUSY)
+            {
+                continue;
+            }
+
+            if (result == CONNECTION_DONE)
+            {
+                worker->completed++;
+            }
+            else if (result == CONNECTION_ABORTED)
+            {
+                worker->aborted++;
+            }
+            else
+            {
+                worker->failed++;
+            }
+
+            connection_close(connection);
+            active--;
+            idle++;
+        }
+    }
+
+    for (size_t i = 0; i < worker->connection_count; i++)
+    {
+        free(connections[i].payload);
+    }
+
+    free(connections);
+    close(epoll_fd);
+
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t left;
+    uint64_t right;
+
+    left = *(const uint64_t *)a;
+    right = *(const uint64_t *)b;
+
+    return (left > right) - (left < right);
+}
+
+// Nearest-rank percentile of sorted latencies, in microseconds.
+static double percentile_us(const uint64_t *sorted, size_t count, double fraction)
+{
+    size_t rank;
+
+    if (count == 0)
+    {
+        return 0.0;
+    }
+
+    rank = (size_t)ceil(fraction * (double)count);
+
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+
+    return (double)sorted[rank - 1] / 1000.0;
+}
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * NANOSECONDS_IN_SECOND + (uint64_t)now.tv_nsec;
+}
+
+_Noreturn static void error_exit(const char *msg)
+{
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
@@ -0,0 +1,341 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Leveled logging that keeps formatted messages off the event loops. Threads
+// format a message straight into a slot of a bounded lock-free ring, and a
+// background thread drains the ring in batches to stdout, or to stderr for
+// warnings and errors. A thread never waits on the log: when the ring is full
+// the message is dropped and counted instead.
+//
+// LOG_DEBUG and LOG_DEBUG_RATELIMITED compile to nothing when NDEBUG is defined.
+// Before log_start and after log_stop, messages are written directly.
+
+#define LOG_DEBUG_LEVEL 0
+#define LOG_INFO_LEVEL 1
+#define LOG_WARN_LEVEL 2
+#define LOG_ERROR_LEVEL 3
+
+#define LOG_RING_SIZE 4096       // Slots, a power of two
+#define LOG_MESSAGE_SIZE 240     // Longest message kept; longer ones are cut short
+#define LOG_WRITE_BUFFER 65536   // Bytes the writer gathers per write
+#define LOG_IDLE_SLEEP_NS 1000000L
+#define LOG_RATE_LIMIT_BURST 100 // Rate-limited messages per call site, per thread and interval
+#define LOG_RATE_LIMIT_INTERVAL_NS 1000000000ULL
+
+typedef struct
+{
+    _Atomic size_t sequence; // Equals the slot's position once a message is ready
+    uint8_t level;
+    uint16_t length;
+    char text[LOG_MESSAGE_SIZE];
+} LogSlot;
+
+typedef struct
+{
+    LogSlot slots[LOG_RING_SIZE];
+    _Atomic size_t head; // Next position producers claim
+    size_t tail;         // Next position the writer drains, writer only
+    _Atomic unsigned long long dropped;
+    _Atomic int running;
+    pthread_t thread;
+} Logger;
+
+// A call site's budget of rate-limited messages for the current interval.
+typedef struct
+{
+    uint64_t window_start;
+    unsigned int count;
+    unsigned long long suppressed;
+} LogRateLimit;
+
+static Logger logger;
+
+#ifdef NDEBUG
+#define LOG_DEBUG(...) ((void)0)
+#define LOG_DEBUG_RATELIMITED(...) ((void)0)
+#else
+#define LOG_DEBUG(...) log_message(LOG_DEBUG_LEVEL, __VA_ARGS__)
+#define LOG_DEBUG_RATELIMITED(...)                                   \
+    do                                                               \
+    {                                                                \
+        static __thread LogRateLimit log_rate_limit_;                \
+                                                                     \
+        if (log_rate_limit_allow(&log_rate_limit_))                  \
+        {                                                            \
+            log_message(LOG_DEBUG_LEVEL, __VA_ARGS__);               \
+        }                                                            \
+    } while (0)
+#endif
+
+#define LOG_INFO(...) log_message(LOG_INFO_LEVEL, __VA_ARGS__)
+#define LOG_WARN(...) log_message(LOG_WARN_LEVEL, __VA_ARGS__)
+#define LOG_ERROR(...) log_message(LOG_ERROR_LEVEL, __VA_ARGS__)
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+
+static uint64_t log_clock_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static int log_fd(uint8_t level)
+{
+    return level >= LOG_WARN_LEVEL ? STDERR_FILENO : STDOUT_FILENO;
+}
+
+static void log_write(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(fd, data, length);
+
+        if (written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return;
+        }
+
+        data += written;
+        length -= (size_t)written;
+    }
+}
+
+__attribute__((format(printf, 2, 3))) static void log_message(uint8_t level, const char *format, ...)
+{
+    va_list args;
+    LogSlot *slot;
+    size_t position;
+    int length;
+
+    if (!atomic_load_explicit(&logger.running, memory_order_acquire))
+    {
+        va_start(args, format);
+        vfprintf(level >= LOG_WARN_LEVEL ? stderr : stdout, format, args);
+        va_end(args);
+        fputc('\n', level >= LOG_WARN_LEVEL ? stderr : stdout);
+        return;
+    }
+
+    // Claim a slot. A slot is free for position p when its sequence is p; the
+    // writer moves it on by a lap once it has copied the message out.
+    position = atomic_load_explicit(&logger.head, memory_order_relaxed);
+
+    for (;;)
+    {
+        size_t sequence;
+
+        slot = &logger.slots[position & (LOG_RING_SIZE - 1)];
+        sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+
+        if (sequence == position)
+        {
+            if (atomic_compare_exchange_weak_explicit(&logger.head, &position, position + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if ((intptr_t)(sequence - position) < 0)
+        {
+            atomic_fetch_add_explicit(&logger.dropped, 1, memory_order_relaxed);
+            return;
+        }
+        else
+        {
+            position = atomic_load_explicit(&logger.head, memory_order_relaxed);
+        }
+    }
+
+    va_start(args, format);
+    length = vsnprintf(slot->text, sizeof(slot->text) - 1, format, args);
+    va_end(args);
+
+    if (length < 0)
+    {
+        length = 0;
+    }
+    else if ((size_t)length > sizeof(slot->text) - 2)
+    {
+        length = (int)sizeof(slot->text) - 2;
+    }
+
+    slot->text[length] = '\n';
+    slot->length = (uint16_t)(length + 1);
+    slot->level = level;
+    atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+}
+
+// Returns whether a rate-limited message may be logged now. Once a call site has
+// logged its burst for the interval, the rest are counted and reported together
+// when the next interval starts.
+static int log_rate_limit_allow(LogRateLimit *limit)
+{
+    uint64_t now = log_clock_ns();
+
+    if (now - limit->window_start >= LOG_RATE_LIMIT_INTERVAL_NS)
+    {
+        if (limit->suppressed > 0)
+        {
+            log_message(LOG_DEBUG_LEVEL, "(%llu similar messages suppressed)", limit->suppressed);
+        }
+
+        limit->window_start = now;
+        limit->count = 0;
+        limit->suppressed = 0;
+    }
+
+    if (limit->count < LOG_RATE_LIMIT_BURST)
+    {
+        limit->count++;
+        return 1;
+    }
+
+    limit->suppressed++;
+
+    return 0;
+}
+
+// Copies every ready message out of the ring and writes them in batches, one per
+// output. Returns the number of messages drained.
+static size_t log_drain(char buffers[2][LOG_WRITE_BUFFER], size_t lengths[2])
+{
+    size_t drained = 0;
+
+    for (;;)
+    {
+        LogSlot *slot = &logger.slots[logger.tail & (LOG_RING_SIZE - 1)];
+        int out;
+
+        if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != logger.tail + 1)
+        {
+            break;
+        }
+
+        out = log_fd(slot->level) == STDERR_FILENO;
+
+        if (lengths[out] + slot->length > LOG_WRITE_BUFFER)
+        {
+            log_write(log_fd(out ? LOG_ERROR_LEVEL : LOG_INFO_LEVEL), buffers[out], lengths[out]);
+            lengths[out] = 0;
+        }
+
+        memcpy(buffers[out] + lengths[out], slot->text, slot->length);
+        lengths[out] += slot->length;
+        atomic_store_explicit(&slot->sequence, logger.tail + LOG_RING_SIZE, memory_order_release);
+        logger.tail++;
+        drained++;
+    }
+
+    for (int out = 0; out < 2; out++)
+    {
+        if (lengths[out] > 0)
+        {
+            log_write(log_fd(out ? LOG_ERROR_LEVEL : LOG_INFO_LEVEL), buffers[out], lengths[out]);
+            lengths[out] = 0;
+        }
+    }
+
+    return drained;
+}
+
+static void *log_run(void *arg)
+{
+    static char buffers[2][LOG_WRITE_BUFFER];
+    size_t lengths[2] = {0, 0};
+
+    (void)arg;
+
+    for (;;)
+    {
+        int running = atomic_load_explicit(&logger.running, memory_order_acquire);
+        unsigned long long dropped;
+
+        if (log_drain(buffers, lengths) > 0)
+        {
+            continue;
+        }
+
+        dropped = atomic_exchange_explicit(&logger.dropped, 0, memory_order_relaxed);
+
+        if (dropped > 0)
+        {
+            char notice[64];
+            int length = snprintf(notice, sizeof(notice), "(%llu log messages dropped)\n", dropped);
+
+            log_write(STDERR_FILENO, notice, (size_t)length);
+        }
+
+        // Producers that saw the logger running may still be filling slots; one
+        // more drain after they have stopped picks those up.
+        if (!running)
+        {
+            log_drain(buffers, lengths);
+            return NULL;
+        }
+
+        nanosleep(&(struct timespec){0, LOG_IDLE_SLEEP_NS}, NULL);
+    }
+}
+
+// Starts the writer thread. Threads created afterwards inherit the caller's
+// signal mask, so call it once signals are blocked. Returns 0, or an error number.
+static int log_start(void)
+{
+    int result;
+
+    fflush(stdout);
+    fflush(stderr);
+
+    for (size_t i = 0; i < LOG_RING_SIZE; i++)
+    {
+        atomic_init(&logger.slots[i].sequence, i);
+    }
+
+    atomic_init(&logger.head, 0);
+    logger.tail = 0;
+    atomic_init(&logger.dropped, 0);
+    atomic_store_explicit(&logger.running, 1, memory_order_release);
+    result = pthread_create(&logger.thread, NULL, log_run, NULL);
+
+    if (result != 0)
+    {
+        atomic_store_explicit(&logger.running, 0, memory_order_release);
+    }
+
+    return result;
+}
+
+// Writes out everything logged so far and stops the writer. Call it once the
+// threads that log have stopped.
+static void log_stop(void)
+{
+    if (!atomic_load_explicit(&logger.running, memory_order_acquire))
+    {
+        return;
+    }
+
+    atomic_store_explicit(&logger.running, 0, memory_order_release);
+    pthread_join(logger.thread, NULL);
+}
+
+#pragma GCC diagnostic pop
+
+#endif
@@ -0,0 +1,268 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Live server counters. Every counter has a single writer, the reactor that owns
+// it, so updates are a relaxed load and store rather than a locked add, and any
+// other thread can read them at any time. A report is a snapshot that may mix
+// values from a few events apart, which is fine for monitoring.
+
+#define METRICS_ALIGNMENT 64 // Keep each reactor's counters on their own cache lines
+
+// The byte and word counts of one connection, kept in the slot that matches the
+// connection's place in its reactor's pool.
+typedef struct
+{
+    _Atomic int fd; // -1 while the slot is free
+    _Atomic uint64_t bytes_received;
+    _Atomic uint64_t bytes_sent;
+    _Atomic uint64_t words;
+} ConnectionCounters;
+
+typedef struct
+{
+    _Atomic uint64_t accepts;
+    _Atomic uint64_t active;
+    _Atomic uint64_t closing; // Connections whose stats reply is still draining
+    _Atomic uint64_t words;
+    _Atomic uint64_t bytes_received;
+    _Atomic uint64_t bytes_sent;
+    _Atomic uint64_t wakeups; // Returns from poll, epoll_wait or io_uring_enter
+    _Atomic uint64_t events;  // Ready descriptors or completions they reported
+    ConnectionCounters *connections;
+    size_t capacity;
+} __attribute__((aligned(METRICS_ALIGNMENT))) ReactorMetrics;
+
+// Sums over all reactors, with the accept rate since the previous report.
+typedef struct
+{
+    uint64_t accepts;
+    uint64_t active;
+    uint64_t closing;
+    uint64_t words;
+    uint64_t bytes_received;
+    uint64_t bytes_sent;
+    uint64_t wakeups;
+    uint64_t events;
+    double accepts_per_second;
+} MetricsTotals;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+
+// Only the owning reactor writes a counter, so no atomic read-modify-write is needed.
+static void metric_add(_Atomic uint64_t *counter, uint64_t amount)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+static void metric_sub(_Atomic uint64_t *counter, uint64_t amount)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) - amount, memory_order_relaxed);
+}
+
+static uint64_t metric_read(const _Atomic uint64_t *counter)
+{
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static double metric_ratio(uint64_t numerator, uint64_t denominator)
+{
+    return denominator == 0 ? 0.0 : (double)numerator / (double)denominator;
+}
+
+// Returns an array of count zeroed reactor metrics with room for capacity
+// connections each, or NULL if it cannot be allocated.
+static ReactorMetrics *metrics_create(size_t count, size_t capacity)
+{
+    ReactorMetrics *metrics;
+
+    metrics = (ReactorMetrics *)aligned_alloc(METRICS_ALIGNMENT, count * sizeof(ReactorMetrics));
+
+    if (metrics == NULL)
+    {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        ReactorMetrics *reactor = &metrics[i];
+
+        atomic_init(&reactor->accepts, 0);
+        atomic_init(&reactor->active, 0);
+        atomic_init(&reactor->closing, 0);
+        atomic_init(&reactor->words, 0);
+        atomic_init(&reactor->bytes_received, 0);
+        atomic_init(&reactor->bytes_sent, 0);
+        atomic_init(&reactor->wakeups, 0);
+        atomic_init(&reactor->events, 0);
+        reactor->capacity = capacity;
+        reactor->connections = (ConnectionCounters *)calloc(capacity, sizeof(ConnectionCounters));
+
+        if (reactor->connections == NULL)
+        {
+            while (i-- > 0)
+            {
+                free(metrics[i].connections);
+            }
+
+            free(metrics);
+            return NULL;
+        }
+
+        for (size_t slot = 0; slot < capacity; slot++)
+        {
+            atomic_init(&reactor->connections[slot].fd, -1);
+        }
+    }
+
+    return metrics;
+}
+
+static void metrics_destroy(ReactorMetrics *metrics, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        free(metrics[i].connections);
+    }
+
+    free(metrics);
+}
+
+static void metrics_connection_open(ReactorMetrics *metrics, ConnectionCounters *connection, int fd)
+{
+    atomic_store_explicit(&connection->bytes_received, 0, memory_order_relaxed);
+    atomic_store_explicit(&connection->bytes_sent, 0, memory_order_relaxed);
+    atomic_store_explicit(&connection->words, 0, memory_order_relaxed);
+    atomic_store_explicit(&connection->fd, fd, memory_order_release);
+    metric_add(&metrics->accepts, 1);
+    metric_add(&metrics->active, 1);
+}
+
+static void metrics_connection_close(ReactorMetrics *metrics, ConnectionCounters *connection, int closing)
+{
+    atomic_store_explicit(&connection->fd, -1, memory_order_release);
+    metric_sub(&metrics->active, 1);
+
+    if (closing)
+    {
+        metric_sub(&metrics->closing, 1);
+    }
+}
+
+static void metrics_count_received(ReactorMetrics *metrics, ConnectionCounters *connection, size_t bytes)
+{
+    metric_add(&connection->bytes_received, bytes);
+    metric_add(&metrics->bytes_received, bytes);
+}
+
+static void metrics_count_sent(ReactorMetrics *metrics, ConnectionCounters *connection, size_t bytes)
+{
+    metric_add(&connection->bytes_sent, bytes);
+    metric_add(&metrics->bytes_sent, bytes);
+}
+
+// Brings the connection's word count up to word_count, its running total.
+static void metrics_count_words(ReactorMetrics *metrics, ConnectionCounters *connection, uint64_t word_count)
+{
+    uint64_t added = word_count - metric_read(&connection->words);
+
+    if (added > 0)
+    {
+        atomic_store_explicit(&connection->words, word_count, memory_order_relaxed);
+        metric_add(&metrics->words, added);
+    }
+}
+
+static void metrics_count_wakeup(ReactorMetrics *metrics, int events)
+{
+    metric_add(&metrics->wakeups, 1);
+    metric_add(&metrics->events, (uint64_t)events);
+}
+
+static void metrics_sum(const ReactorMetrics *metrics, size_t count, MetricsTotals *totals)
+{
+    *totals = (MetricsTotals){0};
+
+    for (size_t i = 0; i < count; i++)
+    {
+        totals->accepts += metric_read(&metrics[i].accepts);
+        totals->active += metric_read(&metrics[i].active);
+        totals->closing += metric_read(&metrics[i].closing);
+        totals->words += metric_read(&metrics[i].words);
+        totals->bytes_received += metric_read(&metrics[i].bytes_received);
+        totals->bytes_sent += metric_read(&metrics[i].bytes_sent);
+        totals->wakeups += metric_read(&metrics[i].wakeups);
+        totals->events += metric_read(&metrics[i].events);
+    }
+}
+
+static void metrics_write_text(FILE *out, const ReactorMetrics *metrics, size_t count, const MetricsTotals *totals)
+{
+    fprintf(out, "Active connections:   %" PRIu64 "\n", totals->active);
+    fprintf(out, "Accepts:              %" PRIu64 " (%.1f/s)\n", totals->accepts, totals->accepts_per_second);
+    fprintf(out, "Words ingested:       %" PRIu64 "\n", totals->words);
+    fprintf(out, "Bytes received:       %" PRIu64 "\n", totals->bytes_received);
+    fprintf(out, "Bytes sent:           %" PRIu64 "\n", totals->bytes_sent);
+    fprintf(out, "Wakeups:              %" PRIu64 "\n", totals->wakeups);
+    fprintf(out, "Events per wakeup:    %.2f\n", metric_ratio(totals->events, totals->wakeups));
+    fprintf(out, "Stats replies queued: %" PRIu64 "\n", totals->closing);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const ReactorMetrics *reactor = &metrics[i];
+
+        fprintf(out, "\nReactor %zu: %" PRIu64 " active, %" PRIu64 " accepts, %" PRIu64 " words, %" PRIu64 " wakeups, %.2f events per wakeup, %" PRIu64 " replies queued\n", i, metric_read(&reactor->active), metric_read(&reactor->accepts), metric_read(&reactor->words), metric_read(&reactor->wakeups), metric_ratio(metric_read(&reactor->events), metric_read(&reactor->wakeups)), metric_read(&reactor->closing));
+
+        for (size_t slot = 0; slot < reactor->capacity; slot++)
+        {
+            const ConnectionCounters *connection = &reactor->connections[slot];
+            int fd = atomic_load_explicit(&connection->fd, memory_order_acquire);
+
+            if (fd != -1)
+            {
+                fprintf(out, "  Client %d: %" PRIu64 " bytes received, %" PRIu64 " bytes sent, %" PRIu64 " words\n", fd, metric_read(&connection->bytes_received), metric_read(&connection->bytes_sent), metric_read(&connection->words));
+            }
+        }
+    }
+}
+
+// One JSON object, on one line.
+static void metrics_write_json(FILE *out, const ReactorMetrics *metrics, size_t count, const MetricsTotals *totals)
+{
+    fprintf(out, "{\"active_connections\":%" PRIu64 ",\"accepts\":%" PRIu64 ",\"accepts_per_second\":%.1f,\"words\":%" PRIu64 ",\"bytes_received\":%" PRIu64 ",\"bytes_sent\":%" PRIu64 ",\"wakeups\":%" PRIu64 ",\"events\":%" PRIu64 ",\"events_per_wakeup\":%.2f,\"stats_replies_queued\":%" PRIu64 ",\"reactors\":[", totals->active, totals->accepts, totals->accepts_per_second, totals->words, totals->bytes_received, totals->bytes_sent, totals->wakeups, totals->events, metric_ratio(totals->events, totals->wakeups), totals->closing);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const ReactorMetrics *reactor = &metrics[i];
+        const char *separator = "";
+
+        fprintf(out, "%s{\"id\":%zu,\"active_connections\":%" PRIu64 ",\"accepts\":%" PRIu64 ",\"words\":%" PRIu64 ",\"bytes_received\":%" PRIu64 ",\"bytes_sent\":%" PRIu64 ",\"wakeups\":%" PRIu64 ",\"events\":%" PRIu64 ",\"stats_replies_queued\":%" PRIu64 ",\"connections\":[", i == 0 ? "" : ",", i, metric_read(&reactor->active), metric_read(&reactor->accepts), metric_read(&reactor->words), metric_read(&reactor->bytes_received), metric_read(&reactor->bytes_sent), metric_read(&reactor->wakeups), metric_read(&reactor->events), metric_read(&reactor->closing));
+
+        for (size_t slot = 0; slot < reactor->capacity; slot++)
+        {
+            const ConnectionCounters *connection = &reactor->connections[slot];
+            int fd = atomic_load_explicit(&connection->fd, memory_order_acquire);
+
+            if (fd != -1)
+            {
+                fprintf(out, "%s{\"fd\":%d,\"bytes_received\":%" PRIu64 ",\"bytes_sent\":%" PRIu64 ",\"words\":%" PRIu64 "}", separator, fd, metric_read(&connection->bytes_received), metric_read(&connection->bytes_sent), metric_read(&connection->words));
+                separator = ",";
+            }
+        }
+
+        fputs("]}", out);
+    }
+
+    fputs("]}\n", out);
+}
+
+#pragma GCC diagnostic pop
+
+#endif
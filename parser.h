@@ -0,0 +1,447 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "histogram.h"
+#include "log.h"
+#include "protocol.h"
+#include "sketch.h"
+#include "text_statistics.h"
+#include "utf8.h"
+#include "word_table.h"
+
+// Incremental word parser for both protocol versions. It is fed whatever part of
+// the stream has arrived, counts every complete word into stats and keeps the
+// state needed to carry on where the input stopped, including a v2 word that is
+// longer than anything it is handed at once. Given a word table or a sketch, it
+// also counts each word in them, and once a v7 client asks, it counts the code
+// points of every word.
+
+typedef struct
+{
+    TextStatistics *stats;
+    WordTable *words;         // Word frequencies, or NULL to skip them
+    WordSketch *sketch;       // Server-wide word statistics, or NULL to skip them
+    int id;                   // Shown when words are echoed
+    int echo;                 // Log every word as it is counted, rate-limited
+    uint32_t frame_remaining; // v2: bytes of the current frame not parsed yet
+    uint64_t frame_words;     // v2: words of the current frame not parsed yet
+    uint64_t word_remaining;  // v2: bytes still to come of a word streamed through the buffer
+    uint64_t word_size;       // v2: that word's length on the wire
+    uint64_t word_length;     // v2: characters counted so far of that word
+    int word_terminated;      // v2: a null terminator has ended that word
+    int totals_requested;     // v4: the client sent a totals request
+    int snapshot_requested;   // v5: parsing stopped at a snapshot request
+    uint8_t session_key[SESSION_KEY_MAX]; // v6: the session key the client named
+    size_t session_key_len;   // v6: its length, 0 if none
+    Utf8Stats *utf8;          // v7: code point counts, NULL unless the client asked for them
+    uint8_t word_text[WORD_TABLE_MAX_KEY]; // v2: that word's text so far, if it is short enough to track
+} WordParser;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+
+static void parser_init(WordParser *parser, TextStatistics *stats, WordTable *words, WordSketch *sketch, int id, int echo)
+{
+    parser->stats = stats;
+    parser->words = words;
+    parser->sketch = sketch;
+    parser->id = id;
+    parser->echo = echo;
+    parser->frame_remaining = 0;
+    parser->frame_words = 0;
+    parser->word_remaining = 0;
+    parser->word_size = 0;
+    parser->word_length = 0;
+    parser->word_terminated = 0;
+    parser->totals_requested = 0;
+    parser->snapshot_requested = 0;
+    parser->session_key_len = 0;
+    parser->utf8 = NULL;
+}
+
+static void parser_free(WordParser *parser)
+{
+    if (parser->utf8 != NULL)
+    {
+        utf8_stats_free(parser->utf8);
+        free(parser->utf8);
+        parser->utf8 = NULL;
+    }
+}
+
+static void frequency_subtract(unsigned long long *frequency, const uint8_t *data, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        frequency[case_fold_table[data[i]]]--;
+    }
+}
+
+// Counts a word too long to track as untracked.
+static void parser_skip_word(WordParser *parser)
+{
+    if (parser->words != NULL)
+    {
+        parser->words->untracked++;
+    }
+
+    if (parser->sketch != NULL)
+    {
+        word_sketch_skip(parser->sketch);
+    }
+}
+
+// Counts a word in the word table and the sketch, whichever are set. The key is
+// folded and hashed once for both.
+static void parser_track_word(WordParser *parser, const uint8_t *word, size_t length)
+{
+    uint8_t key[WORD_TABLE_MAX_KEY + 8];
+    uint64_t hash;
+
+    if (length == 0 || (parser->words == NULL && parser->sketch == NULL))
+    {
+        return;
+    }
+
+    if (length > WORD_TABLE_MAX_KEY)
+    {
+        parser_skip_word(parser);
+        return;
+    }
+
+    hash = word_key(word, length, key);
+
+    if (parser->words != NULL)
+    {
+        word_table_add_key(parser->words, key, length, hash);
+    }
+
+    if (parser->sketch != NULL)
+    {
+        word_sketch_add(parser->sketch, key, length, hash);
+    }
+}
+
+// Adds a word whose bytes are all buffered. The bytes themselves are histogrammed
+// with the rest of the buffer; words end at an embedded null terminator, as they
+// did when they were C strings, so whatever follows one is taken back.
+static void parser_count_word(WordParser *parser, const uint8_t *word, size_t length)
+{
+    size_t word_len = strnlen((const char *)word, length);
+
+    frequency_subtract(parser->stats->character_frequency, word + word_len, length - word_len);
+    parser->stats->word_count++;
+    parser->stats->character_count += word_len;
+
+    parser_track_word(parser, word, word_len);
+
+    if (parser->utf8 != NULL)
+    {
+        utf8_count(parser->utf8, word, word_len);
+        utf8_end_word(parser->utf8);
+    }
+
+    if (parser->echo)
+    {
+        LOG_DEBUG_RATELIMITED("Received word from client %d: %.*s", parser->id, (int)word_len, (const char *)word);
+    }
+}
+
+// Adds the next buffered piece of a word that did not fit in the buffer. A word
+// short enough to track is gathered so it can go into the word table whole.
+static void parser_stream_word(WordParser *parser, const uint8_t *chunk, size_t length)
+{
+    size_t text = 0;
+
+    if (!parser->word_terminated)
+    {
+        text = strnlen((const char *)chunk, length);
+
+        if ((parser->words != NULL || parser->sketch != NULL) && parser->word_size <= WORD_TABLE_MAX_KEY)
+        {
+            memcpy(parser->word_text + parser->word_length, chunk, text);
+        }
+
+        if (parser->utf8 != NULL)
+        {
+            utf8_count(parser->utf8, chunk, text);
+        }
+
+        parser->word_length += text;
+        parser->word_terminated = text < length;
+    }
+
+    frequency_subtract(parser->stats->character_frequency, chunk + text, length - text);
+}
+
+static void parser_finish_streamed_word(WordParser *parser)
+{
+    parser->stats->word_count++;
+    parser->stats->character_count += parser->word_length;
+
+    if (parser->word_size <= WORD_TABLE_MAX_KEY)
+    {
+        parser_track_word(parser, parser->word_text, (size_t)parser->word_length);
+    }
+    else if (parser->word_length > 0)
+    {
+        parser_skip_word(parser);
+    }
+
+    if (parser->utf8 != NULL)
+    {
+        utf8_end_word(parser->utf8);
+    }
+
+    if (parser->echo)
+    {
+        LOG_DEBUG_RATELIMITED("Received word from client %d: %" PRIu64 " characters", parser->id, parser->word_length);
+    }
+}
+
+// Counts every complete v1 frame in data from *offset on.
+static void parser_parse_v1(WordParser *parser, const uint8_t *data, size_t length, size_t *offset)
+{
+    const char *word;
+    size_t frame_len;
+
+    while (next_word_frame(data, length, offset, &word, &frame_len))
+    {
+        frequency_subtract(parser->stats->character_frequency, (const uint8_t *)word - 1, 1);
+        parser_count_word(parser, (const uint8_t *)word, frame_len);
+    }
+}
+
+// Starts the v2 frame at *offset. Returns 1 once its header is parsed, 0 if the
+// header has not fully arrived and -1 if it is malformed.
+static int parser_parse_frame_header(WordParser *parser, uint8_t protocol, const uint8_t *data, size_t length, size_t *offset)
+{
+    size_t available = length - *offset;
+    size_t position = *offset + 5;
+    uint32_t frame_len;
+    uint64_t words;
+    int result;
+
+    if (available < 5)
+    {
+        return 0;
+    }
+
+    frame_len = get_u32_be(data + *offset);
+
+    // A session frame is parsed whole; its key is short.
+    if (frame_len >= 2 && frame_len <= 1 + SESSION_KEY_MAX && data[*offset + 4] == V2_FRAME_SESSION && protocol >= PROTOCOL_V6)
+    {
+        if (available < 4 + (size_t)frame_len)
+        {
+            return 0;
+        }
+
+        parser->session_key_len = frame_len - 1;
+        memcpy(parser->session_key, data + *offset + 5, parser->session_key_len);
+        frequency_subtract(parser->stats->character_frequency, data + *offset, 4 + (size_t)frame_len);
+        *offset += 4 + (size_t)frame_len;
+        return 1;
+    }
+
+    // A request is a frame type and nothing else.
+    if (frame_len == 1 && ((data[*offset + 4] == V2_FRAME_TOTALS && protocol >= PROTOCOL_V4) || (data[*offset + 4] == V2_FRAME_SNAPSHOT && protocol >= PROTOCOL_V5)))
+    {
+        if (data[*offset + 4] == V2_FRAME_TOTALS)
+        {
+            parser->totals_requested = 1;
+        }
+        else
+        {
+            parser->snapshot_requested = 1;
+        }
+
+        frequency_subtract(parser->stats->character_frequency, data + *offset, V2_REQUEST_SIZE);
+        *offset += V2_REQUEST_SIZE;
+        return 1;
+    }
+
+    // Code points are counted from the first word on or not at all.
+    if (frame_len == 1 && data[*offset + 4] == V2_FRAME_UTF8 && protocol >= PROTOCOL_V7 && parser->utf8 == NULL && parser->stats->word_count == 0)
+    {
+        parser->utf8 = (Utf8Stats *)malloc(sizeof(Utf8Stats));
+
+        if (parser->utf8 == NULL)
+        {
+            return -1;
+        }
+
+        utf8_stats_init(parser->utf8);
+        frequency_subtract(parser->stats->character_frequency, data + *offset, V2_REQUEST_SIZE);
+        *offset += V2_REQUEST_SIZE;
+        return 1;
+    }
+
+    if (frame_len < 2 || data[*offset + 4] != V2_FRAME_WORDS)
+    {
+        return -1;
+    }
+
+    result = varint_decode(data, available < 4 + (size_t)frame_len ? length : *offset + 4 + frame_len, &position, &words);
+
+    if (result == 0)
+    {
+        return available >= 4 + (size_t)frame_len ? -1 : 0;
+    }
+
+    parser->frame_remaining = frame_len - (uint32_t)(position - *offset - 4);
+
+    // Every word takes at least its one-byte length.
+    if (result < 0 || words > parser->frame_remaining)
+    {
+        return -1;
+    }
+
+    parser->frame_words = words;
+    frequency_subtract(parser->stats->character_frequency, data + *offset, position - *offset);
+
+    // Grown for the frame's new words at once; if memory runs out, the table grows as it fills.
+    if (parser->words != NULL)
+    {
+        word_table_reserve(parser->words, words);
+    }
+    *offset = position;
+
+    return 1;
+}
+
+// Counts v2 words in data from *offset on, including the buffered part of a word
+// that is longer than what has arrived, and notes requests. A snapshot request
+// stops parsing right after it, so the snapshot covers exactly the words before
+// it. Returns 0, or -1 if a frame is malformed.
+static int parser_parse_v2(WordParser *parser, uint8_t protocol, const uint8_t *data, size_t length, size_t *offset)
+{
+    for (;;)
+    {
+        size_t available = length - *offset;
+        size_t frame_available;
+        size_t position;
+        uint64_t word_len;
+        int result;
+
+        if (parser->word_remaining > 0)
+        {
+            size_t chunk = available < parser->word_remaining ? available : (size_t)parser->word_remaining;
+
+            if (chunk == 0)
+            {
+                return 0;
+            }
+
+            parser_stream_word(parser, data + *offset, chunk);
+            *offset += chunk;
+            parser->word_remaining -= chunk;
+
+            if (parser->word_remaining == 0)
+            {
+                parser_finish_streamed_word(parser);
+            }
+
+            continue;
+        }
+
+        if (parser->frame_words == 0)
+        {
+            // Words that end before their frame does leave bytes unaccounted for.
+            if (parser->frame_remaining != 0)
+            {
+                return -1;
+            }
+
+            result = parser_parse_frame_header(parser, protocol, data, length, offset);
+
+            if (result <= 0 || parser->snapshot_requested)
+            {
+                return result < 0 ? result : 0;
+            }
+
+            continue;
+        }
+
+        // The word's length, which has to lie inside the frame.
+        frame_available = available < parser->frame_remaining ? available : parser->frame_remaining;
+        position = *offset;
+        result = varint_decode(data, *offset + frame_available, &position, &word_len);
+
+        if (result == 0)
+        {
+            return available >= parser->frame_remaining ? -1 : 0;
+        }
+
+        if (result < 0 || word_len > parser->frame_remaining - (position - *offset))
+        {
+            return -1;
+        }
+
+        frequency_subtract(parser->stats->character_frequency, data + *offset, position - *offset);
+        parser->frame_words--;
+        parser->frame_remaining -= (uint32_t)(position - *offset + word_len);
+        *offset = position;
+
+        if (word_len <= length - position)
+        {
+            parser_count_word(parser, data + position, (size_t)word_len);
+            *offset += (size_t)word_len;
+        }
+        else
+        {
+            parser->word_remaining = word_len;
+            parser->word_size = word_len;
+            parser->word_length = 0;
+            parser->word_terminated = 0;
+        }
+    }
+}
+
+// Parses everything in data from *offset on that can be parsed with the given
+// protocol, leaving *offset at the first byte still needed. Returns 0, or -1 if
+// the input broke the protocol.
+static int parser_parse(WordParser *parser, uint8_t protocol, const uint8_t *data, size_t length, size_t *offset)
+{
+    size_t start = *offset;
+    int result = 0;
+
+    if (protocol == PROTOCOL_V1)
+    {
+        parser_parse_v1(parser, data, length, offset);
+    }
+    else
+    {
+        result = parser_parse_v2(parser, protocol, data, length, offset);
+    }
+
+    // Everything parsed is histogrammed in one pass. The parsers have already
+    // taken back the bytes that are not word text: frame and word headers and
+    // anything after a null terminator. Counts are unsigned, so they come out
+    // exact even if one briefly wraps.
+    histogram_count(data + start, *offset - start, parser->stats->character_frequency);
+
+    return result;
+}
+
+// Called once the input has ended. The bytes of a cut-off word have been counted,
+// so the word is counted too.
+static void parser_finish(WordParser *parser)
+{
+    if (parser->word_remaining > 0)
+    {
+        parser->word_remaining = 0;
+        parser_finish_streamed_word(parser);
+    }
+}
+
+#pragma GCC diagnostic pop
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+// Fixed-capacity object pool. All objects come from one slab that is mapped up
+// front, so allocating and freeing never goes through malloc. Freed objects are
+// kept on an intrusive free list; objects that have never been handed out are
+// carved from the end of the slab, so untouched pages are not committed.
+
+typedef struct
+{
+    uint8_t *slab;
+    size_t slab_size;
+    size_t object_size;
+    size_t capacity;
+    size_t carved;   // Objects handed out from the slab at least once
+    size_t in_use;
+    void *free_list; // Each free object starts with a pointer to the next one
+} ObjectPool;
+
+#define POOL_ALIGNMENT 64 // Keep objects on separate cache lines
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+
+// Returns 0 on success or -1 with errno set if the slab cannot be mapped.
+static int pool_init(ObjectPool *pool, size_t object_size, size_t capacity)
+{
+    void *slab;
+
+    if (object_size < sizeof(void *))
+    {
+        object_size = sizeof(void *);
+    }
+
+    pool->object_size = (object_size + POOL_ALIGNMENT - 1) & ~(size_t)(POOL_ALIGNMENT - 1);
+    pool->capacity = capacity;
+    pool->slab_size = pool->object_size * capacity;
+    pool->carved = 0;
+    pool->in_use = 0;
+    pool->free_list = NULL;
+    pool->slab = NULL;
+
+    if (pool->slab_size == 0)
+    {
+        return 0;
+    }
+
+    slab = mmap(NULL, pool->slab_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (slab == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    pool->slab = (uint8_t *)slab;
+
+    return 0;
+}
+
+// Returns an uninitialised object, or NULL if all capacity objects are in use.
+static void *pool_alloc(ObjectPool *pool)
+{
+    void *object;
+
+    if (pool->free_list != NULL)
+    {
+        object = pool->free_list;
+        pool->free_list = *(void **)object;
+    }
+    else if (pool->carved < pool->capacity)
+    {
+        object = pool->slab + pool->carved * pool->object_size;
+        pool->carved++;
+    }
+    else
+    {
+        return NULL;
+    }
+
+    pool->in_use++;
+
+    return object;
+}
+
+static void pool_free(ObjectPool *pool, void *object)
+{
+    if (object == NULL)
+    {
+        return;
+    }
+
+    *(void **)object = pool->free_list;
+    pool->free_list = object;
+    pool->in_use--;
+}
+
+// Returns the object's position in the slab, below the pool's capacity.
+static size_t pool_index(const ObjectPool *pool, const void *object)
+{
+    return (size_t)((const uint8_t *)object - pool->slab) / pool->object_size;
+}
+
+static void pool_destroy(ObjectPool *pool)
+{
+    if (pool->slab != NULL)
+    {
+        munmap(pool->slab, pool->slab_size);
+        pool->slab = NULL;
+    }
+}
+
+#pragma GCC diagnostic pop
+
+#endif
@@ -0,0 +1,278 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Wire protocol shared by the client and the server.
+//
+// Version 1 sends one word per frame: a single length byte followed by that many
+// bytes of the word.
+//
+// Version 2 is negotiated. The client opens with a hello: a zero byte, the magic
+// "TXST" and the highest version it speaks. The server answers with a hello
+// reply naming the version it picked, and frames of that version follow. A v1
+// stream only looks like a hello if it starts with an empty word followed by a
+// word of 'T' (84) bytes spelling "XST" and a version, so servers tell the two
+// apart from the first six bytes. A version 2 frame carries a batch of words:
+//   u32     frame length, big-endian, counting the bytes after it
+//   u8      frame type, V2_FRAME_WORDS
+//   varint  word count
+//   words, each a varint length followed by that many bytes
+// Words can be as long as the frame; the server does not need a whole frame, or
+// a whole word, to be buffered before counting it.
+//
+// Version 3 frames words as version 2 does. After the stats reply, the server
+// also sends a top words reply with the connection's most frequent words.
+//
+// Version 4 adds a request frame the client can send among its word frames:
+//   u32     frame length, 1
+//   u8      frame type, V2_FRAME_TOTALS
+// It asks for the server's totals over every upload that has finished, this one
+// included. They come back in a totals reply after the connection's other replies.
+//
+// Version 5 adds a snapshot request frame, laid out the same way with the type
+// V2_FRAME_SNAPSHOT. The server answers it while the upload goes on, with a
+// snapshot reply in the stats layout that holds what has been counted since the
+// previous snapshot of the connection, or since it opened. Adding up the
+// snapshots gives the connection's progress. Each reply covers exactly the words
+// sent before its request. A client that stops reading may leave at most
+// SNAPSHOTS_PENDING_MAX requests unanswered; sending more breaks the protocol.
+//
+// Version 6 adds a session frame that names the upload's session key:
+//   u32     frame length, 1 + the key's length
+//   u8      frame type, V2_FRAME_SESSION
+//   the key, 1 to SESSION_KEY_MAX bytes
+// A server with a persistent store adds the connection's statistics to those
+// of its key once the upload finishes, across connections and restarts.
+//
+// Version 7 adds a UTF-8 request frame, laid out like the totals request with
+// the type V2_FRAME_UTF8. Sent before the first word frame, it has the server
+// decode the words as UTF-8 and count code points as well as bytes. The counts
+// come back in a code points reply, see utf8.h, after the top words reply.
+//
+// Every reply from the server is a u32 big-endian body length followed by the
+// body, which starts with REPLY_VERSION and the reply type.
+//
+// Multi-byte integers are either big-endian or unsigned LEB128 varints: seven
+// bits per byte, least significant group first, with the high bit set on every
+// byte but the last.
+
+#define V1_MAX_WORD_LEN UINT8_MAX
+#define VARINT_MAX_LEN 10 // Bytes needed for a 64-bit value
+
+#define PROTOCOL_V1 1
+#define PROTOCOL_V2 2
+#define PROTOCOL_V3 3
+#define PROTOCOL_V4 4
+#define PROTOCOL_V5 5
+#define PROTOCOL_V6 6
+#define PROTOCOL_V7 7
+#define PROTOCOL_MAX_VERSION PROTOCOL_V7
+#define HELLO_MAGIC "TXST"
+#define HELLO_SIZE 6
+
+#define V2_FRAME_WORDS 1
+#define V2_FRAME_TOTALS 2 // Version 4: asks for the server's totals
+#define V2_FRAME_SNAPSHOT 3 // Version 5: asks for the connection's progress
+#define V2_FRAME_SESSION 4 // Version 6: names the upload's session key
+#define V2_FRAME_UTF8 5 // Version 7: asks for code point counts
+#define V2_REQUEST_SIZE 5 // A request frame: its length and type
+#define SESSION_KEY_MAX 32
+#define SNAPSHOTS_PENDING_MAX 8 // Snapshot requests a connection may leave unanswered
+#define V2_FRAME_HEADER_MAX (4 + 1 + VARINT_MAX_LEN)
+
+#define REPLY_HEADER_SIZE 4
+#define REPLY_VERSION 1
+#define REPLY_STATS 1 // Statistics of a connection whose client has finished sending
+#define REPLY_HELLO 2 // Body: the protocol version the server picked
+#define REPLY_TOP_WORDS 3 // The most frequent words of a connection, see word_table.h
+#define REPLY_TOTALS 4    // Statistics of every finished upload, laid out as REPLY_STATS
+#define REPLY_SNAPSHOT 5  // Counts since a connection's previous snapshot, laid out as REPLY_STATS
+#define REPLY_CODE_POINTS 6 // Code point counts of a connection, see utf8.h
+#define HELLO_REPLY_SIZE (REPLY_HEADER_SIZE + 3)
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+
+// Pulls the next complete [len][bytes] frame out of data[*offset..length).
+// Returns 1 and advances *offset if a whole frame is buffered, or 0 if the
+// remaining bytes are only part of a frame and more input is needed.
+static int next_word_frame(const uint8_t *data, size_t length, size_t *offset, const char **word, size_t *word_len)
+{
+    size_t remaining = length - *offset;
+    size_t frame_len;
+
+    if (remaining < 1)
+    {
+        return 0;
+    }
+
+    frame_len = data[*offset];
+
+    if (remaining < 1 + frame_len)
+    {
+        return 0;
+    }
+
+    *word = (const char *)&data[*offset + 1];
+    *word_len = frame_len;
+    *offset += 1 + frame_len;
+
+    return 1;
+}
+
+// Writes value as a varint to out, which must have VARINT_MAX_LEN bytes of room.
+// Returns the number of bytes written.
+static size_t varint_encode(uint64_t value, uint8_t *out)
+{
+    size_t length = 0;
+
+    while (value >= 0x80)
+    {
+        out[length++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+
+    out[length++] = (uint8_t)value;
+
+    return length;
+}
+
+// Reads a varint from data[*offset..length). Returns 1 and advances *offset on
+// success, 0 if the input ends inside the varint and -1 if it is malformed: longer
+// than VARINT_MAX_LEN bytes or too large for 64 bits.
+static int varint_decode(const uint8_t *data, size_t length, size_t *offset, uint64_t *value)
+{
+    uint64_t result = 0;
+    size_t position = *offset;
+
+    for (unsigned shift = 0; shift < 7 * VARINT_MAX_LEN; shift += 7)
+    {
+        uint8_t byte;
+
+        if (position >= length)
+        {
+            return 0;
+        }
+
+        byte = data[position++];
+
+        // The tenth byte only has room for the top bit of a 64-bit value.
+        if (shift == 63 && byte > 1)
+        {
+            return -1;
+        }
+
+        result |= (uint64_t)(byte & 0x7f) << shift;
+
+        if ((byte & 0x80) == 0)
+        {
+            *value = result;
+            *offset = position;
+            return 1;
+        }
+    }
+
+    return -1;
+}
+
+static void put_u32_be(uint8_t *out, uint32_t value)
+{
+    out[0] = (uint8_t)(value >> 24);
+    out[1] = (uint8_t)(value >> 16);
+    out[2] = (uint8_t)(value >> 8);
+    out[3] = (uint8_t)value;
+}
+
+static uint32_t get_u32_be(const uint8_t *in)
+{
+    return (uint32_t)in[0] << 24 | (uint32_t)in[1] << 16 | (uint32_t)in[2] << 8 | (uint32_t)in[3];
+}
+
+// Writes the hello that offers protocol versions up to max_version.
+static size_t hello_encode(uint8_t *out, uint8_t max_version)
+{
+    out[0] = 0;
+    memcpy(out + 1, HELLO_MAGIC, 4);
+    out[5] = max_version;
+
+    return HELLO_SIZE;
+}
+
+// Looks for a hello at the start of a connection's input. Returns 1 and sets
+// *version if there is one, 0 if too few bytes have arrived to tell, or -1 if
+// the input is a v1 stream.
+static int hello_parse(const uint8_t *data, size_t length, uint8_t *version)
+{
+    uint8_t expected[HELLO_SIZE - 1];
+    size_t compare;
+
+    expected[0] = 0;
+    memcpy(expected + 1, HELLO_MAGIC, 4);
+    compare = length < sizeof(expected) ? length : sizeof(expected);
+
+    if (memcmp(data, expected, compare) != 0)
+    {
+        return -1;
+    }
+
+    if (length < HELLO_SIZE)
+    {
+        return 0;
+    }
+
+    *version = data[HELLO_SIZE - 1];
+
+    return 1;
+}
+
+static size_t hello_reply_encode(uint8_t *out, uint8_t version)
+{
+    put_u32_be(out, 3);
+    out[4] = REPLY_VERSION;
+    out[5] = REPLY_HELLO;
+    out[6] = version;
+
+    return HELLO_REPLY_SIZE;
+}
+
+// Writes the header of a v2 frame of the given type whose words take payload_len
+// bytes, to out, which must have V2_FRAME_HEADER_MAX bytes of room. Returns the
+// header length.
+static size_t frame_header_encode(uint8_t *out, uint8_t type, uint64_t word_count, size_t payload_len)
+{
+    size_t length;
+
+    out[4] = type;
+    length = 5 + varint_encode(word_count, out + 5);
+    put_u32_be(out, (uint32_t)(length - 4 + payload_len));
+
+    return length;
+}
+
+// Writes a request frame of the given type: V2_FRAME_TOTALS, V2_FRAME_SNAPSHOT
+// or V2_FRAME_UTF8.
+static size_t request_encode(uint8_t *out, uint8_t type)
+{
+    put_u32_be(out, 1);
+    out[4] = type;
+
+    return V2_REQUEST_SIZE;
+}
+
+// Writes a session frame for the key, which must be 1 to SESSION_KEY_MAX bytes,
+// to out, which must have V2_REQUEST_SIZE + SESSION_KEY_MAX bytes of room.
+static size_t session_encode(uint8_t *out, const char *key, size_t key_len)
+{
+    put_u32_be(out, (uint32_t)(1 + key_len));
+    out[4] = V2_FRAME_SESSION;
+    memcpy(out + 5, key, key_len);
+
+    return V2_REQUEST_SIZE + key_len;
+}
+
+#pragma GCC diagnostic pop
+
+#endif
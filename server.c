@@ -16,45 +16,289 @@
  * https://creativecommons.org/licenses/by-nc-nd/4.0/
  */
 
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 #include <poll.h>
 #include <sys/un.h>
 
+#include "log.h"
+#include "metrics.h"
+#include "parser.h"
+#include "pool.h"
+#include "protocol.h"
+#include "sketch.h"
+#include "store.h"
 #include "text_statistics.h"
+#include "totals.h"
+#include "uring.h"
+#include "word_table.h"
+
+typedef struct ClientData
+{
+    int socket_fd;           // Client's socket file descriptor
+    TextStatistics *stats;   // Statistics for this client
+    uint8_t *rx_buffer;      // Received bytes that have not been parsed yet
+    size_t rx_len;
+    uint8_t *tx_buffer;      // Reply bytes waiting for the socket to accept them
+    size_t tx_len;
+    size_t tx_sent;
+    uint8_t protocol;        // A PROTOCOL_V* version once the first bytes settle it
+    uint8_t uring_ops;       // io_uring operations in flight, URING_PENDING_* bits
+    WordParser parser;       // Where parsing of the received words has got to
+    WordTable words;         // How often each word was sent, from version 3 on
+    ReactorMetrics *metrics; // The owning reactor's counters
+    ConnectionCounters *counters; // This connection's counters, NULL until it is set up
+    StatsShard *shard;       // The owning reactor's share of the server totals
+    const ServerTotals *totals;
+    TextStatistics *snapshot; // The counts the last snapshot reply was taken at, NULL before the first
+    ObjectPool *snapshots;   // Where snapshot and deferred are taken from
+    StatsStore *store;       // Where session statistics persist, or NULL without -p
+    uint32_t snapshots_pending; // Snapshot requests waiting for room in the transmit buffer
+    TextStatistics *deferred[SNAPSHOTS_PENDING_MAX]; // The counts each waiting request was made at
+    uint64_t close_deadline; // Nonzero once the connection is closing: the time, in
+                             // monotonic milliseconds, by which its reply must drain
+    size_t slot;             // Index in the poll backend's table
+    struct ClientData *prev; // Neighbours in the epoll and io_uring connection lists
+    struct ClientData *next;
+    struct ClientData *close_prev; // Neighbours in the close queue
+    struct ClientData *close_next;
+    struct __kernel_timespec send_timeout; // Time left for an io_uring reply send
+} ClientData;
+
+// Connections whose reply is still draining. Every connection gets the same
+// timeout, so appending keeps the queue in deadline order.
+typedef struct
+{
+    ClientData *head;
+    ClientData *tail;
+} CloseQueue;
+
+// Per-reactor pools for connection state, sized once at startup so accepting and
+// closing connections does no general-purpose allocation. The reactor's metrics,
+// word sketch and totals shard ride along so connection setup can find them.
+typedef struct
+{
+    size_t capacity;
+    ReactorMetrics *metrics;
+    WordSketch *sketch;
+    ServerTotals *totals;
+    StatsShard *shard;
+    StatsStore *store;
+    ObjectPool clients;
+    ObjectPool stats;
+    ObjectPool snapshots;
+    ObjectPool rx_buffers;
+    ObjectPool tx_buffers;
+} ConnectionPools;
+
+typedef enum
+{
+    BACKEND_POLL,
+    BACKEND_EPOLL,
+    BACKEND_URING
+} EventBackend;
+
+// One event loop with its own listening socket and connections. Reactors share
+// nothing but the shutdown eventfd, which is written once when the server stops,
+// and the Unix listening socket, which every reactor accepts from.
+typedef struct
+{
+    int id;
+    int listen_fd;
+    int unix_listen_fd; // Shared by every reactor, or -1 without -u
+    int shutdown_fd;
+    int cpu; // CPU to pin the reactor thread to, or -1 to leave it unpinned
+    size_t max_connections;
+    EventBackend backend;
+    ReactorMetrics *metrics; // Owned by main, so it outlives the reactor
+    WordSketch *sketch;      // Likewise; written only by this reactor
+    ServerTotals *totals;    // Shared; this reactor writes only the shard at its id
+    StatsStore *store;       // Shared, or NULL without -p
+    pthread_t thread;
+} Reactor;
+
+// The admin socket: a Unix domain socket that answers every connection with a
+// report of the live metrics, as plain text or, if the client asks with "json",
+// as one JSON object. A client that asks with "words" gets the top words and
+// distinct words of the last hour instead, and "words json" gets them as JSON.
+// "sessions" lists the session keys in the persistent store.
+typedef struct
+{
+    const char *path;
+    int listen_fd;
+    int shutdown_fd;
+    const ReactorMetrics *metrics;
+    const WordSketch *sketches;
+    size_t reactors;
+    StatsStore *store; // NULL without -p
+    pthread_t thread;
+} AdminServer;
+
+// The thread that checkpoints the persistent store every STORE_CHECKPOINT_MS,
+// so syncing it to disk never holds up a reactor.
+typedef struct
+{
+    StatsStore *store;
+    const ServerTotals *totals;
+    int shutdown_fd;
+    pthread_t thread;
+} Checkpointer;
 
 static void setup_signal_handler(void);
 static void sigint_handler(int signum);
-static void parse_arguments(int argc, char *argv[], char **ip_address, char **port, char **backlog);
-static void handle_arguments(const char *binary_name, const char *ip_address, const char *port_str, const char *backlog_str, in_port_t *port, int *backlog);
+static void wait_for_shutdown(const sigset_t *wait_mask);
+static void parse_arguments(int argc, char *argv[], char **ip_address, char **port, char **backlog, char **backend, char **threads, char **max_connections, char **admin_path, char **unix_path, char **store_path);
+static void handle_arguments(const char *binary_name, const char *ip_address, const char *port_str, const char *backlog_str, const char *backend_str, const char *threads_str, const char *max_connections_str, const char *admin_path, const char *unix_path, in_port_t *port, int *backlog, EventBackend *backend, int *threads, size_t *max_connections);
+static EventBackend parse_backend(const char *binary_name, const char *str);
 static in_port_t parse_in_port_t(const char *binary_name, const char *port_str);
 static int parse_positive_int(const char *binary_name, const char *str);
 _Noreturn static void usage(const char *program_name, int exit_code, const char *message);
 static void convert_address(const char *address, struct sockaddr_storage *addr);
+static socklen_t convert_unix_address(const char *path, struct sockaddr_un *addr);
+static int is_valid_unix_path(const char *path);
 static int socket_create(int domain, int type, int protocol);
 static void socket_bind(int sockfd, struct sockaddr_storage *addr, in_port_t port);
 static void start_listening(int server_fd, int backlog);
+static void socket_set_reuseport(int sockfd);
 static void socket_close(int sockfd);
+// Admin socket
+static void admin_open(AdminServer *admin, const char *path, int shutdown_fd, const ReactorMetrics *metrics, const WordSketch *sketches, size_t reactors, StatsStore *store);
+static void admin_start(AdminServer *admin);
+static void *admin_main(void *arg);
+static void admin_serve(const AdminServer *admin, int fd, uint64_t *last_accepts, uint64_t *last_report_ms);
+static void admin_write_words(FILE *out, const AdminServer *admin, int json);
+static void admin_write(int fd, const char *data, size_t length);
+static void admin_stop(AdminServer *admin);
+
+static void checkpointer_start(Checkpointer *checkpointer, StatsStore *store, const ServerTotals *totals, int shutdown_fd);
+static void *checkpointer_main(void *arg);
+static void checkpointer_stop(Checkpointer *checkpointer);
+// Reactors
+static int create_listener(const struct sockaddr_storage *addr, in_port_t port, int backlog, int reuseport);
+static int create_unix_listener(const char *path, int backlog);
+static void remove_unix_socket(const char *path);
+static void assign_reactor_cpus(Reactor *reactors, int threads);
+static void start_reactors(Reactor *reactors, int threads);
+static void *reactor_main(void *arg);
+static int open_spare_fd(void);
+static int accept_connection(int listen_fd, int *spare_fd);
+// Client connections
+static void connection_pools_init(ConnectionPools *pools, size_t capacity, ReactorMetrics *metrics, WordSketch *sketch, ServerTotals *totals, StatsStore *store, int id);
+static void connection_pools_destroy(ConnectionPools *pools);
+static ClientData *client_create(ConnectionPools *pools, int socket_fd);
+static void client_destroy(ClientData *client, ConnectionPools *pools);
+static int client_init(ClientData *client, int socket_fd, ConnectionPools *pools);
+static ssize_t client_receive(ClientData *client);
+static int client_ingest(ClientData *client, const uint8_t *data, size_t length);
+static int client_process_input(ClientData *client);
+static int client_negotiate(ClientData *client, size_t *offset);
+static void client_end_of_input(ClientData *client);
+static void client_log_stats(const ClientData *client);
+static uint8_t *client_tx_reserve(ClientData *client, size_t length);
+static int client_has_output(const ClientData *client);
+static void client_queue_stats(ClientData *client);
+static int client_request_snapshot(ClientData *client);
+static int client_queue_snapshot(ClientData *client, const TextStatistics *counts);
+static void client_queue_snapshots(ClientData *client);
+static void client_drop_snapshots(ClientData *client);
+static int client_flush(ClientData *client);
+static int client_start_close(ClientData *client, CloseQueue *queue);
+static void client_close(ClientData *client, CloseQueue *queue, ConnectionPools *pools);
+static void client_release(ClientData *client, ConnectionPools *pools);
+static uint64_t monotonic_ms(void);
+static void close_queue_push(CloseQueue *queue, ClientData *client);
+static void close_queue_remove(CloseQueue *queue, ClientData *client);
+static int close_queue_timeout(const CloseQueue *queue);
 // Polling
-static struct pollfd *initialize_pollfds(int sockfd, ClientData **client_sockets);
-static void handle_new_connection(int sockfd, ClientData **client_sockets, nfds_t *max_clients, struct pollfd **fds, struct sockaddr_storage *client_addr, socklen_t *client_addr_len);
-static void handle_client_data(struct pollfd *fds, ClientData *client_sockets, nfds_t *max_clients);
-static void handle_client_disconnection(ClientData **client_sockets, nfds_t *max_clients, struct pollfd **fds, nfds_t client_index);
+static void run_poll_loop(const Reactor *reactor);
+static struct pollfd *initialize_pollfds(int sockfd, int unix_sockfd, int shutdown_fd, ClientData ***clients, size_t capacity);
+static void handle_new_connection(const struct pollfd *listener, int *spare_fd, ClientData **clients, nfds_t *max_clients, struct pollfd *fds, ConnectionPools *pools);
+static void handle_client_data(struct pollfd *fds, ClientData **clients, nfds_t *max_clients, CloseQueue *close_queue, ConnectionPools *pools);
+static void handle_client_disconnection(ClientData **clients, nfds_t *max_clients, struct pollfd *fds, nfds_t client_index, CloseQueue *close_queue, ConnectionPools *pools);
+static void handle_expired_closes(ClientData **clients, nfds_t *max_clients, struct pollfd *fds, CloseQueue *close_queue, ConnectionPools *pools);
+// epoll
+static void run_epoll_loop(const Reactor *reactor);
+static void epoll_add(int epoll_fd, int fd, uint32_t events, void *ptr);
+static void epoll_modify(int epoll_fd, int fd, uint32_t events, void *ptr);
+static void epoll_accept_connection(int epoll_fd, int sockfd, int *spare_fd, ClientData **clients, ConnectionPools *pools);
+static void epoll_handle_client(int epoll_fd, ClientData *client, uint32_t events, ClientData **clients, CloseQueue *close_queue, ConnectionPools *pools);
+static void epoll_drop_client(ClientData *client, ClientData **clients, CloseQueue *close_queue, ConnectionPools *pools);
+static void epoll_expire_closes(ClientData **clients, CloseQueue *close_queue, ConnectionPools *pools);
+static void client_list_add(ClientData *client, ClientData **clients);
+static void client_list_remove(ClientData *client, ClientData **clients);
+// io_uring
+static int run_uring_loop(const Reactor *reactor);
+static void uring_queue_accept(Uring *ring, int listen_fd);
+static void uring_accept_pending(Uring *ring, UringBufferRing *buffers, int listen_fd, int *spare_fd, ClientData **clients, ConnectionPools *pools);
+static void uring_queue_recv(Uring *ring, const UringBufferRing *buffers, ClientData *client);
+static void uring_queue_send(Uring *ring, ClientData *client);
+static void uring_queue_poll(Uring *ring, int fd, uint64_t user_data);
+static struct io_uring_sqe *uring_sqe(Uring *ring);
+static void uring_handle_recv(Uring *ring, UringBufferRing *buffers, ClientData *client, const struct io_uring_cqe *cqe, ClientData **clients, ConnectionPools *pools);
+static void uring_handle_send(Uring *ring, ClientData *client, int result, ClientData **clients, ConnectionPools *pools);
+static void uring_client_output(Uring *ring, ClientData *client);
+static void uring_client_fail(ClientData *client);
+static void uring_client_finish(ClientData *client, ClientData **clients, ConnectionPools *pools);
 
 #define UNKNOWN_OPTION_MESSAGE_LEN 24
 #define BASE_TEN 10
-#define MAX_WORD_LEN 256
+#define RX_BUFFER_SIZE 16384
+#define TX_BUFFER_SIZE 24576
+#define CLOSE_TIMEOUT_MS 5000 // How long a closing client has to read its reply
+#define DEFAULT_MAX_CONNECTIONS 1024
+#define MAX_EPOLL_EVENTS 256
+#define POLL_RESERVED_FDS 3 // The listening socket, the shutdown eventfd and the Unix listening socket
+#define SHUTDOWN_EVENT ((void *)-1)
+#define UNIX_LISTEN_EVENT ((void *)-2)
+#define ADMIN_BACKLOG 8
+#define ADMIN_REQUEST_SIZE 16
+#define ADMIN_TIMEOUT_MS 1000 // How long an admin client has to send its request and read the report
+#define URING_SQ_ENTRIES 256
+#define URING_CQ_ENTRIES 4096
+#define URING_BUFFER_COUNT 1024 // Provided receive buffers per reactor, a power of two
+#define URING_BUFFER_SIZE 4096
+#define URING_BUFFER_GROUP 0
+// io_uring user_data is a ClientData pointer, or for accepts and listen polls the
+// listening descriptor shifted up, with the operation in the low bits.
+#define URING_OP_ACCEPT 1
+#define URING_OP_RECV 2
+#define URING_OP_SEND 3
+#define URING_OP_SHUTDOWN 4
+#define URING_OP_LISTEN 5
+#define URING_OP_TIMEOUT 6
+#define URING_OP_MASK 7
+#define URING_OP_SHIFT 3
+#define URING_PENDING_RECV 1
+#define URING_PENDING_SEND 2
+// Connection protocol states besides the PROTOCOL_V* versions.
+#define PROTOCOL_PENDING 0    // Too few bytes yet to tell a v1 stream from a hello
+#define PROTOCOL_INVALID 0xff // The client broke the protocol; its input is ignored
+
+// Room a connection's last replies need: stats, top words, code points and totals.
+#define FINAL_REPLIES_MAX_SIZE (2 * STATS_REPLY_MAX_SIZE + TOP_WORDS_REPLY_MAX_SIZE + CODE_POINTS_REPLY_MAX_SIZE)
+
+_Static_assert(HELLO_REPLY_SIZE + STATS_REPLY_MAX_SIZE + FINAL_REPLIES_MAX_SIZE <= TX_BUFFER_SIZE, "The hello, a snapshot and the last replies must fit in the transmit buffer");
 
 static volatile sig_atomic_t exit_flag = 0; // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
 
@@ -63,81 +307,409 @@ int main(int argc, char *argv[])
     char *address;
     char *port_str;
     char *backlog_str;
+    char *backend_str;
+    char *threads_str;
+    char *max_connections_str;
+    char *admin_path;
+    char *unix_path;
+    char *store_path;
     in_port_t port;
     int backlog;
+    int threads;
+    size_t max_connections;
+    EventBackend backend;
     struct sockaddr_storage addr;
-    struct sockaddr_storage client_addr;
-    socklen_t client_addr_len;
-
-    // Polling
-    int sockfd;
-    ClientData *client_sockets = NULL;
-    nfds_t max_clients = 0;
-    struct pollfd *fds;
+    sigset_t block_mask;
+    sigset_t wait_mask;
+    Reactor *reactors;
+    ReactorMetrics *metrics;
+    WordSketch *sketches;
+    ServerTotals totals;
+    StatsStore store;
+    Checkpointer checkpointer;
+    AdminServer admin;
+    int shutdown_fd;
+    int unix_listen_fd;
+    int result;
 
     // Setup the server
     address = NULL;
     port_str = NULL;
     backlog_str = NULL;
-    parse_arguments(argc, argv, &address, &port_str, &backlog_str);
-    handle_arguments(argv[0], address, port_str, backlog_str, &port, &backlog);
+    backend_str = NULL;
+    threads_str = NULL;
+    max_connections_str = NULL;
+    admin_path = NULL;
+    unix_path = NULL;
+    store_path = NULL;
+    parse_arguments(argc, argv, &address, &port_str, &backlog_str, &backend_str, &threads_str, &max_connections_str, &admin_path, &unix_path, &store_path);
+    handle_arguments(argv[0], address, port_str, backlog_str, backend_str, threads_str, max_connections_str, admin_path, unix_path, &port, &backlog, &backend, &threads, &max_connections);
     convert_address(address, &addr);
-    sockfd = socket_create(addr.ss_family, SOCK_STREAM, 0);
-    socket_bind(sockfd, &addr, port);
-    start_listening(sockfd, backlog);
+
+    shutdown_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    if (shutdown_fd == -1)
+    {
+        perror("eventfd");
+        exit(EXIT_FAILURE);
+    }
+
+    reactors = (Reactor *)calloc((size_t)threads, sizeof(Reactor));
+
+    if (reactors == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    metrics = metrics_create((size_t)threads, max_connections);
+
+    if (metrics == NULL)
+    {
+        perror("Failed to allocate metrics");
+        exit(EXIT_FAILURE);
+    }
+
+    sketches = word_sketch_create((size_t)threads, monotonic_ms());
+
+    if (sketches == NULL)
+    {
+        perror("Failed to allocate word sketches");
+        exit(EXIT_FAILURE);
+    }
+
+    if (server_totals_init(&totals, (size_t)threads) == -1)
+    {
+        perror("Failed to allocate server totals");
+        exit(EXIT_FAILURE);
+    }
+
+    // The totals pick up where the store left off.
+    if (store_path != NULL)
+    {
+        if (store_open(&store, store_path) == -1)
+        {
+            perror("Failed to open the statistics store");
+            exit(EXIT_FAILURE);
+        }
+
+        totals.base = store.live->totals;
+    }
+
+    // Unix sockets have no SO_REUSEPORT, so the reactors share one and whichever
+    // wakes first accepts the connection.
+    unix_listen_fd = unix_path == NULL ? -1 : create_unix_listener(unix_path, backlog);
+
+    // Every reactor binds its own socket to the same address; the kernel spreads
+    // incoming connections across them.
+    for (int i = 0; i < threads; i++)
+    {
+        reactors[i].id = i;
+        reactors[i].listen_fd = create_listener(&addr, port, backlog, threads > 1);
+        reactors[i].unix_listen_fd = unix_listen_fd;
+        reactors[i].shutdown_fd = shutdown_fd;
+        reactors[i].backend = backend;
+        reactors[i].cpu = -1;
+        reactors[i].max_connections = max_connections;
+        reactors[i].metrics = &metrics[i];
+        reactors[i].sketch = &sketches[i];
+        reactors[i].totals = &totals;
+        reactors[i].store = store_path != NULL ? &store : NULL;
+    }
+
+    if (admin_path != NULL)
+    {
+        admin_open(&admin, admin_path, shutdown_fd, metrics, sketches, (size_t)threads, store_path != NULL ? &store : NULL);
+    }
+
+    if (threads > 1)
+    {
+        assign_reactor_cpus(reactors, threads);
+    }
+
+    // SIGINT is blocked in the reactor threads and only delivered to the main thread.
     setup_signal_handler();
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &block_mask, &wait_mask);
+
+    result = log_start();
+
+    if (result != 0)
+    {
+        fprintf(stderr, "Failed to start the logger: %s\n", strerror(result));
+        exit(EXIT_FAILURE);
+    }
+
+    start_reactors(reactors, threads);
+
+    if (admin_path != NULL)
+    {
+        admin_start(&admin);
+    }
+
+    if (store_path != NULL)
+    {
+        checkpointer_start(&checkpointer, &store, &totals, shutdown_fd);
+    }
+
+    wait_for_shutdown(&wait_mask);
+
+    if (eventfd_write(shutdown_fd, 1) == -1)
+    {
+        perror("eventfd_write");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(reactors[i].thread, NULL);
+        socket_close(reactors[i].listen_fd);
+    }
+
+    if (unix_listen_fd != -1)
+    {
+        socket_close(unix_listen_fd);
+        remove_unix_socket(unix_path);
+    }
+
+    // The shutdown eventfd stops the admin thread too.
+    if (admin_path != NULL)
+    {
+        admin_stop(&admin);
+    }
+
+    // After the reactors, so the last checkpoint has every upload.
+    if (store_path != NULL)
+    {
+        checkpointer_stop(&checkpointer);
+    }
+
+    log_stop();
+
+    metrics_destroy(metrics, (size_t)threads);
+    word_sketch_destroy(sketches);
+    server_totals_destroy(&totals);
+    free(reactors);
+    socket_close(shutdown_fd);
+    printf("Server exited successfully.\n");
+
+    return EXIT_SUCCESS;
+}
+
+static void wait_for_shutdown(const sigset_t *wait_mask)
+{
+    // wait_mask is the signal mask from before SIGINT was blocked, so the signal
+    // can only arrive inside sigsuspend and cannot be missed between the checks.
+    while (!exit_flag)
+    {
+        sigsuspend(wait_mask);
+    }
+}
+
+static int create_listener(const struct sockaddr_storage *addr, in_port_t port, int backlog, int reuseport)
+{
+    struct sockaddr_storage bind_addr;
+    int sockfd;
+
+    bind_addr = *addr;
+    sockfd = socket_create(bind_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (reuseport)
+    {
+        socket_set_reuseport(sockfd);
+    }
+
+    socket_bind(sockfd, &bind_addr, port);
+    start_listening(sockfd, backlog);
+
+    return sockfd;
+}
+
+// Binds a Unix listening socket, replacing whatever a previous run left at path.
+static int create_unix_listener(const char *path, int backlog)
+{
+    struct sockaddr_un addr;
+    socklen_t addr_len;
+    int sockfd;
+
+    addr_len = convert_unix_address(path, &addr);
+    sockfd = socket_create(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    remove_unix_socket(path);
+
+    if (bind(sockfd, (struct sockaddr *)&addr, addr_len) == -1)
+    {
+        perror("Failed to bind the Unix socket");
+        exit(EXIT_FAILURE);
+    }
+
+    start_listening(sockfd, backlog);
+
+    return sockfd;
+}
+
+// Removes a filesystem socket. Abstract sockets go away when they are closed.
+static void remove_unix_socket(const char *path)
+{
+    if (path[0] != '@' && unlink(path) == -1 && errno != ENOENT)
+    {
+        perror("Failed to remove the Unix socket");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void assign_reactor_cpus(Reactor *reactors, int threads)
+{
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE];
+    int cpu_count = 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+    {
+        perror("sched_getaffinity");
+        return;
+    }
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &allowed))
+        {
+            cpus[cpu_count++] = cpu;
+        }
+    }
+
+    for (int i = 0; i < threads && cpu_count > 0; i++)
+    {
+        reactors[i].cpu = cpus[i % cpu_count];
+    }
+}
+
+static void start_reactors(Reactor *reactors, int threads)
+{
+    for (int i = 0; i < threads; i++)
+    {
+        int result;
+
+        result = pthread_create(&reactors[i].thread, NULL, reactor_main, &reactors[i]);
+
+        if (result != 0)
+        {
+            fprintf(stderr, "pthread_create: %s\n", strerror(result));
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void *reactor_main(void *arg)
+{
+    const Reactor *reactor = (const Reactor *)arg;
+
+    if (reactor->cpu >= 0)
+    {
+        cpu_set_t cpuset;
+        int result;
+
+        CPU_ZERO(&cpuset);
+        CPU_SET(reactor->cpu, &cpuset);
+        result = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+
+        if (result != 0)
+        {
+            fprintf(stderr, "Reactor %d: pthread_setaffinity_np: %s\n", reactor->id, strerror(result));
+        }
+    }
+
+    if (reactor->backend == BACKEND_URING)
+    {
+        if (run_uring_loop(reactor) == 0)
+        {
+            return NULL;
+        }
+
+        fprintf(stderr, "Reactor %d: io_uring is not available (%s), using epoll\n", reactor->id, strerror(errno));
+        run_epoll_loop(reactor);
+    }
+    else if (reactor->backend == BACKEND_EPOLL)
+    {
+        run_epoll_loop(reactor);
+    }
+    else
+    {
+        run_poll_loop(reactor);
+    }
+
+    return NULL;
+}
 
-    fds = initialize_pollfds(sockfd, &client_sockets);
+static void run_poll_loop(const Reactor *reactor)
+{
+    ClientData **clients;
+    nfds_t max_clients = 0;
+    struct pollfd *fds;
+    CloseQueue close_queue = {NULL, NULL};
+    ConnectionPools pools;
+    int spare_fd;
+
+    // clients[i] is the connection polled by fds[i + POLL_RESERVED_FDS]; both
+    // arrays are dense and sized for the pool capacity.
+    connection_pools_init(&pools, reactor->max_connections, reactor->metrics, reactor->sketch, reactor->totals, reactor->store, reactor->id);
+    fds = initialize_pollfds(reactor->listen_fd, reactor->unix_listen_fd, reactor->shutdown_fd, &clients, reactor->max_connections);
+    spare_fd = open_spare_fd();
     while (!exit_flag)
     {
         int activity;
 
-        activity = poll(fds, max_clients + 1, -1);
+        activity = poll(fds, max_clients + POLL_RESERVED_FDS, close_queue_timeout(&close_queue));
 
         if (activity < 0)
         {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
             perror("Poll error");
             exit(EXIT_FAILURE);
         }
-        // printf("Polling Started\n");
-        // Handle new client connections
-        client_addr_len = sizeof(client_addr);
-        handle_new_connection(sockfd, &client_sockets, &max_clients, &fds, &client_addr, &client_addr_len);
-        // printf("Connection Made\n");
 
-        if (client_sockets != NULL)
+        metrics_count_wakeup(reactor->metrics, activity);
+        word_sketch_tick(reactor->sketch, monotonic_ms());
+        if (fds[1].revents & POLLIN)
         {
-            // Handle incoming data from existing clients
-            // printf("Handling Client Data\n");
-            handle_client_data(fds, client_sockets, &max_clients);
+            break;
         }
+
+        // Handle incoming data from existing clients before the new connection
+        // is appended, so its pollfd is not checked with a stale revents.
+        handle_client_data(fds, clients, &max_clients, &close_queue, &pools);
+        handle_expired_closes(clients, &max_clients, fds, &close_queue, &pools);
+
+        // Handle new client connections
+        handle_new_connection(&fds[0], &spare_fd, clients, &max_clients, fds, &pools);
+        handle_new_connection(&fds[2], &spare_fd, clients, &max_clients, fds, &pools);
     }
 
     free(fds);
+    close(spare_fd);
 
     // Cleanup and close all client sockets
     for (size_t i = 0; i < max_clients; i++)
     {
-        if (client_sockets[i].socket_fd > 0)
-        {
-            socket_close(client_sockets[i].socket_fd);
-        }
+        socket_close(clients[i]->socket_fd);
+        client_destroy(clients[i], &pools);
     }
 
-    free(client_sockets);
-    socket_close(sockfd);
-    printf("Server exited successfully.\n");
-
-    return EXIT_SUCCESS;
+    free(clients);
+    connection_pools_destroy(&pools);
 }
 
-static void parse_arguments(int argc, char *argv[], char **ip_address, char **port, char **backlog)
+static void parse_arguments(int argc, char *argv[], char **ip_address, char **port, char **backlog, char **backend, char **threads, char **max_connections, char **admin_path, char **unix_path, char **store_path)
 {
     int opt;
 
     opterr = 0;
 
-    while ((opt = getopt(argc, argv, "hb:")) != -1)
+    while ((opt = getopt(argc, argv, "hb:e:t:m:a:p:u:")) != -1)
     {
         switch (opt)
         {
@@ -146,6 +718,36 @@ static void parse_arguments(int argc, char *argv[], char **ip_address, char **po
             *backlog = optarg;
             break;
         }
+        case 'e':
+        {
+            *backend = optarg;
+            break;
+        }
+        case 't':
+        {
+            *threads = optarg;
+            break;
+        }
+        case 'm':
+        {
+            *max_connections = optarg;
+            break;
+        }
+        case 'a':
+        {
+            *admin_path = optarg;
+            break;
+        }
+        case 'p':
+        {
+            *store_path = optarg;
+            break;
+        }
+        case 'u':
+        {
+            *unix_path = optarg;
+            break;
+        }
         case 'h':
         {
             usage(argv[0], EXIT_SUCCESS, NULL);
@@ -183,7 +785,7 @@ static void parse_arguments(int argc, char *argv[], char **ip_address, char **po
     *port = argv[optind + 1];
 }
 
-static void handle_arguments(const char *binary_name, const char *ip_address, const char *port_str, const char *backlog_str, in_port_t *port, int *backlog)
+static void handle_arguments(const char *binary_name, const char *ip_address, const char *port_str, const char *backlog_str, const char *backend_str, const char *threads_str, const char *max_connections_str, const char *admin_path, const char *unix_path, in_port_t *port, int *backlog, EventBackend *backend, int *threads, size_t *max_connections)
 {
     if (ip_address == NULL)
     {
@@ -202,6 +804,63 @@ static void handle_arguments(const char *binary_name, const char *ip_address, co
 
     *port = parse_in_port_t(binary_name, port_str);
     *backlog = parse_positive_int(binary_name, backlog_str);
+    *backend = parse_backend(binary_name, backend_str);
+    *threads = 1;
+
+    if (threads_str != NULL)
+    {
+        *threads = parse_positive_int(binary_name, threads_str);
+
+        // -t 0 starts one reactor per online CPU
+        if (*threads == 0)
+        {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+            *threads = cpus > 0 ? (int)cpus : 1;
+        }
+    }
+
+    *max_connections = DEFAULT_MAX_CONNECTIONS;
+
+    if (max_connections_str != NULL)
+    {
+        *max_connections = (size_t)parse_positive_int(binary_name, max_connections_str);
+
+        if (*max_connections == 0)
+        {
+            usage(binary_name, EXIT_FAILURE, "The connection limit must be at least 1.");
+        }
+    }
+
+    if (admin_path != NULL && !is_valid_unix_path(admin_path))
+    {
+        usage(binary_name, EXIT_FAILURE, "The admin socket path is empty or too long.");
+    }
+
+    if (unix_path != NULL && !is_valid_unix_path(unix_path))
+    {
+        usage(binary_name, EXIT_FAILURE, "The Unix socket path is empty or too long.");
+    }
+}
+
+static EventBackend parse_backend(const char *binary_name, const char *str)
+{
+    if (str == NULL || strcmp(str, "epoll") == 0)
+    {
+        return BACKEND_EPOLL;
+    }
+
+    if (strcmp(str, "poll") == 0)
+    {
+        return BACKEND_POLL;
+    }
+
+    if (strcmp(str, "uring") == 0)
+    {
+        return BACKEND_URING;
+    }
+
+    usage(binary_name, EXIT_FAILURE, "The backend must be poll, epoll or uring.");
 }
 
 in_port_t parse_in_port_t(const char *binary_name, const char *str)
@@ -268,10 +927,16 @@ _Noreturn static void usage(const char *program_name, int exit_code, const char
         fprintf(stderr, "%s\n", message);
     }
 
-    fprintf(stderr, "Usage: %s [-h] -b <backlog> <ip address> <port>\n", program_name);
+    fprintf(stderr, "Usage: %s [-h] -b <backlog> [-e <backend>] [-t <threads>] [-m <connections>] [-a <path>] [-p <path>] [-u <path>] <ip address> <port>\n", program_name);
     fputs("Options:\n", stderr);
     fputs("  -h  Display this help message\n", stderr);
     fputs("  -b <backlog> the backlog\n", stderr);
+    fputs("  -e <backend> the event backend: epoll (default), poll or uring\n", stderr);
+    fputs("  -t <threads> the number of reactor threads, 0 for one per CPU (default 1)\n", stderr);
+    fputs("  -m <connections> the connection limit per reactor (default 1024)\n", stderr);
+    fputs("  -a <path> the Unix socket to serve live metrics on (default none)\n", stderr);
+    fputs("  -p <path> the file to keep totals and session statistics in across restarts (default none)\n", stderr);
+    fputs("  -u <path> a Unix socket to accept clients on as well, @name for an abstract one (default none)\n", stderr);
     exit(exit_code);
 }
 
@@ -304,6 +969,33 @@ static void convert_address(const char *address, struct sockaddr_storage *addr)
     }
 }
 
+// Fills addr for a filesystem socket path, or for an abstract socket if the path
+// starts with '@'. Returns the length of the address to bind to.
+static socklen_t convert_unix_address(const char *path, struct sockaddr_un *addr)
+{
+    size_t length = strlen(path);
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, path, length);
+
+    if (path[0] == '@')
+    {
+        // An abstract name is exactly as long as the address says; it is not terminated.
+        addr->sun_path[0] = '\0';
+        return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + length);
+    }
+
+    return (socklen_t)sizeof(*addr);
+}
+
+static int is_valid_unix_path(const char *path)
+{
+    size_t length = strlen(path);
+
+    return length > 0 && length < sizeof(((struct sockaddr_un *)NULL)->sun_path) && strcmp(path, "@") != 0;
+}
+
 static int socket_create(int domain, int type, int protocol)
 {
     int sockfd;
@@ -407,154 +1099,437 @@ static void setup_signal_handler(void)
     }
 }
 
-static void socket_close(int sockfd)
+static void socket_set_reuseport(int sockfd)
 {
-    if (close(sockfd) == -1)
+    int enable = 1;
+
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) == -1)
+    {
+        perror("setsockopt SO_REUSEPORT");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void socket_close(int sockfd)
+{
+    if (close(sockfd) == -1)
     {
         perror("Error closing socket");
         exit(EXIT_FAILURE);
     }
 }
 
-static void handle_new_connection(int sockfd, ClientData **client_sockets, nfds_t *max_clients, struct pollfd **fds, struct sockaddr_storage *client_addr, socklen_t *client_addr_len)
+// Binds the admin socket, replacing whatever a previous run left at path.
+static void admin_open(AdminServer *admin, const char *path, int shutdown_fd, const ReactorMetrics *metrics, const WordSketch *sketches, size_t reactors, StatsStore *store)
+{
+    struct sockaddr_un addr;
+    socklen_t addr_len;
+
+    admin->path = path;
+    admin->shutdown_fd = shutdown_fd;
+    admin->metrics = metrics;
+    admin->sketches = sketches;
+    admin->reactors = reactors;
+    admin->store = store;
+    admin->listen_fd = socket_create(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    addr_len = convert_unix_address(path, &addr);
+    remove_unix_socket(path);
+
+    if (bind(admin->listen_fd, (struct sockaddr *)&addr, addr_len) == -1)
+    {
+        perror("Failed to bind the admin socket");
+        exit(EXIT_FAILURE);
+    }
+
+    if (listen(admin->listen_fd, ADMIN_BACKLOG) == -1)
+    {
+        perror("Failed to listen on the admin socket");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void admin_start(AdminServer *admin)
 {
-    if ((*fds)[0].revents & POLLIN)
+    int result;
+
+    result = pthread_create(&admin->thread, NULL, admin_main, admin);
+
+    if (result != 0)
     {
-        ClientData *temp;
-        TextStatistics *stats_temp;
-        int new_socket;
+        fprintf(stderr, "pthread_create: %s\n", strerror(result));
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Serves one admin client at a time until the shutdown eventfd is written.
+static void *admin_main(void *arg)
+{
+    const AdminServer *admin = (const AdminServer *)arg;
+    struct pollfd fds[2];
+    uint64_t last_accepts = 0;
+    uint64_t last_report_ms = monotonic_ms();
+
+    fds[0].fd = admin->listen_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = admin->shutdown_fd;
+    fds[1].events = POLLIN;
 
-        // printf("Accept request about to be made\n");
-        new_socket = accept(sockfd, (struct sockaddr *)client_addr, client_addr_len);
-        // printf("Accept request made, Socket: %d\n", new_socket);
+    for (;;)
+    {
+        int fd;
 
-        if (new_socket == -1)
+        if (poll(fds, 2, -1) < 0)
         {
-            perror("Accept error");
-            exit(EXIT_FAILURE);
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            LOG_ERROR("Admin socket poll error: %s", strerror(errno));
+            return NULL;
         }
 
-        // printf("Allocating memory Client Data \n");
-        (*max_clients)++;
-        temp = (ClientData *)realloc(*client_sockets, sizeof(ClientData) * (*max_clients));
-        if (temp == NULL)
+        if (fds[1].revents & POLLIN)
         {
-            perror("realloc");
-            free(*client_sockets);
-            exit(EXIT_FAILURE);
+            return NULL;
         }
 
-        // printf("Allocating memory Text Statistics\n");
-        stats_temp = (TextStatistics *)calloc(1, sizeof(TextStatistics));
-        if (stats_temp == NULL)
+        while ((fd = accept4(admin->listen_fd, NULL, NULL, SOCK_CLOEXEC)) != -1)
         {
-            perror("calloc");
-            free(*client_sockets);
-            free(temp);
-            exit(EXIT_FAILURE);
+            admin_serve(admin, fd, &last_accepts, &last_report_ms);
+            close(fd);
         }
-        initialize_stats_zero(stats_temp);
-        // printf("Text Statistics to 0\n");
-        struct pollfd *new_fds;
-        *client_sockets = temp;
-        (*client_sockets)[(*max_clients) - 1].socket_fd = new_socket;
-        (*client_sockets)[(*max_clients) - 1].stats = stats_temp;
+    }
+}
+
+// Reads the client's request, if it sends one in time, and writes the report it
+// asked for. The accept rate covers the time since the previous report.
+static void admin_serve(const AdminServer *admin, int fd, uint64_t *last_accepts, uint64_t *last_report_ms)
+{
+    struct timeval timeout = {ADMIN_TIMEOUT_MS / 1000, (ADMIN_TIMEOUT_MS % 1000) * 1000};
+    char request[ADMIN_REQUEST_SIZE];
+    MetricsTotals totals;
+    char *report = NULL;
+    size_t report_len = 0;
+    ssize_t received;
+    uint64_t now;
+    FILE *out;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    received = recv(fd, request, sizeof(request) - 1, 0);
+    request[received > 0 ? received : 0] = '\0';
+
+    metrics_sum(admin->metrics, admin->reactors, &totals);
+    now = monotonic_ms();
+
+    if (now > *last_report_ms)
+    {
+        totals.accepts_per_second = (double)(totals.accepts - *last_accepts) * 1000.0 / (double)(now - *last_report_ms);
+    }
+
+    *last_accepts = totals.accepts;
+    *last_report_ms = now;
+
+    out = open_memstream(&report, &report_len);
 
-        // printf("Allocating memory new fds\n");
-        new_fds = (struct pollfd *)realloc(*fds, (*max_clients + 1) * sizeof(struct pollfd));
-        if (new_fds == NULL)
+    if (out == NULL)
+    {
+        LOG_ERROR("Admin report: %s", strerror(errno));
+        return;
+    }
+
+    if (strncmp(request, "words", 5) == 0)
+    {
+        admin_write_words(out, admin, strstr(request, "json") != NULL);
+    }
+    else if (strncmp(request, "sessions", 8) == 0)
+    {
+        if (admin->store != NULL)
         {
-            perror("realloc");
-            free(*client_sockets);
-            exit(EXIT_FAILURE);
+            store_write_sessions(out, admin->store);
+        }
+        else
+        {
+            fputs("no store, start the server with -p\n", out);
         }
-        *fds = new_fds;
-        (*fds)[*max_clients].fd = new_socket;
-        (*fds)[*max_clients].events = POLLIN;
     }
-    // printf("End\n");
+    else if (strncmp(request, "json", 4) == 0)
+    {
+        metrics_write_json(out, admin->metrics, admin->reactors, &totals);
+    }
+    else
+    {
+        metrics_write_text(out, admin->metrics, admin->reactors, &totals);
+    }
+
+    fclose(out);
+    admin_write(fd, report, report_len);
+    free(report);
 }
 
-static void handle_client_data(struct pollfd *fds, ClientData *client_sockets, nfds_t *max_clients)
+// Merges every reactor's word sketch, as it stands, into one report.
+static void admin_write_words(FILE *out, const AdminServer *admin, int json)
 {
-    for (nfds_t i = 0; i < *max_clients; i++)
+    SketchQuery *query;
+    uint64_t now = monotonic_ms();
+
+    query = (SketchQuery *)malloc(sizeof(SketchQuery));
+
+    if (query == NULL)
+    {
+        LOG_ERROR("Admin word report: %s", strerror(errno));
+        return;
+    }
+
+    sketch_query_init(query);
+
+    for (size_t i = 0; i < admin->reactors; i++)
     {
-        if (client_sockets[i].socket_fd != -1 && (fds[i + 1].revents & POLLIN))
+        if (sketch_query_add(query, &admin->sketches[i], now) == -1)
         {
-            char word_length;
-            ssize_t valread;
+            LOG_ERROR("Admin word report: %s", strerror(errno));
+            break;
+        }
+    }
+
+    sketch_query_finish(query);
+
+    if (json)
+    {
+        sketch_write_json(out, query);
+    }
+    else
+    {
+        sketch_write_text(out, query);
+    }
+
+    sketch_query_free(query);
+    free(query);
+}
 
-            valread = read(client_sockets[i].socket_fd, &word_length, sizeof(word_length));
+static void admin_write(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
 
-            if (valread <= 0)
+        if (sent == -1)
+        {
+            if (errno == EINTR)
             {
-                // Connection closed or error
-                printf("Client %d disconnected\n", client_sockets[i].socket_fd);
-                handle_client_disconnection(&client_sockets, max_clients, &fds, i);
+                continue;
             }
-            else
+
+            return;
+        }
+
+        data += sent;
+        length -= (size_t)sent;
+    }
+}
+
+static void admin_stop(AdminServer *admin)
+{
+    pthread_join(admin->thread, NULL);
+    socket_close(admin->listen_fd);
+    remove_unix_socket(admin->path);
+}
+
+static void checkpointer_start(Checkpointer *checkpointer, StatsStore *store, const ServerTotals *totals, int shutdown_fd)
+{
+    int result;
+
+    checkpointer->store = store;
+    checkpointer->totals = totals;
+    checkpointer->shutdown_fd = shutdown_fd;
+    result = pthread_create(&checkpointer->thread, NULL, checkpointer_main, checkpointer);
+
+    if (result != 0)
+    {
+        fprintf(stderr, "pthread_create: %s\n", strerror(result));
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Checkpoints the store until the shutdown eventfd is written.
+static void *checkpointer_main(void *arg)
+{
+    const Checkpointer *checkpointer = (const Checkpointer *)arg;
+    struct pollfd shutdown_event;
+
+    shutdown_event.fd = checkpointer->shutdown_fd;
+    shutdown_event.events = POLLIN;
+
+    for (;;)
+    {
+        int ready = poll(&shutdown_event, 1, STORE_CHECKPOINT_MS);
+
+        if (ready > 0)
+        {
+            return NULL;
+        }
+
+        if (ready == 0 && store_checkpoint(checkpointer->store, checkpointer->totals) == -1)
+        {
+            LOG_ERROR("Failed to checkpoint the statistics store: %s", strerror(errno));
+        }
+    }
+}
+
+// Stops the thread, takes a last checkpoint and closes the store.
+static void checkpointer_stop(Checkpointer *checkpointer)
+{
+    pthread_join(checkpointer->thread, NULL);
+
+    if (store_checkpoint(checkpointer->store, checkpointer->totals) == -1)
+    {
+        LOG_ERROR("Failed to checkpoint the statistics store: %s", strerror(errno));
+    }
+
+    store_close(checkpointer->store);
+}
+
+static void handle_new_connection(const struct pollfd *listener, int *spare_fd, ClientData **clients, nfds_t *max_clients, struct pollfd *fds, ConnectionPools *pools)
+{
+    int new_socket;
+
+    if ((listener->revents & POLLIN) == 0)
+    {
+        return;
+    }
+
+    // Drain the accept queue so a burst of connections costs one wakeup.
+    while ((new_socket = accept_connection(listener->fd, spare_fd)) != -1)
+    {
+        ClientData *client;
+
+        client = client_create(pools, new_socket);
+
+        if (client == NULL)
+        {
+            continue;
+        }
+
+        client->slot = *max_clients;
+        clients[*max_clients] = client;
+        fds[*max_clients + POLL_RESERVED_FDS].fd = new_socket;
+        fds[*max_clients + POLL_RESERVED_FDS].events = POLLIN;
+        fds[*max_clients + POLL_RESERVED_FDS].revents = 0;
+        (*max_clients)++;
+    }
+}
+
+static void handle_client_data(struct pollfd *fds, ClientData **clients, nfds_t *max_clients, CloseQueue *close_queue, ConnectionPools *pools)
+{
+    // Walk the table backwards: a disconnect moves the last entry, which has
+    // already been handled, into the freed slot.
+    for (nfds_t i = *max_clients; i-- > 0;)
+    {
+        ClientData *client = clients[i];
+        short revents = fds[i + POLL_RESERVED_FDS].revents;
+
+        if (client->close_deadline != 0)
+        {
+            // Closing: only the rest of the reply is left to send.
+            if ((revents & (POLLOUT | POLLHUP | POLLERR)) && client_flush(client) != 0)
+            {
+                handle_client_disconnection(clients, max_clients, fds, i, close_queue, pools);
+            }
+
+            continue;
+        }
+
+        if (revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            ssize_t received;
+
+            // One recv per wakeup; poll reports the socket again if more is waiting.
+            received = client_receive(client);
+
+            if (received > 0 && client_process_input(client) == -1)
             {
-                char word[MAX_WORD_LEN];
+                LOG_WARN("Client %d broke the protocol, closing", client->socket_fd);
+                handle_client_disconnection(clients, max_clients, fds, i, close_queue, pools);
+                continue;
+            }
 
-                valread = read(client_sockets[i].socket_fd, word, (size_t)word_length);
+            if (received < 0)
+            {
+                // Connection closed or error
+                LOG_INFO("Client %d disconnected", client->socket_fd);
 
-                if (valread <= 0)
+                if (client_start_close(client, close_queue))
                 {
-                    // Connection closed or error
-                    printf("Client %d disconnected\n", client_sockets[i].socket_fd);
-                    handle_client_disconnection(&client_sockets, max_clients, &fds, i);
+                    handle_client_disconnection(clients, max_clients, fds, i, close_queue, pools);
                 }
                 else
                 {
-                    word[valread] = '\0';
-                    client_sockets[i].stats->word_count++;
-                    client_sockets[i].stats->character_count += strlen(word);
-                    update_character_frequency(word, strlen(word), client_sockets[i].stats->character_frequency);
-
-                    printf("Received word from client %d: %s\n", client_sockets[i].socket_fd, word);
+                    fds[i + POLL_RESERVED_FDS].events = POLLOUT;
                 }
+
+                continue;
+            }
+        }
+
+        // Replies sent while the client is still sending, such as the hello reply.
+        if (client_has_output(client))
+        {
+            int flushed = client_flush(client);
+
+            if (flushed < 0)
+            {
+                handle_client_disconnection(clients, max_clients, fds, i, close_queue, pools);
+                continue;
             }
+
+            fds[i + POLL_RESERVED_FDS].events = flushed ? POLLIN : POLLIN | POLLOUT;
         }
     }
 }
 
-static void handle_client_disconnection(ClientData **client_sockets, nfds_t *max_clients, struct pollfd **fds, nfds_t client_index)
+// Closes the client and fills its slot with the last entry, so removal is O(1).
+static void handle_client_disconnection(ClientData **clients, nfds_t *max_clients, struct pollfd *fds, nfds_t client_index, CloseQueue *close_queue, ConnectionPools *pools)
 {
-    size_t stats_len = sizeof(TextStatistics);
-    write_stats(client_sockets, client_index, stats_len);
-    print_stats((*client_sockets)[client_index].stats);
+    nfds_t last = *max_clients - 1;
 
-    int disconnected_socket = (*client_sockets)[client_index].socket_fd;
-    close(disconnected_socket);
+    client_close(clients[client_index], close_queue, pools);
+    pool_free(&pools->clients, clients[client_index]);
 
-    if ((*client_sockets)[client_index].stats != NULL)
-    {
-        free((*client_sockets)[client_index].stats);
-        (*client_sockets)[client_index].stats = NULL;
-    }
+    clients[client_index] = clients[last];
+    clients[client_index]->slot = client_index;
+    fds[client_index + POLL_RESERVED_FDS] = fds[last + POLL_RESERVED_FDS];
+    (*max_clients)--;
+}
+
+// Closes the connections whose reply has not drained by their deadline.
+static void handle_expired_closes(ClientData **clients, nfds_t *max_clients, struct pollfd *fds, CloseQueue *close_queue, ConnectionPools *pools)
+{
+    uint64_t now;
 
-    for (nfds_t i = client_index; i < *max_clients - 1; i++)
+    if (close_queue->head == NULL)
     {
-        (*client_sockets)[i] = (*client_sockets)[i + 1];
+        return;
     }
 
-    (*max_clients)--;
+    now = monotonic_ms();
 
-    for (nfds_t i = client_index + 1; i <= *max_clients; i++)
+    while (close_queue->head != NULL && close_queue->head->close_deadline <= now)
     {
-        (*fds)[i] = (*fds)[i + 1];
+        LOG_WARN("Client %d did not read its stats in time, closing", close_queue->head->socket_fd);
+        handle_client_disconnection(clients, max_clients, fds, close_queue->head->slot, close_queue, pools);
     }
 }
 
-static struct pollfd *initialize_pollfds(int sockfd, ClientData **client_sockets)
+static struct pollfd *initialize_pollfds(int sockfd, int unix_sockfd, int shutdown_fd, ClientData ***clients, size_t capacity)
 {
     struct pollfd *fds;
 
-    *client_sockets = NULL;
-
-    fds = (struct pollfd *)malloc((1) * sizeof(struct pollfd));
+    *clients = (ClientData **)calloc(capacity, sizeof(ClientData *));
+    fds = (struct pollfd *)malloc((capacity + POLL_RESERVED_FDS) * sizeof(struct pollfd));
 
-    if (fds == NULL)
+    if (fds == NULL || *clients == NULL)
     {
         perror("malloc");
         exit(EXIT_FAILURE);
@@ -562,6 +1537,1380 @@ static struct pollfd *initialize_pollfds(int sockfd, ClientData **client_sockets
 
     fds[0].fd = sockfd;
     fds[0].events = POLLIN;
+    fds[1].fd = shutdown_fd;
+    fds[1].events = POLLIN;
+    fds[2].fd = unix_sockfd; // poll skips it while it is -1
+    fds[2].events = POLLIN;
+    fds[2].revents = 0;
 
     return fds;
-}
\ No newline at end of file
+}
+
+// Opens a descriptor that is held in reserve and given up when accept fails with
+// EMFILE or ENFILE, so the pending connection can be accepted and closed.
+static int open_spare_fd(void)
+{
+    int fd;
+
+    fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1)
+    {
+        perror("open /dev/null");
+    }
+
+    return fd;
+}
+
+// Accepts one non-blocking connection. Returns its descriptor, or -1 once the
+// queue is empty or accepting should stop until the next wakeup. Transient
+// errors are reported and never terminate the server.
+static int accept_connection(int listen_fd, int *spare_fd)
+{
+    for (;;)
+    {
+        int fd;
+
+        fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd != -1)
+        {
+            return fd;
+        }
+
+        switch (errno)
+        {
+        case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+        case EWOULDBLOCK:
+#endif
+        {
+            return -1;
+        }
+        case EINTR:
+        case ECONNABORTED:
+        case EPROTO:
+        {
+            // The connection went away before it was accepted; try the next one.
+            continue;
+        }
+        case EMFILE:
+        case ENFILE:
+        {
+            LOG_ERROR("Accept error: %s", strerror(errno));
+
+            if (*spare_fd == -1)
+            {
+                return -1;
+            }
+
+            // Out of descriptors: use the spare one to take the connection off
+            // the queue and close it, rather than spinning on it every wakeup.
+            close(*spare_fd);
+            fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+            if (fd != -1)
+            {
+                close(fd);
+            }
+
+            *spare_fd = open_spare_fd();
+
+            // accept reports EMFILE even with an empty queue, so stop once there
+            // was nothing left to shed.
+            if (fd == -1)
+            {
+                return -1;
+            }
+
+            continue;
+        }
+        default:
+        {
+            // ENOBUFS, ENOMEM and the like: give the system a chance to recover.
+            LOG_ERROR("Accept error: %s", strerror(errno));
+            return -1;
+        }
+        }
+    }
+}
+
+static void connection_pools_init(ConnectionPools *pools, size_t capacity, ReactorMetrics *metrics, WordSketch *sketch, ServerTotals *totals, StatsStore *store, int id)
+{
+    pools->capacity = capacity;
+    pools->metrics = metrics;
+    pools->sketch = sketch;
+    pools->totals = totals;
+    pools->shard = &totals->shards[id];
+    pools->store = store;
+
+    if (pool_init(&pools->clients, sizeof(ClientData), capacity) == -1 || pool_init(&pools->stats, sizeof(TextStatistics), capacity) == -1 || pool_init(&pools->snapshots, sizeof(TextStatistics), capacity * (1 + SNAPSHOTS_PENDING_MAX)) == -1 || pool_init(&pools->rx_buffers, RX_BUFFER_SIZE, capacity) == -1 || pool_init(&pools->tx_buffers, TX_BUFFER_SIZE, capacity) == -1)
+    {
+        perror("Failed to map connection pools");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void connection_pools_destroy(ConnectionPools *pools)
+{
+    pool_destroy(&pools->clients);
+    pool_destroy(&pools->stats);
+    pool_destroy(&pools->snapshots);
+    pool_destroy(&pools->rx_buffers);
+    pool_destroy(&pools->tx_buffers);
+}
+
+// Takes a ClientData from the pool for socket_fd. If the pool is exhausted the
+// socket is closed and NULL is returned.
+static ClientData *client_create(ConnectionPools *pools, int socket_fd)
+{
+    ClientData *client;
+
+    client = (ClientData *)pool_alloc(&pools->clients);
+
+    if (client == NULL || client_init(client, socket_fd, pools) == -1)
+    {
+        LOG_WARN("Connection limit reached, closing client %d", socket_fd);
+        pool_free(&pools->clients, client);
+        close(socket_fd);
+        return NULL;
+    }
+
+    return client;
+}
+
+static void client_destroy(ClientData *client, ConnectionPools *pools)
+{
+    client_release(client, pools);
+    pool_free(&pools->clients, client);
+}
+
+// Returns -1 if the pools have no statistics or buffers left.
+static int client_init(ClientData *client, int socket_fd, ConnectionPools *pools)
+{
+    client->socket_fd = socket_fd;
+    client->rx_len = 0;
+    client->tx_len = 0;
+    client->tx_sent = 0;
+    client->close_deadline = 0;
+    client->protocol = PROTOCOL_PENDING;
+    client->uring_ops = 0;
+    client->metrics = pools->metrics;
+    client->counters = NULL;
+    client->shard = pools->shard;
+    client->totals = pools->totals;
+    client->snapshot = NULL;
+    client->snapshots = &pools->snapshots;
+    client->snapshots_pending = 0;
+    client->store = pools->store;
+    word_table_init(&client->words);
+    client->stats = (TextStatistics *)pool_alloc(&pools->stats);
+    client->rx_buffer = (uint8_t *)pool_alloc(&pools->rx_buffers);
+    client->tx_buffer = (uint8_t *)pool_alloc(&pools->tx_buffers);
+
+    if (client->stats == NULL || client->rx_buffer == NULL || client->tx_buffer == NULL)
+    {
+        client_release(client, pools);
+        return -1;
+    }
+
+    initialize_stats_zero(client->stats);
+    parser_init(&client->parser, client->stats, NULL, pools->sketch, socket_fd, 1);
+    client->counters = &pools->metrics->connections[pool_index(&pools->clients, client)];
+    metrics_connection_open(client->metrics, client->counters, socket_fd);
+
+    return 0;
+}
+
+// Fills the free end of the receive buffer with a single recv.
+// Returns the number of bytes added, 0 if no data is waiting and -1 if the connection is done.
+static ssize_t client_receive(ClientData *client)
+{
+    ssize_t valread;
+
+    valread = recv(client->socket_fd, client->rx_buffer + client->rx_len, RX_BUFFER_SIZE - client->rx_len, 0);
+
+    if (valread < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        {
+            return 0;
+        }
+
+        return -1;
+    }
+
+    if (valread == 0)
+    {
+        return -1;
+    }
+
+    client->rx_len += (size_t)valread;
+    metrics_count_received(client->metrics, client->counters, (size_t)valread);
+
+    return valread;
+}
+
+// Appends bytes that were received outside the receive buffer (by the io_uring
+// backend, into a provided buffer) and parses them like a regular receive.
+// Returns 0, or -1 if the client broke the protocol.
+static int client_ingest(ClientData *client, const uint8_t *data, size_t length)
+{
+    metrics_count_received(client->metrics, client->counters, length);
+
+    while (length > 0)
+    {
+        size_t chunk = RX_BUFFER_SIZE - client->rx_len;
+
+        if (chunk > length)
+        {
+            chunk = length;
+        }
+
+        memcpy(client->rx_buffer + client->rx_len, data, chunk);
+        client->rx_len += chunk;
+
+        if (client_process_input(client) == -1)
+        {
+            return -1;
+        }
+
+        data += chunk;
+        length -= chunk;
+    }
+
+    return 0;
+}
+
+// Parses everything in the receive buffer that can be parsed and moves the rest
+// to the front of the buffer for the next receive. Returns 0, or -1 if the client
+// broke the protocol.
+static int client_process_input(ClientData *client)
+{
+    size_t offset = 0;
+    int result = 0;
+
+    if (client->protocol == PROTOCOL_PENDING)
+    {
+        result = client_negotiate(client, &offset);
+
+        if (result <= 0)
+        {
+            return result;
+        }
+
+        result = 0;
+    }
+
+    result = parser_parse(&client->parser, client->protocol, client->rx_buffer, client->rx_len, &offset);
+
+    // Parsing stops at each snapshot request so the snapshot covers the words
+    // before it and none after.
+    while (result == 0 && client->parser.snapshot_requested)
+    {
+        client->parser.snapshot_requested = 0;
+        result = client_request_snapshot(client);
+
+        if (result == 0)
+        {
+            result = parser_parse(&client->parser, client->protocol, client->rx_buffer, client->rx_len, &offset);
+        }
+    }
+
+    client->rx_len -= offset;
+
+    if (client->rx_len > 0 && offset > 0)
+    {
+        memmove(client->rx_buffer, client->rx_buffer + offset, client->rx_len);
+    }
+
+    metrics_count_words(client->metrics, client->counters, client->stats->word_count);
+
+    return result;
+}
+
+// Settles the protocol from the first bytes of the connection, answering a hello
+// with the version picked. Returns 1 once settled, 0 if more bytes are needed to
+// tell and -1 if the hello is invalid.
+static int client_negotiate(ClientData *client, size_t *offset)
+{
+    uint8_t *reply;
+    uint8_t version;
+    int hello;
+
+    hello = hello_parse(client->rx_buffer, client->rx_len, &version);
+
+    if (hello == 0)
+    {
+        return 0;
+    }
+
+    if (hello < 0)
+    {
+        client->protocol = PROTOCOL_V1;
+        return 1;
+    }
+
+    reply = client_tx_reserve(client, HELLO_REPLY_SIZE);
+
+    if (version < PROTOCOL_V1 || reply == NULL)
+    {
+        return -1;
+    }
+
+    client->protocol = version < PROTOCOL_MAX_VERSION ? version : PROTOCOL_MAX_VERSION;
+    client->tx_len += hello_reply_encode(reply, client->protocol);
+
+    // Only version 3 clients get their top words back, so only they pay for the table.
+    if (client->protocol >= PROTOCOL_V3)
+    {
+        client->parser.words = &client->words;
+    }
+
+    *offset = HELLO_SIZE;
+
+    return 1;
+}
+
+// Called once the client has finished sending, before its reply is queued.
+static void client_end_of_input(ClientData *client)
+{
+    // A stream too short to tell apart from a hello is a v1 stream.
+    if (client->protocol == PROTOCOL_PENDING && client->rx_len > 0)
+    {
+        client->protocol = PROTOCOL_V1;
+        client_process_input(client);
+    }
+
+    parser_finish(&client->parser);
+
+    // Snapshots that still find no room are covered by the stats reply.
+    if (client->protocol != PROTOCOL_INVALID)
+    {
+        client_queue_snapshots(client);
+    }
+
+    client_drop_snapshots(client);
+
+    metrics_count_words(client->metrics, client->counters, client->stats->word_count);
+
+    if (client->protocol != PROTOCOL_INVALID)
+    {
+        stats_shard_add(client->shard, client->stats);
+
+        if (client->store != NULL && client->parser.session_key_len > 0 && !store_session_add(client->store, client->parser.session_key, client->parser.session_key_len, client->stats))
+        {
+            LOG_WARN("The session store is full, client %d's session is not kept", client->socket_fd);
+        }
+    }
+}
+
+// Logs the counts a client's upload came to. The frequency table is debug output.
+static void client_log_stats(const ClientData *client)
+{
+    LOG_INFO("Client %d: Word Count: %llu, Character Count: %llu", client->socket_fd, client->stats->word_count, client->stats->character_count);
+
+#ifndef NDEBUG
+    for (int i = 0; i < MAX_ASCII_CHAR; i++)
+    {
+        if (client->stats->character_frequency[i] != 0)
+        {
+            LOG_DEBUG("Client %d: Character: %c Frequency: %llu", client->socket_fd, (char)i, client->stats->character_frequency[i]);
+        }
+    }
+#endif
+}
+
+// Returns room for length more bytes at the end of the transmit buffer, or NULL
+// if the output that has not been sent yet leaves too little.
+static uint8_t *client_tx_reserve(ClientData *client, size_t length)
+{
+    if (client->tx_sent == client->tx_len)
+    {
+        client->tx_sent = 0;
+        client->tx_len = 0;
+    }
+    else if (client->tx_sent > 0 && (client->uring_ops & URING_PENDING_SEND) == 0)
+    {
+        memmove(client->tx_buffer, client->tx_buffer + client->tx_sent, client->tx_len - client->tx_sent);
+        client->tx_len -= client->tx_sent;
+        client->tx_sent = 0;
+    }
+
+    if (TX_BUFFER_SIZE - client->tx_len < length)
+    {
+        return NULL;
+    }
+
+    return client->tx_buffer + client->tx_len;
+}
+
+static int client_has_output(const ClientData *client)
+{
+    return client->tx_sent < client->tx_len;
+}
+
+// Encodes the client's statistics into its transmit buffer, followed by its top
+// words if the client speaks version 3 and the server totals if it asked for them.
+static void client_queue_stats(ClientData *client)
+{
+    int top_words = client->protocol >= PROTOCOL_V3 && client->protocol != PROTOCOL_INVALID;
+    int totals = client->parser.totals_requested && client->protocol != PROTOCOL_INVALID;
+    int code_points = client->parser.utf8 != NULL && client->protocol != PROTOCOL_INVALID;
+    uint8_t *reply;
+    size_t reply_len;
+
+    reply = client_tx_reserve(client, STATS_REPLY_MAX_SIZE + (top_words ? TOP_WORDS_REPLY_MAX_SIZE : 0) + (code_points ? CODE_POINTS_REPLY_MAX_SIZE : 0) + (totals ? STATS_REPLY_MAX_SIZE : 0));
+
+    if (reply == NULL)
+    {
+        LOG_WARN("No room to queue the stats reply for client %d", client->socket_fd);
+        return;
+    }
+
+    reply_len = encode_stats(client->stats, REPLY_STATS, reply);
+
+    if (top_words)
+    {
+        TopWords top;
+
+        word_table_top(&client->words, &top);
+        reply_len += encode_top_words(&top, reply + reply_len);
+    }
+
+    if (code_points)
+    {
+        reply_len += encode_code_points(client->parser.utf8, client->stats->character_frequency, reply + reply_len);
+    }
+
+    if (totals)
+    {
+        TextStatistics total;
+
+        server_totals_read(client->totals, &total);
+        reply_len += encode_stats(&total, REPLY_TOTALS, reply + reply_len);
+    }
+
+    client->tx_len += reply_len;
+    LOG_DEBUG("Stats_len %zu", reply_len);
+}
+
+// Answers a snapshot request straight away if the transmit buffer has room,
+// or else keeps the counts it was made at until there is. Returns 0, or -1 if
+// the client already has SNAPSHOTS_PENDING_MAX requests waiting.
+static int client_request_snapshot(ClientData *client)
+{
+    TextStatistics *counts;
+
+    if (client->snapshots_pending == 0 && client_queue_snapshot(client, client->stats) == 0)
+    {
+        return 0;
+    }
+
+    if (client->snapshots_pending == SNAPSHOTS_PENDING_MAX)
+    {
+        return -1;
+    }
+
+    counts = (TextStatistics *)pool_alloc(client->snapshots);
+    *counts = *client->stats;
+    client->deferred[client->snapshots_pending++] = counts;
+
+    return 0;
+}
+
+// Queues a snapshot reply with what was counted between the previous snapshot
+// and counts, as long as that leaves room for the connection's last replies.
+// Returns 0, or -1 if there is no room.
+static int client_queue_snapshot(ClientData *client, const TextStatistics *counts)
+{
+    TextStatistics delta;
+    uint8_t *reply;
+
+    reply = client_tx_reserve(client, STATS_REPLY_MAX_SIZE + FINAL_REPLIES_MAX_SIZE);
+
+    if (reply == NULL)
+    {
+        return -1;
+    }
+
+    if (client->snapshot == NULL)
+    {
+        // The first snapshot counts from the start of the connection.
+        client->snapshot = (TextStatistics *)pool_alloc(client->snapshots);
+        initialize_stats_zero(client->snapshot);
+    }
+
+    delta.word_count = counts->word_count - client->snapshot->word_count;
+    delta.character_count = counts->character_count - client->snapshot->character_count;
+
+    for (int i = 0; i < MAX_ASCII_CHAR; i++)
+    {
+        delta.character_frequency[i] = counts->character_frequency[i] - client->snapshot->character_frequency[i];
+    }
+
+    *client->snapshot = *counts;
+    client->tx_len += encode_stats(&delta, REPLY_SNAPSHOT, reply);
+
+    return 0;
+}
+
+// Answers waiting snapshot requests in order, for as many as there is room.
+static void client_queue_snapshots(ClientData *client)
+{
+    uint32_t queued = 0;
+
+    while (queued < client->snapshots_pending && client_queue_snapshot(client, client->deferred[queued]) == 0)
+    {
+        pool_free(client->snapshots, client->deferred[queued]);
+        queued++;
+    }
+
+    client->snapshots_pending -= queued;
+    memmove(client->deferred, client->deferred + queued, client->snapshots_pending * sizeof(client->deferred[0]));
+}
+
+// Forgets waiting snapshot requests, whose counts the stats reply covers.
+static void client_drop_snapshots(ClientData *client)
+{
+    for (uint32_t i = 0; i < client->snapshots_pending; i++)
+    {
+        pool_free(client->snapshots, client->deferred[i]);
+    }
+
+    client->snapshots_pending = 0;
+}
+
+// Sends as much of the queued reply as the socket takes without blocking.
+// Returns 1 once all of it is sent, 0 if the rest has to wait for the socket to
+// become writable and -1 if the connection failed.
+static int client_flush(ClientData *client)
+{
+    while (client->tx_sent < client->tx_len)
+    {
+        ssize_t sent;
+
+        sent = send(client->socket_fd, client->tx_buffer + client->tx_sent, client->tx_len - client->tx_sent, MSG_NOSIGNAL);
+
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+
+            LOG_ERROR("Failed to write stats: %s", strerror(errno));
+            return -1;
+        }
+
+        client->tx_sent += (size_t)sent;
+        metrics_count_sent(client->metrics, client->counters, (size_t)sent);
+
+        // Snapshots that were waiting for room go out with the rest.
+        if (client->tx_sent == client->tx_len && client->snapshots_pending > 0)
+        {
+            client_queue_snapshots(client);
+        }
+    }
+
+    return 1;
+}
+
+// Queues the stats reply for a client that has finished sending and writes what
+// the socket takes now. Returns 1 if the connection can be closed straight away,
+// or 0 if it has joined the close queue until the rest drains or times out.
+static int client_start_close(ClientData *client, CloseQueue *queue)
+{
+    client_end_of_input(client);
+    client_queue_stats(client);
+    client_log_stats(client);
+
+    if (client_flush(client) != 0)
+    {
+        return 1;
+    }
+
+    client->close_deadline = monotonic_ms() + CLOSE_TIMEOUT_MS;
+    metric_add(&client->metrics->closing, 1);
+    close_queue_push(queue, client);
+
+    return 0;
+}
+
+static void client_close(ClientData *client, CloseQueue *queue, ConnectionPools *pools)
+{
+    if (client->close_deadline != 0)
+    {
+        close_queue_remove(queue, client);
+    }
+
+    close(client->socket_fd);
+    client->socket_fd = -1;
+    client_release(client, pools);
+}
+
+static void client_release(ClientData *client, ConnectionPools *pools)
+{
+    if (client->counters != NULL)
+    {
+        metrics_connection_close(client->metrics, client->counters, client->close_deadline != 0);
+        client->counters = NULL;
+    }
+
+    pool_free(&pools->stats, client->stats);
+    client->stats = NULL;
+    client_drop_snapshots(client);
+    pool_free(&pools->snapshots, client->snapshot);
+    client->snapshot = NULL;
+    pool_free(&pools->rx_buffers, client->rx_buffer);
+    client->rx_buffer = NULL;
+    pool_free(&pools->tx_buffers, client->tx_buffer);
+    client->tx_buffer = NULL;
+    word_table_free(&client->words);
+    parser_free(&client->parser);
+}
+
+static uint64_t monotonic_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+static void close_queue_push(CloseQueue *queue, ClientData *client)
+{
+    client->close_next = NULL;
+    client->close_prev = queue->tail;
+
+    if (queue->tail != NULL)
+    {
+        queue->tail->close_next = client;
+    }
+    else
+    {
+        queue->head = client;
+    }
+
+    queue->tail = client;
+}
+
+static void close_queue_remove(CloseQueue *queue, ClientData *client)
+{
+    if (client->close_prev != NULL)
+    {
+        client->close_prev->close_next = client->close_next;
+    }
+    else
+    {
+        queue->head = client->close_next;
+    }
+
+    if (client->close_next != NULL)
+    {
+        client->close_next->close_prev = client->close_prev;
+    }
+    else
+    {
+        queue->tail = client->close_prev;
+    }
+}
+
+// Returns the poll timeout in milliseconds until the earliest close deadline,
+// or -1 to wait indefinitely when no connection is closing.
+static int close_queue_timeout(const CloseQueue *queue)
+{
+    uint64_t now;
+
+    if (queue->head == NULL)
+    {
+        return -1;
+    }
+
+    now = monotonic_ms();
+
+    if (queue->head->close_deadline <= now)
+    {
+        return 0;
+    }
+
+    return (int)(queue->head->close_deadline - now);
+}
+
+static void run_epoll_loop(const Reactor *reactor)
+{
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    ClientData *clients = NULL;
+    int shutting_down = 0;
+    int epoll_fd;
+    CloseQueue close_queue = {NULL, NULL};
+    ConnectionPools pools;
+    int spare_fd;
+
+    connection_pools_init(&pools, reactor->max_connections, reactor->metrics, reactor->sketch, reactor->totals, reactor->store, reactor->id);
+    spare_fd = open_spare_fd();
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (epoll_fd == -1)
+    {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+
+    // The listening socket stays level-triggered and is identified by a NULL pointer.
+    // The shutdown eventfd is never read, so it wakes every reactor once it is written.
+    epoll_add(epoll_fd, reactor->listen_fd, EPOLLIN, NULL);
+    epoll_add(epoll_fd, reactor->shutdown_fd, EPOLLIN, SHUTDOWN_EVENT);
+
+    // The shared Unix listening socket wakes only one of the reactors per connection.
+    if (reactor->unix_listen_fd != -1)
+    {
+        epoll_add(epoll_fd, reactor->unix_listen_fd, EPOLLIN | EPOLLEXCLUSIVE, UNIX_LISTEN_EVENT);
+    }
+
+    while (!exit_flag && !shutting_down)
+    {
+        int ready;
+
+        ready = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, close_queue_timeout(&close_queue));
+
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+
+        metrics_count_wakeup(reactor->metrics, ready);
+        word_sketch_tick(reactor->sketch, monotonic_ms());
+
+        for (int i = 0; i < ready; i++)
+        {
+            if (events[i].data.ptr == SHUTDOWN_EVENT)
+            {
+                shutting_down = 1;
+                continue;
+            }
+
+            if (events[i].data.ptr == NULL || events[i].data.ptr == UNIX_LISTEN_EVENT)
+            {
+                epoll_accept_connection(epoll_fd, events[i].data.ptr == NULL ? reactor->listen_fd : reactor->unix_listen_fd, &spare_fd, &clients, &pools);
+            }
+            else
+            {
+                epoll_handle_client(epoll_fd, (ClientData *)events[i].data.ptr, events[i].events, &clients, &close_queue, &pools);
+            }
+        }
+
+        epoll_expire_closes(&clients, &close_queue, &pools);
+    }
+
+    // Cleanup and close all client sockets
+    while (clients != NULL)
+    {
+        ClientData *client = clients;
+
+        client_list_remove(client, &clients);
+        socket_close(client->socket_fd);
+        client_destroy(client, &pools);
+    }
+
+    socket_close(epoll_fd);
+    close(spare_fd);
+    connection_pools_destroy(&pools);
+}
+
+static void epoll_add(int epoll_fd, int fd, uint32_t events, void *ptr)
+{
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.ptr = ptr;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+    {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void epoll_modify(int epoll_fd, int fd, uint32_t events, void *ptr)
+{
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.ptr = ptr;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1)
+    {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void epoll_accept_connection(int epoll_fd, int sockfd, int *spare_fd, ClientData **clients, ConnectionPools *pools)
+{
+    int new_socket;
+
+    // Drain the accept queue so a burst of connections costs one wakeup.
+    while ((new_socket = accept_connection(sockfd, spare_fd)) != -1)
+    {
+        ClientData *client;
+
+        client = client_create(pools, new_socket);
+        if (client == NULL)
+        {
+            continue;
+        }
+
+        client_list_add(client, clients);
+        epoll_add(epoll_fd, new_socket, EPOLLIN | EPOLLRDHUP | EPOLLET, client);
+    }
+}
+
+static void epoll_handle_client(int epoll_fd, ClientData *client, uint32_t events, ClientData **clients, CloseQueue *close_queue, ConnectionPools *pools)
+{
+    ssize_t received = 0;
+
+    if (client->close_deadline != 0)
+    {
+        // Closing: only the rest of the reply is left to send.
+        if ((events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) && client_flush(client) != 0)
+        {
+            epoll_drop_client(client, clients, close_queue, pools);
+        }
+
+        return;
+    }
+
+    // Edge-triggered: keep reading until the socket has nothing more to give. A
+    // receive that leaves room in the buffer has drained the socket, so another
+    // recv is only needed when the buffer filled up or the peer has hung up.
+    while (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+    {
+        size_t space = RX_BUFFER_SIZE - client->rx_len;
+
+        received = client_receive(client);
+
+        if (received > 0 && client_process_input(client) == -1)
+        {
+            LOG_WARN("Client %d broke the protocol, closing", client->socket_fd);
+            epoll_drop_client(client, clients, close_queue, pools);
+            return;
+        }
+
+        if (received <= 0 || ((size_t)received < space && (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) == 0))
+        {
+            break;
+        }
+    }
+
+    if (received < 0)
+    {
+        LOG_INFO("Client %d disconnected", client->socket_fd);
+
+        if (client_start_close(client, close_queue))
+        {
+            epoll_drop_client(client, clients, close_queue, pools);
+        }
+        else
+        {
+            // Wait for the socket to take the rest of the reply.
+            epoll_modify(epoll_fd, client->socket_fd, EPOLLOUT | EPOLLET, client);
+        }
+
+        return;
+    }
+
+    // Replies sent while the client is still sending, such as the hello reply.
+    if (client_has_output(client))
+    {
+        int flushed = client_flush(client);
+
+        if (flushed < 0)
+        {
+            epoll_drop_client(client, clients, close_queue, pools);
+        }
+        else if (flushed == 0)
+        {
+            epoll_modify(epoll_fd, client->socket_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, client);
+        }
+    }
+}
+
+static void epoll_drop_client(ClientData *client, ClientData **clients, CloseQueue *close_queue, ConnectionPools *pools)
+{
+    // close() removes the descriptor from the epoll set.
+    client_list_remove(client, clients);
+    client_close(client, close_queue, pools);
+    pool_free(&pools->clients, client);
+}
+
+// Closes the connections whose reply has not drained by their deadline.
+static void epoll_expire_closes(ClientData **clients, CloseQueue *close_queue, ConnectionPools *pools)
+{
+    uint64_t now;
+
+    if (close_queue->head == NULL)
+    {
+        return;
+    }
+
+    now = monotonic_ms();
+
+    while (close_queue->head != NULL && close_queue->head->close_deadline <= now)
+    {
+        LOG_WARN("Client %d did not read its stats in time, closing", close_queue->head->socket_fd);
+        epoll_drop_client(close_queue->head, clients, close_queue, pools);
+    }
+}
+
+static void client_list_add(ClientData *client, ClientData **clients)
+{
+    client->prev = NULL;
+    client->next = *clients;
+
+    if (*clients != NULL)
+    {
+        (*clients)->prev = client;
+    }
+
+    *clients = client;
+}
+
+static void client_list_remove(ClientData *client, ClientData **clients)
+{
+    if (client->prev != NULL)
+    {
+        client->prev->next = client->next;
+    }
+    else
+    {
+        *clients = client->next;
+    }
+
+    if (client->next != NULL)
+    {
+        client->next->prev = client->prev;
+    }
+}
+
+// Runs the reactor on io_uring: a multishot accept, one multishot receive per
+// connection that picks buffers from a registered provided-buffer ring, and stats
+// replies sent asynchronously. Everything queued while handling one batch of
+// completions is submitted by the single io_uring_enter that waits for the next.
+// Returns -1 with errno set if the kernel does not support what this needs.
+static int run_uring_loop(const Reactor *reactor)
+{
+    Uring ring;
+    UringBufferRing buffers;
+    ClientData *clients = NULL;
+    int shutting_down = 0;
+    ConnectionPools pools;
+    int spare_fd;
+
+    if (uring_init(&ring, URING_SQ_ENTRIES, URING_CQ_ENTRIES) == -1)
+    {
+        return -1;
+    }
+
+    if (uring_buffer_ring_init(&ring, &buffers, URING_BUFFER_GROUP, URING_BUFFER_COUNT, URING_BUFFER_SIZE) == -1)
+    {
+        int saved_errno = errno;
+
+        uring_exit(&ring);
+        errno = saved_errno;
+        return -1;
+    }
+
+    connection_pools_init(&pools, reactor->max_connections, reactor->metrics, reactor->sketch, reactor->totals, reactor->store, reactor->id);
+    spare_fd = open_spare_fd();
+    uring_queue_accept(&ring, reactor->listen_fd);
+    uring_queue_poll(&ring, reactor->shutdown_fd, URING_OP_SHUTDOWN);
+
+    if (reactor->unix_listen_fd != -1)
+    {
+        uring_queue_accept(&ring, reactor->unix_listen_fd);
+    }
+
+    while (!exit_flag && !shutting_down)
+    {
+        struct io_uring_cqe *cqe;
+        int completions = 0;
+
+        if (uring_submit_and_wait(&ring, 1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+
+        word_sketch_tick(reactor->sketch, monotonic_ms());
+
+        while ((cqe = uring_peek_cqe(&ring)) != NULL)
+        {
+            ClientData *client = (ClientData *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+            int listen_fd = (int)(cqe->user_data >> URING_OP_SHIFT);
+
+            switch (cqe->user_data & URING_OP_MASK)
+            {
+            case URING_OP_ACCEPT:
+            {
+                if (cqe->res >= 0)
+                {
+                    client = client_create(&pools, cqe->res);
+                    if (client != NULL)
+                    {
+                        client_list_add(client, &clients);
+                        uring_queue_recv(&ring, &buffers, client);
+                    }
+                }
+                else if (cqe->res == -EMFILE || cqe->res == -ENFILE)
+                {
+                    // An accept re-armed now would fail again at once, even with an
+                    // empty queue. Shed the pending connections with the spare
+                    // descriptor, then wait for the next one before accepting again.
+                    uring_accept_pending(&ring, &buffers, listen_fd, &spare_fd, &clients, &pools);
+
+                    if ((cqe->flags & IORING_CQE_F_MORE) == 0)
+                    {
+                        uring_queue_poll(&ring, listen_fd, ((uint64_t)listen_fd << URING_OP_SHIFT) | URING_OP_LISTEN);
+                    }
+                    break;
+                }
+                else if (cqe->res != -ECONNABORTED && cqe->res != -EINTR)
+                {
+                    LOG_ERROR("Accept error: %s", strerror(-cqe->res));
+                }
+
+                // The kernel ends a multishot accept on errors; start a new one.
+                if ((cqe->flags & IORING_CQE_F_MORE) == 0)
+                {
+                    uring_queue_accept(&ring, listen_fd);
+                }
+                break;
+            }
+            case URING_OP_LISTEN:
+            {
+                uring_accept_pending(&ring, &buffers, listen_fd, &spare_fd, &clients, &pools);
+                uring_queue_accept(&ring, listen_fd);
+                break;
+            }
+            case URING_OP_RECV:
+            {
+                uring_handle_recv(&ring, &buffers, client, cqe, &clients, &pools);
+                break;
+            }
+            case URING_OP_SEND:
+            {
+                uring_handle_send(&ring, client, cqe->res, &clients, &pools);
+                break;
+            }
+            case URING_OP_SHUTDOWN:
+            {
+                shutting_down = 1;
+                break;
+            }
+            case URING_OP_TIMEOUT:
+            {
+                // The linked send reports the outcome; the client may already be gone.
+                break;
+            }
+            default:
+            {
+                break;
+            }
+            }
+
+            uring_cqe_seen(&ring);
+            completions++;
+        }
+
+        metrics_count_wakeup(reactor->metrics, completions);
+    }
+
+    // Cleanup and close all client sockets
+    while (clients != NULL)
+    {
+        ClientData *client = clients;
+
+        client_list_remove(client, &clients);
+        socket_close(client->socket_fd);
+        client_destroy(client, &pools);
+    }
+
+    uring_exit(&ring);
+    uring_buffer_ring_free(&buffers);
+    close(spare_fd);
+    connection_pools_destroy(&pools);
+
+    return 0;
+}
+
+static void uring_handle_recv(Uring *ring, UringBufferRing *buffers, ClientData *client, const struct io_uring_cqe *cqe, ClientData **clients, ConnectionPools *pools)
+{
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+    {
+        uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+        if (cqe->res > 0 && client->protocol != PROTOCOL_INVALID && client_ingest(client, buffers->buffers + (size_t)bid * buffers->buffer_size, (size_t)cqe->res) == -1)
+        {
+            LOG_WARN("Client %d broke the protocol, closing", client->socket_fd);
+            uring_client_fail(client);
+        }
+
+        uring_buffer_ring_recycle(buffers, bid);
+    }
+
+    if (cqe->res > 0 || cqe->res == -ENOBUFS)
+    {
+        // Buffers have been handed back, so a receive that ran out of them can be restarted.
+        if ((cqe->flags & IORING_CQE_F_MORE) == 0)
+        {
+            client->uring_ops &= (uint8_t)~URING_PENDING_RECV;
+
+            if (client->protocol != PROTOCOL_INVALID)
+            {
+                uring_queue_recv(ring, buffers, client);
+            }
+        }
+
+        if (client->protocol != PROTOCOL_INVALID)
+        {
+            uring_client_output(ring, client);
+        }
+
+        uring_client_finish(client, clients, pools);
+        return;
+    }
+
+    client->uring_ops &= (uint8_t)~URING_PENDING_RECV;
+
+    if (cqe->res == 0 && client->protocol != PROTOCOL_INVALID)
+    {
+        // The client shut down its side: queue the reply; the socket closes once it is sent.
+        LOG_INFO("Client %d disconnected", client->socket_fd);
+        client_end_of_input(client);
+        client_log_stats(client);
+        client_queue_stats(client);
+        client->close_deadline = monotonic_ms() + CLOSE_TIMEOUT_MS;
+        metric_add(&client->metrics->closing, 1);
+        uring_client_output(ring, client);
+    }
+    else if (cqe->res < 0)
+    {
+        LOG_ERROR("Client %d receive error: %s", client->socket_fd, strerror(-cqe->res));
+        uring_client_fail(client);
+    }
+
+    uring_client_finish(client, clients, pools);
+}
+
+static void uring_handle_send(Uring *ring, ClientData *client, int result, ClientData **clients, ConnectionPools *pools)
+{
+    client->uring_ops &= (uint8_t)~URING_PENDING_SEND;
+
+    if (result > 0)
+    {
+        client->tx_sent += (size_t)result;
+        metrics_count_sent(client->metrics, client->counters, (size_t)result);
+    }
+    else if (result == -ECANCELED || result == -EINTR)
+    {
+        // The linked timeout cancels a waiting send with ECANCELED, or EINTR if it
+        // had been handed to an io-wq worker.
+        LOG_WARN("Client %d did not read its stats in time, closing", client->socket_fd);
+        uring_client_fail(client);
+    }
+    else
+    {
+        LOG_ERROR("Failed to write stats: %s", strerror(-result));
+        uring_client_fail(client);
+    }
+
+    if (client_has_output(client) && client->close_deadline != 0 && monotonic_ms() >= client->close_deadline)
+    {
+        LOG_WARN("Client %d did not read its stats in time, closing", client->socket_fd);
+        uring_client_fail(client);
+    }
+
+    if (client->protocol != PROTOCOL_INVALID)
+    {
+        client_queue_snapshots(client);
+        uring_client_output(ring, client);
+    }
+
+    uring_client_finish(client, clients, pools);
+}
+
+// Starts a send of the queued output unless one is already in flight; its
+// completion picks up whatever has been queued since.
+static void uring_client_output(Uring *ring, ClientData *client)
+{
+    if (client_has_output(client) && (client->uring_ops & URING_PENDING_SEND) == 0)
+    {
+        uring_queue_send(ring, client);
+    }
+}
+
+// Gives up on the connection: its input is ignored from now on, and a shutdown
+// ends the receive that is still armed so the connection can be released.
+static void uring_client_fail(ClientData *client)
+{
+    if (client->protocol != PROTOCOL_INVALID)
+    {
+        client->protocol = PROTOCOL_INVALID;
+        shutdown(client->socket_fd, SHUT_RDWR);
+    }
+}
+
+// Closes and frees the connection once it is done and the kernel holds no
+// operation that refers to it.
+static void uring_client_finish(ClientData *client, ClientData **clients, ConnectionPools *pools)
+{
+    int done = client->protocol == PROTOCOL_INVALID || (client->close_deadline != 0 && !client_has_output(client));
+
+    if (done && client->uring_ops == 0)
+    {
+        client_list_remove(client, clients);
+        close(client->socket_fd);
+        client_destroy(client, pools);
+    }
+}
+
+static struct io_uring_sqe *uring_sqe(Uring *ring)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe(ring);
+
+    if (sqe == NULL)
+    {
+        perror("io_uring submission queue");
+        exit(EXIT_FAILURE);
+    }
+
+    return sqe;
+}
+
+// Accepts whatever is queued on the listener synchronously, shedding connections
+// while the process is out of descriptors.
+static void uring_accept_pending(Uring *ring, UringBufferRing *buffers, int listen_fd, int *spare_fd, ClientData **clients, ConnectionPools *pools)
+{
+    int new_socket;
+
+    while ((new_socket = accept_connection(listen_fd, spare_fd)) != -1)
+    {
+        ClientData *client;
+
+        client = client_create(pools, new_socket);
+        if (client != NULL)
+        {
+            client_list_add(client, clients);
+            uring_queue_recv(ring, buffers, client);
+        }
+    }
+}
+
+static void uring_queue_accept(Uring *ring, int listen_fd)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_sqe(ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = ((uint64_t)listen_fd << URING_OP_SHIFT) | URING_OP_ACCEPT;
+}
+
+static void uring_queue_recv(Uring *ring, const UringBufferRing *buffers, ClientData *client)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_sqe(ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client->socket_fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = buffers->group_id;
+    sqe->user_data = (uint64_t)(uintptr_t)client | URING_OP_RECV;
+    client->uring_ops |= URING_PENDING_RECV;
+}
+
+// Sends the rest of the output. Once the connection is closing, the send is linked
+// to a timeout that cancels it if the client has not read the reply by its close
+// deadline.
+static void uring_queue_send(Uring *ring, ClientData *client)
+{
+    struct io_uring_sqe *sqe;
+    uint64_t now;
+    uint64_t remaining_ms = 0;
+
+    // A linked pair must not be split across two submissions.
+    if (uring_reserve(ring, 2) == -1)
+    {
+        perror("io_uring submission queue");
+        exit(EXIT_FAILURE);
+    }
+
+    sqe = uring_sqe(ring);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = client->socket_fd;
+    sqe->addr = (uint64_t)(uintptr_t)(client->tx_buffer + client->tx_sent);
+    sqe->len = (uint32_t)(client->tx_len - client->tx_sent);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)client | URING_OP_SEND;
+    client->uring_ops |= URING_PENDING_SEND;
+
+    if (client->close_deadline == 0)
+    {
+        return;
+    }
+
+    sqe->flags = IOSQE_IO_LINK;
+    now = monotonic_ms();
+
+    if (client->close_deadline > now)
+    {
+        remaining_ms = client->close_deadline - now;
+    }
+
+    // The kernel copies the timeout when the request is submitted.
+    client->send_timeout.tv_sec = (long long)(remaining_ms / 1000);
+    client->send_timeout.tv_nsec = (long long)(remaining_ms % 1000) * 1000000;
+
+    sqe = uring_sqe(ring);
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&client->send_timeout;
+    sqe->len = 1;
+    sqe->user_data = (uint64_t)(uintptr_t)client | URING_OP_TIMEOUT;
+}
+
+static void uring_queue_poll(Uring *ring, int fd, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_sqe(ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = user_data;
+}
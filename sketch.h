@@ -0,0 +1,729 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Server-wide word statistics in fixed memory: the most frequent words and the
+// number of distinct words over roughly the last hour, across every client.
+//
+// Each reactor feeds its own sketch, so a sketch has a single writer and needs
+// no locks. A sketch is a ring of SKETCH_WINDOWS windows of SKETCH_WINDOW_MS
+// each; the reactor writes to the one for the current time and clears a window
+// when it comes round again. A window holds:
+//
+//   - a Space-Saving summary of SKETCH_COUNTERS counters. A word with a counter
+//     has it incremented; a new word takes over the counter with the lowest
+//     count, and inherits that count as its possible overestimate. Counts never
+//     understate a word, and every word more frequent than 1/SKETCH_COUNTERS of
+//     the window has a counter. A min-heap finds the lowest counter, and a
+//     linear-probing index over the counters finds a word's one.
+//   - a HyperLogLog of SKETCH_REGISTERS registers for the distinct words.
+//
+// Both merge: summaries by adding the counts of each word, registers by taking
+// the maximum. A query merges the windows of every reactor that are less than
+// SKETCH_WINDOWS windows old, while the reactors keep writing. Counters and
+// windows carry a sequence number that is odd while they are being rewritten,
+// and a reader that sees it change retries, so it never mixes two words.
+//
+// Words are case-folded and hashed by word_key. Words longer than
+// SKETCH_MAX_KEY bytes are counted as distinct but not ranked.
+
+#define SKETCH_COUNTERS 1024                    // Words ranked per window
+#define SKETCH_INDEX_SLOTS (2 * SKETCH_COUNTERS) // A power of two
+#define SKETCH_MAX_KEY 32                       // Longest ranked word, a multiple of 8
+#define SKETCH_PRECISION 14                     // Index bits of the HyperLogLog, about 0.8% error
+#define SKETCH_REGISTERS (1U << SKETCH_PRECISION)
+#define SKETCH_WINDOWS 6
+#define SKETCH_WINDOW_MS (10 * 60 * 1000ULL)
+#define SKETCH_TOP_WORDS 100   // Words a query reports
+#define SKETCH_READ_ATTEMPTS 64 // Reads of a window before a query skips it
+#define SKETCH_ALIGNMENT 64
+
+typedef struct
+{
+    _Atomic uint64_t count;
+    _Atomic uint64_t error;                   // How much count may overstate the word
+    _Atomic uint64_t key[SKETCH_MAX_KEY / 8]; // Zero-padded
+    _Atomic uint32_t sequence;                // Odd while the counter takes a new word
+    _Atomic uint8_t length;
+    uint16_t heap; // Writer only: the counter's position in the heap
+    uint64_t hash; // Writer only
+} SketchCounter;
+
+typedef struct
+{
+    _Atomic uint32_t sequence; // Odd while the window is being cleared
+    _Atomic uint64_t epoch;    // Which window of time it holds: milliseconds / SKETCH_WINDOW_MS
+    _Atomic uint64_t words;
+    _Atomic uint64_t unranked; // Words too long for a counter
+    _Atomic uint32_t size;     // Counters in use
+    uint16_t heap[SKETCH_COUNTERS];      // Writer only: counter ids, lowest count first
+    uint16_t index[SKETCH_INDEX_SLOTS];  // Writer only: counter id + 1 by hash, 0 if empty
+    SketchCounter counters[SKETCH_COUNTERS] __attribute__((aligned(SKETCH_ALIGNMENT)));
+    _Atomic uint8_t registers[SKETCH_REGISTERS];
+} SketchWindow;
+
+typedef struct
+{
+    SketchWindow windows[SKETCH_WINDOWS];
+    SketchWindow *current; // Writer only
+    uint64_t epoch;        // Writer only: the epoch of current
+} __attribute__((aligned(SKETCH_ALIGNMENT))) WordSketch;
+
+// One word of a query, gathered from one window and then merged.
+typedef struct
+{
+    uint64_t count;
+    uint64_t error;
+    uint64_t floor; // The lowest count in the word's windows that were full
+    uint8_t length;
+    char word[SKETCH_MAX_KEY];
+} SketchEntry;
+
+// The merged windows of any number of sketches.
+typedef struct
+{
+    uint8_t registers[SKETCH_REGISTERS];
+    uint8_t scratch[SKETCH_REGISTERS]; // One window's registers while they are read
+    SketchEntry *entries;
+    size_t count;
+    size_t capacity;
+    uint64_t words;
+    uint64_t unranked;
+    uint64_t floor;    // Sum of the lowest counts of the full windows
+    uint64_t distinct; // Estimated by sketch_query_finish
+} SketchQuery;
+
+_Static_assert(sizeof(SketchCounter) == SKETCH_ALIGNMENT, "Sketch counters must fill one cache line each");
+_Static_assert(SKETCH_COUNTERS <= UINT16_MAX, "Counter ids must fit the heap and the index");
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+
+// Only the reactor writes a window, so no atomic read-modify-write is needed.
+static void sketch_increment(_Atomic uint64_t *counter, uint64_t amount)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+static uint64_t sketch_count(const SketchWindow *window, uint16_t id)
+{
+    return atomic_load_explicit(&window->counters[id].count, memory_order_relaxed);
+}
+
+// Clears the window for epoch. Readers that catch it halfway retry.
+static void sketch_window_reset(SketchWindow *window, uint64_t epoch)
+{
+    uint32_t sequence = atomic_load_explicit(&window->sequence, memory_order_relaxed);
+
+    atomic_store_explicit(&window->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&window->size, 0, memory_order_relaxed);
+    atomic_store_explicit(&window->words, 0, memory_order_relaxed);
+    atomic_store_explicit(&window->unranked, 0, memory_order_relaxed);
+
+    for (size_t i = 0; i < SKETCH_REGISTERS; i++)
+    {
+        atomic_store_explicit(&window->registers[i], 0, memory_order_relaxed);
+    }
+
+    memset(window->index, 0, sizeof(window->index));
+    atomic_store_explicit(&window->epoch, epoch, memory_order_relaxed);
+    atomic_store_explicit(&window->sequence, sequence + 2, memory_order_release);
+}
+
+// Moves the sketch to the window for now_ms, clearing it if it still holds an
+// older one. The reactor calls this on every wakeup.
+static void word_sketch_tick(WordSketch *sketch, uint64_t now_ms)
+{
+    uint64_t epoch = now_ms / SKETCH_WINDOW_MS;
+
+    if (epoch == sketch->epoch)
+    {
+        return;
+    }
+
+    sketch->epoch = epoch;
+    sketch->current = &sketch->windows[epoch % SKETCH_WINDOWS];
+
+    if (atomic_load_explicit(&sketch->current->epoch, memory_order_relaxed) != epoch)
+    {
+        sketch_window_reset(sketch->current, epoch);
+    }
+}
+
+// Returns an array of count empty sketches, or NULL if it cannot be allocated.
+static WordSketch *word_sketch_create(size_t count, uint64_t now_ms)
+{
+    WordSketch *sketches;
+
+    sketches = (WordSketch *)aligned_alloc(SKETCH_ALIGNMENT, count * sizeof(WordSketch));
+
+    if (sketches == NULL)
+    {
+        return NULL;
+    }
+
+    // No reader can see the sketches yet.
+    memset(sketches, 0, count * sizeof(WordSketch));
+
+    for (size_t i = 0; i < count; i++)
+    {
+        sketches[i].epoch = UINT64_MAX;
+        word_sketch_tick(&sketches[i], now_ms);
+    }
+
+    return sketches;
+}
+
+static void word_sketch_destroy(WordSketch *sketches)
+{
+    free(sketches);
+}
+
+static void sketch_heap_set(SketchWindow *window, size_t position, uint16_t id)
+{
+    window->heap[position] = id;
+    window->counters[id].heap = (uint16_t)position;
+}
+
+static void sketch_sift_up(SketchWindow *window, size_t position)
+{
+    uint16_t id = window->heap[position];
+    uint64_t count = sketch_count(window, id);
+
+    while (position > 0)
+    {
+        size_t parent = (position - 1) / 2;
+
+        if (sketch_count(window, window->heap[parent]) <= count)
+        {
+            break;
+        }
+
+        sketch_heap_set(window, position, window->heap[parent]);
+        position = parent;
+    }
+
+    sketch_heap_set(window, position, id);
+}
+
+static void sketch_sift_down(SketchWindow *window, size_t position)
+{
+    size_t size = atomic_load_explicit(&window->size, memory_order_relaxed);
+    uint16_t id = window->heap[position];
+    uint64_t count = sketch_count(window, id);
+
+    for (;;)
+    {
+        size_t child = 2 * position + 1;
+
+        if (child >= size)
+        {
+            break;
+        }
+
+        if (child + 1 < size && sketch_count(window, window->heap[child + 1]) < sketch_count(window, window->heap[child]))
+        {
+            child++;
+        }
+
+        if (sketch_count(window, window->heap[child]) >= count)
+        {
+            break;
+        }
+
+        sketch_heap_set(window, position, window->heap[child]);
+        position = child;
+    }
+
+    sketch_heap_set(window, position, id);
+}
+
+// Returns the index slot that holds the word's counter, or the empty slot where
+// it would go.
+static size_t sketch_index_find(const SketchWindow *window, const uint64_t *key, size_t length, uint64_t hash)
+{
+    size_t slot = hash & (SKETCH_INDEX_SLOTS - 1);
+
+    for (;;)
+    {
+        const SketchCounter *counter;
+        size_t i;
+
+        if (window->index[slot] == 0)
+        {
+            return slot;
+        }
+
+        counter = &window->counters[window->index[slot] - 1];
+
+        if (counter->hash == hash && atomic_load_explicit(&counter->length, memory_order_relaxed) == length)
+        {
+            for (i = 0; i < SKETCH_MAX_KEY / 8 && atomic_load_explicit(&counter->key[i], memory_order_relaxed) == key[i]; i++)
+            {
+            }
+
+            if (i == SKETCH_MAX_KEY / 8)
+            {
+                return slot;
+            }
+        }
+
+        slot = (slot + 1) & (SKETCH_INDEX_SLOTS - 1);
+    }
+}
+
+// Takes a counter out of the index, moving later entries of its probe run back
+// so lookups never stop early at the hole.
+static void sketch_index_remove(SketchWindow *window, uint16_t id)
+{
+    size_t hole = window->counters[id].hash & (SKETCH_INDEX_SLOTS - 1);
+    size_t slot;
+
+    while (window->index[hole] != id + 1)
+    {
+        hole = (hole + 1) & (SKETCH_INDEX_SLOTS - 1);
+    }
+
+    slot = hole;
+
+    for (;;)
+    {
+        size_t home;
+
+        slot = (slot + 1) & (SKETCH_INDEX_SLOTS - 1);
+
+        if (window->index[slot] == 0)
+        {
+            break;
+        }
+
+        home = window->counters[window->index[slot] - 1].hash & (SKETCH_INDEX_SLOTS - 1);
+
+        // The entry can fill the hole unless its home lies cyclically in (hole, slot].
+        if (hole < slot ? (home <= hole || home > slot) : (home <= hole && home > slot))
+        {
+            window->index[hole] = window->index[slot];
+            hole = slot;
+        }
+    }
+
+    window->index[hole] = 0;
+}
+
+static void sketch_counter_set(SketchCounter *counter, const uint64_t *key, size_t length, uint64_t hash, uint64_t count, uint64_t error)
+{
+    uint32_t sequence = atomic_load_explicit(&counter->sequence, memory_order_relaxed);
+
+    atomic_store_explicit(&counter->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    for (size_t i = 0; i < SKETCH_MAX_KEY / 8; i++)
+    {
+        atomic_store_explicit(&counter->key[i], key[i], memory_order_relaxed);
+    }
+
+    atomic_store_explicit(&counter->length, (uint8_t)length, memory_order_relaxed);
+    atomic_store_explicit(&counter->count, count, memory_order_relaxed);
+    atomic_store_explicit(&counter->error, error, memory_order_relaxed);
+    counter->hash = hash;
+    atomic_store_explicit(&counter->sequence, sequence + 2, memory_order_release);
+}
+
+// Counts a word that is too long to hash.
+static void word_sketch_skip(WordSketch *sketch)
+{
+    sketch_increment(&sketch->current->words, 1);
+    sketch_increment(&sketch->current->unranked, 1);
+}
+
+// Counts one occurrence of a key made by word_key.
+static void word_sketch_add(WordSketch *sketch, const uint8_t *key, size_t length, uint64_t hash)
+{
+    SketchWindow *window = sketch->current;
+    _Atomic uint8_t *reg = &window->registers[hash >> (64 - SKETCH_PRECISION)];
+    uint64_t rest = hash << SKETCH_PRECISION;
+    uint8_t rank = rest == 0 ? 64 - SKETCH_PRECISION + 1 : (uint8_t)(__builtin_clzll(rest) + 1);
+    uint64_t padded[SKETCH_MAX_KEY / 8] = {0};
+    uint32_t size;
+    uint64_t floor;
+    uint16_t id;
+    size_t slot;
+
+    if (rank > atomic_load_explicit(reg, memory_order_relaxed))
+    {
+        atomic_store_explicit(reg, rank, memory_order_relaxed);
+    }
+
+    sketch_increment(&window->words, 1);
+
+    if (length > SKETCH_MAX_KEY)
+    {
+        sketch_increment(&window->unranked, 1);
+        return;
+    }
+
+    memcpy(padded, key, length);
+    slot = sketch_index_find(window, padded, length, hash);
+
+    if (window->index[slot] != 0)
+    {
+        id = window->index[slot] - 1;
+        sketch_increment(&window->counters[id].count, 1);
+        sketch_sift_down(window, window->counters[id].heap);
+        return;
+    }
+
+    size = atomic_load_explicit(&window->size, memory_order_relaxed);
+
+    if (size < SKETCH_COUNTERS)
+    {
+        id = (uint16_t)size;
+        sketch_counter_set(&window->counters[id], padded, length, hash, 1, 0);
+        window->index[slot] = id + 1;
+        sketch_heap_set(window, size, id);
+        atomic_store_explicit(&window->size, size + 1, memory_order_release);
+        sketch_sift_up(window, size);
+        return;
+    }
+
+    // The word takes over the lowest counter, whose count it may or may not share.
+    id = window->heap[0];
+    floor = sketch_count(window, id);
+    sketch_index_remove(window, id);
+    sketch_counter_set(&window->counters[id], padded, length, hash, floor + 1, floor);
+    window->index[sketch_index_find(window, padded, length, hash)] = id + 1;
+    sketch_sift_down(window, 0);
+}
+
+static void sketch_query_init(SketchQuery *query)
+{
+    memset(query, 0, sizeof(*query));
+}
+
+static void sketch_query_free(SketchQuery *query)
+{
+    free(query->entries);
+    query->entries = NULL;
+}
+
+// Copies a counter into entry, waiting out a writer that is giving it a new word.
+static void sketch_counter_read(const SketchCounter *counter, SketchEntry *entry)
+{
+    for (;;)
+    {
+        uint32_t sequence = atomic_load_explicit(&counter->sequence, memory_order_acquire);
+        uint64_t key[SKETCH_MAX_KEY / 8];
+
+        if (sequence & 1)
+        {
+            continue;
+        }
+
+        for (size_t i = 0; i < SKETCH_MAX_KEY / 8; i++)
+        {
+            key[i] = atomic_load_explicit(&counter->key[i], memory_order_relaxed);
+        }
+
+        entry->length = atomic_load_explicit(&counter->length, memory_order_relaxed);
+        entry->count = atomic_load_explicit(&counter->count, memory_order_relaxed);
+        entry->error = atomic_load_explicit(&counter->error, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+
+        if (atomic_load_explicit(&counter->sequence, memory_order_relaxed) == sequence)
+        {
+            memcpy(entry->word, key, SKETCH_MAX_KEY);
+            entry->floor = 0;
+            return;
+        }
+    }
+}
+
+// Reads one window into the query. Returns 1 if it was added, 0 if it is too old
+// or kept being cleared, and -1 if out of memory.
+static int sketch_query_window(SketchQuery *query, const SketchWindow *window, uint64_t now_epoch)
+{
+    for (int attempt = 0; attempt < SKETCH_READ_ATTEMPTS; attempt++)
+    {
+        uint32_t sequence = atomic_load_explicit(&window->sequence, memory_order_acquire);
+        uint64_t epoch = atomic_load_explicit(&window->epoch, memory_order_relaxed);
+        uint32_t size;
+        uint64_t words;
+        uint64_t unranked;
+        uint64_t floor;
+
+        if (sequence & 1)
+        {
+            continue;
+        }
+
+        if (epoch > now_epoch || now_epoch - epoch >= SKETCH_WINDOWS)
+        {
+            return 0;
+        }
+
+        size = atomic_load_explicit(&window->size, memory_order_acquire);
+
+        if (query->count + size > query->capacity)
+        {
+            size_t capacity = query->capacity == 0 ? SKETCH_COUNTERS : query->capacity * 2;
+            SketchEntry *entries;
+
+            while (capacity < query->count + size)
+            {
+                capacity *= 2;
+            }
+
+            entries = (SketchEntry *)realloc(query->entries, capacity * sizeof(SketchEntry));
+
+            if (entries == NULL)
+            {
+                return -1;
+            }
+
+            query->entries = entries;
+            query->capacity = capacity;
+        }
+
+        for (uint32_t i = 0; i < size; i++)
+        {
+            sketch_counter_read(&window->counters[i], &query->entries[query->count + i]);
+        }
+
+        for (size_t i = 0; i < SKETCH_REGISTERS; i++)
+        {
+            query->scratch[i] = atomic_load_explicit(&window->registers[i], memory_order_relaxed);
+        }
+
+        words = atomic_load_explicit(&window->words, memory_order_relaxed);
+        unranked = atomic_load_explicit(&window->unranked, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+
+        if (atomic_load_explicit(&window->sequence, memory_order_relaxed) != sequence)
+        {
+            continue;
+        }
+
+        // A word missing from a full window may have had up to its lowest count there.
+        floor = 0;
+
+        if (size == SKETCH_COUNTERS)
+        {
+            floor = UINT64_MAX;
+
+            for (uint32_t i = 0; i < size; i++)
+            {
+                floor = query->entries[query->count + i].count < floor ? query->entries[query->count + i].count : floor;
+            }
+
+            for (uint32_t i = 0; i < size; i++)
+            {
+                query->entries[query->count + i].floor = floor;
+            }
+        }
+
+        for (size_t i = 0; i < SKETCH_REGISTERS; i++)
+        {
+            query->registers[i] = query->scratch[i] > query->registers[i] ? query->scratch[i] : query->registers[i];
+        }
+
+        query->count += size;
+        query->words += words;
+        query->unranked += unranked;
+        query->floor += floor;
+
+        return 1;
+    }
+
+    return 0;
+}
+
+// Adds the sketch's windows from the last SKETCH_WINDOWS to the query. Returns 0,
+// or -1 if out of memory.
+static int sketch_query_add(SketchQuery *query, const WordSketch *sketch, uint64_t now_ms)
+{
+    for (size_t i = 0; i < SKETCH_WINDOWS; i++)
+    {
+        if (sketch_query_window(query, &sketch->windows[i], now_ms / SKETCH_WINDOW_MS) == -1)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int sketch_compare_words(const void *a, const void *b)
+{
+    const SketchEntry *left = (const SketchEntry *)a;
+    const SketchEntry *right = (const SketchEntry *)b;
+
+    if (left->length != right->length)
+    {
+        return left->length < right->length ? -1 : 1;
+    }
+
+    return memcmp(left->word, right->word, left->length);
+}
+
+static int sketch_compare_counts(const void *a, const void *b)
+{
+    const SketchEntry *left = (const SketchEntry *)a;
+    const SketchEntry *right = (const SketchEntry *)b;
+
+    if (left->count != right->count)
+    {
+        return left->count > right->count ? -1 : 1;
+    }
+
+    return sketch_compare_words(a, b);
+}
+
+// The HyperLogLog estimate, with linear counting while registers are still empty.
+static uint64_t sketch_estimate_distinct(const uint8_t *registers)
+{
+    double registers_count = (double)SKETCH_REGISTERS;
+    double sum = 0.0;
+    size_t zeros = 0;
+    double estimate;
+
+    for (size_t i = 0; i < SKETCH_REGISTERS; i++)
+    {
+        sum += 1.0 / (double)(1ULL << registers[i]);
+        zeros += registers[i] == 0;
+    }
+
+    estimate = 0.7213 / (1.0 + 1.079 / registers_count) * registers_count * registers_count / sum;
+
+    if (estimate <= 2.5 * registers_count && zeros > 0)
+    {
+        estimate = registers_count * log(registers_count / (double)zeros);
+    }
+
+    return (uint64_t)(estimate + 0.5);
+}
+
+// Merges the entries of each word and sorts them, most frequent first. A word is
+// charged the lowest count of every full window it is missing from, so counts
+// stay upper bounds and error says by how much they may be too high.
+static void sketch_query_finish(SketchQuery *query)
+{
+    size_t merged = 0;
+
+    if (query->count > 0)
+    {
+        qsort(query->entries, query->count, sizeof(SketchEntry), sketch_compare_words);
+
+        for (size_t i = 1; i < query->count; i++)
+        {
+            SketchEntry *last = &query->entries[merged];
+
+            if (sketch_compare_words(last, &query->entries[i]) == 0)
+            {
+                last->count += query->entries[i].count;
+                last->error += query->entries[i].error;
+                last->floor += query->entries[i].floor;
+            }
+            else
+            {
+                query->entries[++merged] = query->entries[i];
+            }
+        }
+
+        query->count = merged + 1;
+
+        for (size_t i = 0; i < query->count; i++)
+        {
+            // A window read while a word changed counters can list the word twice.
+            uint64_t missing = query->floor > query->entries[i].floor ? query->floor - query->entries[i].floor : 0;
+
+            query->entries[i].count += missing;
+            query->entries[i].error += missing;
+        }
+
+        qsort(query->entries, query->count, sizeof(SketchEntry), sketch_compare_counts);
+    }
+
+    query->distinct = sketch_estimate_distinct(query->registers);
+}
+
+static void sketch_write_text(FILE *out, const SketchQuery *query)
+{
+    size_t shown = query->count < SKETCH_TOP_WORDS ? query->count : SKETCH_TOP_WORDS;
+
+    fprintf(out, "Words in the last hour: %" PRIu64 "\n", query->words);
+    fprintf(out, "Distinct words:         ~%" PRIu64 "\n", query->distinct);
+    fprintf(out, "Too long to rank:       %" PRIu64 "\n", query->unranked);
+    fprintf(out, "Top words:\n");
+
+    for (size_t i = 0; i < shown; i++)
+    {
+        const SketchEntry *entry = &query->entries[i];
+
+        fprintf(out, "  %.*s: %" PRIu64, (int)entry->length, entry->word, entry->count);
+
+        if (entry->error > 0)
+        {
+            fprintf(out, " (at most %" PRIu64 " too high)", entry->error);
+        }
+
+        fputc('\n', out);
+    }
+}
+
+// Writes a word as a JSON string. Bytes outside printable ASCII are escaped as
+// the code points of the same value.
+static void sketch_write_json_string(FILE *out, const char *data, size_t length)
+{
+    fputc('"', out);
+
+    for (size_t i = 0; i < length; i++)
+    {
+        unsigned char c = (unsigned char)data[i];
+
+        if (c == '"' || c == '\\')
+        {
+            fputc('\\', out);
+            fputc(c, out);
+        }
+        else if (c < 0x20 || c >= 0x7f)
+        {
+            fprintf(out, "\\u%04x", c);
+        }
+        else
+        {
+            fputc(c, out);
+        }
+    }
+
+    fputc('"', out);
+}
+
+// One JSON object, on one line.
+static void sketch_write_json(FILE *out, const SketchQuery *query)
+{
+    size_t shown = query->count < SKETCH_TOP_WORDS ? query->count : SKETCH_TOP_WORDS;
+
+    fprintf(out, "{\"window_seconds\":%llu,\"words\":%" PRIu64 ",\"distinct_words\":%" PRIu64 ",\"unranked_words\":%" PRIu64 ",\"top_words\":[", SKETCH_WINDOWS * SKETCH_WINDOW_MS / 1000, query->words, query->distinct, query->unranked);
+
+    for (size_t i = 0; i < shown; i++)
+    {
+        fputs(i == 0 ? "{\"word\":" : ",{\"word\":", out);
+        sketch_write_json_string(out, query->entries[i].word, query->entries[i].length);
+        fprintf(out, ",\"count\":%" PRIu64 ",\"error\":%" PRIu64 "}", query->entries[i].count, query->entries[i].error);
+    }
+
+    fputs("]}\n", out);
+}
+
+#pragma GCC diagnostic pop
+
+#endif
@@ -0,0 +1,450 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "protocol.h"
+#include "text_statistics.h"
+#include "totals.h"
+
+// Persistent statistics: the server totals and the statistics of every session
+// key, in a memory-mapped file that outlives the server.
+//
+// The file holds a header page, the live data and two checkpoint images of it:
+//   page      header: magic, layout version, data size, the boot it was last
+//             written in
+//   data      live: session statistics are added here as uploads finish, and
+//             the totals are folded in at every checkpoint
+//   page, data  image A: its sequence number and checksum, then a copy of the data
+//   page, data  image B: likewise
+// A checkpoint copies the live pages that changed into the older image, syncs
+// them, and only then writes and syncs that image's header. Adding a session
+// marks the pages it wrote as pending for both images, so a checkpoint copies
+// just those and holds the lock that uploads take only for as long as that.
+// A crash during a checkpoint leaves the other image whole.
+//
+// Reopening the file maps it; nothing is replayed. If the machine has not
+// rebooted since the file was last opened, the page cache still held every
+// write to the live data, so it is used as it is. Otherwise the live data may
+// have been torn by the crash, and the newest image whose checksum matches is
+// copied over it.
+
+#define STORE_MAGIC 0x3145524f54535854ULL // "TXSTORE1" in little-endian order
+#define STORE_VERSION 1
+#define STORE_PAGE_SIZE 4096
+#define STORE_SESSIONS 1024 // Session keys kept, a power of two
+#define STORE_BOOT_ID_SIZE 40
+#define STORE_CHECKPOINT_MS 1000 // How often the live data is checkpointed
+
+typedef struct
+{
+    uint64_t hash;
+    uint64_t key_len; // 0 for a free slot
+    uint8_t key[SESSION_KEY_MAX];
+    TextStatistics stats;
+} StoreSession;
+
+typedef struct
+{
+    TextStatistics totals;
+    uint64_t session_count;
+    StoreSession sessions[STORE_SESSIONS]; // Open addressing on the key hash
+} StoreData;
+
+#define STORE_DATA_SIZE ((sizeof(StoreData) + STORE_PAGE_SIZE - 1) & ~(size_t)(STORE_PAGE_SIZE - 1))
+#define STORE_DATA_PAGES (STORE_DATA_SIZE / STORE_PAGE_SIZE)
+#define STORE_FILE_SIZE (STORE_PAGE_SIZE + STORE_DATA_SIZE + 2 * (STORE_PAGE_SIZE + STORE_DATA_SIZE))
+
+typedef struct
+{
+    uint64_t magic;
+    uint64_t version;
+    uint64_t data_size;
+    char boot_id[STORE_BOOT_ID_SIZE];
+} StoreHeader;
+
+typedef struct
+{
+    uint64_t sequence; // 0 until the image is first written
+    uint64_t checksum;
+} StoreImageHeader;
+
+typedef struct
+{
+    int fd;
+    uint8_t *map;
+    StoreHeader *header;
+    StoreData *live;
+    StoreImageHeader *image_headers[2];
+    StoreData *images[2];
+    uint64_t sequence;    // Of the newest image
+    uint8_t pending[2][STORE_DATA_PAGES]; // Live pages that differ from each image
+    uint8_t owed[2];      // Images copied to whose sync failed, still owed a header
+    pthread_mutex_t lock; // Serialises session updates and checkpoints
+} StatsStore;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+
+static uint64_t store_checksum(const StoreData *data)
+{
+    const uint64_t *words = (const uint64_t *)data;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < sizeof(StoreData) / sizeof(uint64_t); i++)
+    {
+        hash = (hash ^ words[i]) * 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static uint64_t store_key_hash(const uint8_t *key, size_t length)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        hash = (hash ^ key[i]) * 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+// Reads the kernel's boot id into boot_id, or leaves it empty if there is none,
+// in which case the store always recovers from its images.
+static void store_read_boot_id(char *boot_id)
+{
+    FILE *file;
+
+    memset(boot_id, 0, STORE_BOOT_ID_SIZE);
+    file = fopen("/proc/sys/kernel/random/boot_id", "re");
+
+    if (file == NULL)
+    {
+        return;
+    }
+
+    if (fgets(boot_id, STORE_BOOT_ID_SIZE, file) == NULL)
+    {
+        memset(boot_id, 0, STORE_BOOT_ID_SIZE);
+    }
+
+    fclose(file);
+}
+
+static int store_image_valid(const StatsStore *store, int image)
+{
+    return store->image_headers[image]->sequence != 0 && store->image_headers[image]->checksum == store_checksum(store->images[image]);
+}
+
+// Marks the live pages that hold [data, data + size) as changed for both images.
+static void store_mark(StatsStore *store, const void *data, size_t size)
+{
+    size_t first = (size_t)((const uint8_t *)data - (const uint8_t *)store->live) / STORE_PAGE_SIZE;
+    size_t last = (size_t)((const uint8_t *)data + size - 1 - (const uint8_t *)store->live) / STORE_PAGE_SIZE;
+
+    for (size_t page = first; page <= last; page++)
+    {
+        store->pending[0][page] = 1;
+        store->pending[1][page] = 1;
+    }
+}
+
+// Notes which live pages each image lacks. Called while nothing else has the store.
+static void store_find_pending(StatsStore *store)
+{
+    const uint8_t *live = (const uint8_t *)store->live;
+
+    for (int i = 0; i < 2; i++)
+    {
+        const uint8_t *image = (const uint8_t *)store->images[i];
+
+        for (size_t page = 0; page < STORE_DATA_PAGES; page++)
+        {
+            store->pending[i][page] = memcmp(image + page * STORE_PAGE_SIZE, live + page * STORE_PAGE_SIZE, STORE_PAGE_SIZE) != 0;
+        }
+    }
+}
+
+// Brings the live data back after a reboot from the newest image that is whole,
+// or starts from nothing if there is none.
+static void store_recover(StatsStore *store)
+{
+    int newest = -1;
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (store_image_valid(store, i) && (newest == -1 || store->image_headers[i]->sequence > store->image_headers[newest]->sequence))
+        {
+            newest = i;
+        }
+    }
+
+    if (newest == -1)
+    {
+        memset(store->live, 0, sizeof(StoreData));
+        store->sequence = 0;
+        return;
+    }
+
+    memcpy(store->live, store->images[newest], sizeof(StoreData));
+    store->sequence = store->image_headers[newest]->sequence;
+}
+
+static int store_fail(StatsStore *store, int error)
+{
+    if (store->map != NULL)
+    {
+        munmap(store->map, STORE_FILE_SIZE);
+        store->map = NULL;
+    }
+
+    close(store->fd);
+    errno = error;
+
+    return -1;
+}
+
+// Opens or creates the store at path and maps it. Returns 0, or -1 with errno
+// set: EWOULDBLOCK if another server has it open, EINVAL if it is not a store
+// of this layout and ENOSPC if there is no room for it.
+static int store_open(StatsStore *store, const char *path)
+{
+    char boot_id[STORE_BOOT_ID_SIZE];
+    struct stat st;
+    void *map;
+    int fresh;
+    int result;
+
+    store->map = NULL;
+    store->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+    if (store->fd == -1)
+    {
+        return -1;
+    }
+
+    if (flock(store->fd, LOCK_EX | LOCK_NB) == -1 || fstat(store->fd, &st) == -1)
+    {
+        return store_fail(store, errno);
+    }
+
+    fresh = st.st_size == 0;
+
+    if (!fresh && (size_t)st.st_size != STORE_FILE_SIZE)
+    {
+        return store_fail(store, EINVAL);
+    }
+
+    // Every block is allocated now, so a full disk fails here, with an error,
+    // and not later as a SIGBUS when a mapped page is first written.
+    result = posix_fallocate(store->fd, 0, STORE_FILE_SIZE);
+
+    if (result != 0)
+    {
+        return store_fail(store, result);
+    }
+
+    map = mmap(NULL, STORE_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, store->fd, 0);
+
+    if (map == MAP_FAILED)
+    {
+        return store_fail(store, errno);
+    }
+
+    store->map = (uint8_t *)map;
+    store->header = (StoreHeader *)map;
+    store->live = (StoreData *)(store->map + STORE_PAGE_SIZE);
+
+    for (int i = 0; i < 2; i++)
+    {
+        uint8_t *image = store->map + STORE_PAGE_SIZE + STORE_DATA_SIZE + (size_t)i * (STORE_PAGE_SIZE + STORE_DATA_SIZE);
+
+        store->image_headers[i] = (StoreImageHeader *)image;
+        store->images[i] = (StoreData *)(image + STORE_PAGE_SIZE);
+    }
+
+    // A file whose header was never written is as good as a new one.
+    fresh = fresh || store->header->magic == 0;
+
+    if (!fresh && (store->header->magic != STORE_MAGIC || store->header->version != STORE_VERSION || store->header->data_size != sizeof(StoreData)))
+    {
+        return store_fail(store, EINVAL);
+    }
+
+    store_read_boot_id(boot_id);
+    store->sequence = 0;
+    memset(store->owed, 0, sizeof(store->owed));
+
+    if (fresh)
+    {
+        store->header->magic = STORE_MAGIC;
+        store->header->version = STORE_VERSION;
+        store->header->data_size = sizeof(StoreData);
+    }
+    else if (boot_id[0] == '\0' || memcmp(boot_id, store->header->boot_id, STORE_BOOT_ID_SIZE) != 0)
+    {
+        store_recover(store);
+    }
+    else
+    {
+        store->sequence = store->image_headers[0]->sequence > store->image_headers[1]->sequence ? store->image_headers[0]->sequence : store->image_headers[1]->sequence;
+    }
+
+    memcpy(store->header->boot_id, boot_id, STORE_BOOT_ID_SIZE);
+    msync(store->map, STORE_PAGE_SIZE, MS_SYNC);
+    store_find_pending(store);
+    pthread_mutex_init(&store->lock, NULL);
+
+    return 0;
+}
+
+// Adds a finished upload to its session key's statistics. A new key that finds
+// the table full is dropped, and 0 is returned; otherwise 1.
+static int store_session_add(StatsStore *store, const uint8_t *key, size_t key_len, const TextStatistics *stats)
+{
+    uint64_t hash = store_key_hash(key, key_len);
+    size_t slot = (size_t)hash & (STORE_SESSIONS - 1);
+    int added = 0;
+
+    pthread_mutex_lock(&store->lock);
+
+    for (size_t probe = 0; probe < STORE_SESSIONS; probe++)
+    {
+        StoreSession *session = &store->live->sessions[(slot + probe) & (STORE_SESSIONS - 1)];
+
+        if (session->key_len == 0)
+        {
+            session->hash = hash;
+            session->key_len = key_len;
+            memcpy(session->key, key, key_len);
+            store->live->session_count++;
+            store_mark(store, &store->live->session_count, sizeof(store->live->session_count));
+        }
+        else if (session->hash != hash || session->key_len != key_len || memcmp(session->key, key, key_len) != 0)
+        {
+            continue;
+        }
+
+        merge_stats(&session->stats, stats);
+        store_mark(store, session, sizeof(*session));
+        added = 1;
+        break;
+    }
+
+    pthread_mutex_unlock(&store->lock);
+
+    return added;
+}
+
+// Copies the server totals, which include what the store held when it was
+// opened, into the live data and copies the pages that changed since the older
+// image was written into it. Returns 0, or -1 with errno set if the image
+// could not be synced, in which case the other image is still whole and the
+// next checkpoint syncs this one again.
+static int store_checkpoint(StatsStore *store, const ServerTotals *totals)
+{
+    // An image whose last checkpoint failed to sync is finished first.
+    int target = store->owed[0] ? 0 : store->owed[1] ? 1 : store->image_headers[0]->sequence <= store->image_headers[1]->sequence ? 0 : 1;
+    const uint8_t *live = (const uint8_t *)store->live;
+    uint8_t *image = (uint8_t *)store->images[target];
+    uint8_t *pending = store->pending[target];
+    StoreImageHeader *header = store->image_headers[target];
+    size_t changed = 0;
+    TextStatistics sum;
+
+    server_totals_read(totals, &sum);
+
+    pthread_mutex_lock(&store->lock);
+
+    if (memcmp(&store->live->totals, &sum, sizeof(sum)) != 0)
+    {
+        store->live->totals = sum;
+        store_mark(store, &store->live->totals, sizeof(sum));
+    }
+
+    // Only pages marked since this image was written are copied, so the lock
+    // is held for those alone, and the kernel syncs only those.
+    for (size_t page = 0; page < STORE_DATA_PAGES; page++)
+    {
+        if (pending[page])
+        {
+            memcpy(image + page * STORE_PAGE_SIZE, live + page * STORE_PAGE_SIZE, STORE_PAGE_SIZE);
+            pending[page] = 0;
+            changed++;
+        }
+    }
+
+    pthread_mutex_unlock(&store->lock);
+
+    // An image that already matches the live data needs no new header either,
+    // unless its pages were copied by a checkpoint that failed to sync them.
+    if (changed == 0 && header->sequence != 0 && !store->owed[target])
+    {
+        return 0;
+    }
+
+    store->owed[target] = 1;
+
+    if (msync(image, STORE_DATA_SIZE, MS_SYNC) == -1)
+    {
+        return -1;
+    }
+
+    header->checksum = store_checksum(store->images[target]);
+    header->sequence = ++store->sequence;
+
+    if (msync(header, STORE_PAGE_SIZE, MS_SYNC) == -1)
+    {
+        return -1;
+    }
+
+    store->owed[target] = 0;
+
+    // Start writing the live data back too, without waiting for it.
+    msync(store->live, STORE_DATA_SIZE, MS_ASYNC);
+
+    return 0;
+}
+
+// Writes one line per session key: the key, its words and its characters.
+static void store_write_sessions(FILE *out, StatsStore *store)
+{
+    pthread_mutex_lock(&store->lock);
+    fprintf(out, "sessions %" PRIu64 "\n", store->live->session_count);
+
+    for (size_t i = 0; i < STORE_SESSIONS; i++)
+    {
+        const StoreSession *session = &store->live->sessions[i];
+
+        if (session->key_len > 0)
+        {
+            fprintf(out, "%.*s words %llu characters %llu\n", (int)session->key_len, (const char *)session->key, session->stats.word_count, session->stats.character_count);
+        }
+    }
+
+    pthread_mutex_unlock(&store->lock);
+}
+
+static void store_close(StatsStore *store)
+{
+    pthread_mutex_destroy(&store->lock);
+    munmap(store->map, STORE_FILE_SIZE);
+    close(store->fd);
+}
+
+#pragma GCC diagnostic pop
+
+#endif
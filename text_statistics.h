@@ -1,9 +1,14 @@
+#ifndef TEXT_STATISTICS_H
+#define TEXT_STATISTICS_H
+
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <ctype.h>
 #include <string.h>
 
 #include "file.h"
+#include "histogram.h"
+#include "protocol.h"
 
 #define MAX_ASCII_CHAR 256
 
@@ -14,11 +19,18 @@ typedef struct
     unsigned long long character_frequency[256];
 } TextStatistics;
 
-typedef struct
-{
-    int socket_fd;         // Client's socket file descriptor
-    TextStatistics *stats; // Statistics for this client
-} ClientData;
+// Stats reply, in network byte order:
+//   u32     length of the body that follows, big-endian
+//   u8      format version, REPLY_VERSION
+//   u8      reply type, REPLY_STATS
+//   varint  word count
+//   varint  character count
+//   varint  number of frequency entries
+//   entries of (u8 byte, varint count), in increasing byte order, counts non-zero
+// Only characters that occurred are sent, so a reply for English text is around
+// a hundred bytes instead of the 2 KB of the full table.
+#define STATS_REPLY_MAX_BODY (2 + 3 * VARINT_MAX_LEN + MAX_ASCII_CHAR * (1 + VARINT_MAX_LEN))
+#define STATS_REPLY_MAX_SIZE (REPLY_HEADER_SIZE + STATS_REPLY_MAX_BODY)
 
 // static void update_character_frequency(const char *word, uint8_t word_size, unsigned int *frequencyArray);
 // static void read_stats(FILE *file, int sockfd);
@@ -77,65 +89,189 @@ static void update_character_frequency(const char *word, uint8_t word_size, unsi
             break;
         }
 
-        unsigned char lowered = (unsigned char)tolower(word[i]);
+        unsigned char lowered = case_fold_table[(unsigned char)word[i]];
         frequencyArray[(int)lowered]++;
         // printf("Character: %c Frequency: %u\n", lowered, frequencyArray[(int) lowered]);
     }
 }
 
-static void read_stats(int sockfd) // [-Wunused-function]
+static void initialize_stats_zero(TextStatistics *stats) // [-Wunused-function]
 {
-    TextStatistics *stats = (TextStatistics *)calloc(1, sizeof(TextStatistics));
-    size_t stats_len = sizeof(TextStatistics);
+    stats->word_count = 0;
+    stats->character_count = 0;
+    memset(stats->character_frequency, 0, sizeof(stats->character_frequency));
+}
 
-    if (!stats)
-        handleError((char *)"Failed to allocate memory for stats", sockfd, stats, 1);
+// Checks and decodes a stats reply body into stats. Every field is bounds-checked
+// against length; returns 0, or -1 if the body is truncated or malformed.
+static int decode_stats(const uint8_t *body, size_t length, TextStatistics *stats, uint8_t *type)
+{
+    uint64_t word_count;
+    uint64_t character_count;
+    uint64_t entries;
+    size_t offset = 2;
+    int previous = -1;
 
-    ssize_t read_bytes;
+    if (length < 2 || body[0] != REPLY_VERSION)
+    {
+        return -1;
+    }
 
-    if ((read_bytes = read_fully(sockfd, &stats_len, sizeof(stats_len))) <= 0)
-        handleError("Failed to read stats length", sockfd, stats, 1);
+    *type = body[1];
 
-    stats = realloc(stats, stats_len);
-    if (!stats)
-        handleError("Failed to reallocate memory for stats", sockfd, NULL, 1);
+    if (varint_decode(body, length, &offset, &word_count) != 1 || varint_decode(body, length, &offset, &character_count) != 1 || varint_decode(body, length, &offset, &entries) != 1 || entries > MAX_ASCII_CHAR)
+    {
+        return -1;
+    }
 
-    if ((read_bytes = read_fully(sockfd, stats, stats_len)) <= 0)
-        handleError("Failed to read stats data", sockfd, stats, 1);
+    initialize_stats_zero(stats);
+    stats->word_count = word_count;
+    stats->character_count = character_count;
 
-    printf("Bytes read %zu\n", read_bytes);
+    for (uint64_t i = 0; i < entries; i++)
+    {
+        uint64_t count;
+        uint8_t character;
 
-    print_stats(stats);
-    free(stats);
+        if (offset >= length)
+        {
+            return -1;
+        }
+
+        character = body[offset++];
+
+        // Entries must be in increasing byte order, which also rules out duplicates.
+        if ((int)character <= previous || varint_decode(body, length, &offset, &count) != 1 || count == 0)
+        {
+            return -1;
+        }
+
+        stats->character_frequency[character] = count;
+        previous = character;
+    }
+
+    return offset == length ? 0 : -1;
 }
 
-static void write_stats(ClientData **client_sockets, int client_index, size_t stats_len)
+// Reads one reply into body, which has room for capacity bytes, and stores its
+// length. Returns 0, or -1 if the connection fails or the reply does not fit.
+static int read_reply(int sockfd, uint8_t *body, size_t capacity, size_t *length)
 {
-    ssize_t written_bytes;
-    if ((written_bytes = write_fully((*client_sockets)[client_index].socket_fd, &stats_len, sizeof(stats_len))) <= 0)
+    uint8_t header[REPLY_HEADER_SIZE];
+    uint32_t body_len;
+
+    if (read_fully(sockfd, header, sizeof(header)) != (ssize_t)sizeof(header))
     {
-        perror("Failed to write stats length");
-        free((*client_sockets)[client_index].stats);
-        close((*client_sockets)[client_index].socket_fd);
-        return; // should i exit ?
+        handleError("Failed to read reply length", -1, NULL, 1);
+        return -1;
     }
 
-    printf("Stats_len %zd\n", stats_len);
+    body_len = get_u32_be(header);
 
-    if ((written_bytes = write_fully((*client_sockets)[client_index].socket_fd, (*client_sockets)[client_index].stats, stats_len)) <= 0)
+    if (body_len > capacity)
     {
-        perror("Failed to write stats data");
-        free((*client_sockets)[client_index].stats);
-        close((*client_sockets)[client_index].socket_fd);
-        return; // should i exit ?
+        fprintf(stderr, "Reply of %lu bytes is too large\n", (unsigned long)body_len);
+        return -1;
     }
+
+    if (read_fully(sockfd, body, body_len) != (ssize_t)body_len)
+    {
+        handleError("Failed to read reply", -1, NULL, 1);
+        return -1;
+    }
+
+    *length = body_len;
+
+    return 0;
 }
 
-static void initialize_stats_zero(TextStatistics *stats) // [-Wunused-function]
+// Reads a stats reply into stats. Returns the number of bytes read, or -1 if the
+// connection fails or the reply is malformed.
+static ssize_t receive_stats(int sockfd, TextStatistics *stats)
 {
-    stats->word_count = 0;
-    stats->character_count = 0;
-    memset(stats->character_frequency, 0, MAX_ASCII_CHAR * sizeof(unsigned int));
+    uint8_t body[STATS_REPLY_MAX_BODY];
+    size_t body_len;
+    uint8_t type;
+
+    if (read_reply(sockfd, body, sizeof(body), &body_len) == -1)
+    {
+        return -1;
+    }
+
+    if (decode_stats(body, body_len, stats, &type) == -1 || type != REPLY_STATS)
+    {
+        fprintf(stderr, "Malformed stats reply\n");
+        return -1;
+    }
+
+    return (ssize_t)(REPLY_HEADER_SIZE + body_len);
+}
+
+// Reads a stats reply, prints it and returns 0, or returns -1 if the connection
+// fails or the reply is malformed.
+static int read_stats(int sockfd) // [-Wunused-function]
+{
+    TextStatistics stats;
+    ssize_t bytes_read;
+
+    bytes_read = receive_stats(sockfd, &stats);
+
+    if (bytes_read == -1)
+    {
+        return -1;
+    }
+
+    printf("Bytes read %zd\n", bytes_read);
+
+    print_stats(&stats);
+
+    return 0;
+}
+
+// Adds the counts in part to total.
+static void merge_stats(TextStatistics *total, const TextStatistics *part)
+{
+    total->word_count += part->word_count;
+    total->character_count += part->character_count;
+
+    for (int i = 0; i < MAX_ASCII_CHAR; i++)
+    {
+        total->character_frequency[i] += part->character_frequency[i];
+    }
 }
 
-#pragma GCC diagnostic pop
\ No newline at end of file
+// Serializes a reply of the given type into buffer, which must hold
+// STATS_REPLY_MAX_SIZE bytes. Returns the number of bytes written.
+static size_t encode_stats(const TextStatistics *stats, uint8_t type, uint8_t *buffer)
+{
+    size_t entries = 0;
+    size_t length = REPLY_HEADER_SIZE;
+
+    for (int i = 0; i < MAX_ASCII_CHAR; i++)
+    {
+        entries += stats->character_frequency[i] != 0;
+    }
+
+    buffer[length++] = REPLY_VERSION;
+    buffer[length++] = type;
+    length += varint_encode(stats->word_count, buffer + length);
+    length += varint_encode(stats->character_count, buffer + length);
+    length += varint_encode(entries, buffer + length);
+
+    for (int i = 0; i < MAX_ASCII_CHAR; i++)
+    {
+        if (stats->character_frequency[i] != 0)
+        {
+            buffer[length++] = (uint8_t)i;
+            length += varint_encode(stats->character_frequency[i], buffer + length);
+        }
+    }
+
+    put_u32_be(buffer, (uint32_t)(length - REPLY_HEADER_SIZE));
+
+    return length;
+}
+
+#pragma GCC diagnostic pop
+
+#endif
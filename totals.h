@@ -0,0 +1,108 @@
+#ifndef TOTALS_H
+#define TOTALS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "text_statistics.h"
+
+// Server-wide statistics over every upload that has finished. Each reactor adds
+// its connections' statistics to a shard of its own, on its own cache lines, so
+// the ingest path never writes a shared counter. Only a reader sums the shards.
+// Every shard has a single writer, so additions are a relaxed load and store;
+// a sum may miss an upload that is being added, which the next one includes.
+
+#define TOTALS_ALIGNMENT 64
+
+typedef struct
+{
+    _Atomic unsigned long long word_count;
+    _Atomic unsigned long long character_count;
+    _Atomic unsigned long long character_frequency[MAX_ASCII_CHAR];
+} __attribute__((aligned(TOTALS_ALIGNMENT))) StatsShard;
+
+typedef struct
+{
+    StatsShard *shards; // One per reactor
+    size_t count;
+    TextStatistics base; // Totals carried over from before the server started
+} ServerTotals;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+
+// Returns 0, or -1 if the shards cannot be allocated.
+static int server_totals_init(ServerTotals *totals, size_t count)
+{
+    totals->count = count;
+    initialize_stats_zero(&totals->base);
+    totals->shards = (StatsShard *)aligned_alloc(TOTALS_ALIGNMENT, count * sizeof(StatsShard));
+
+    if (totals->shards == NULL)
+    {
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        atomic_init(&totals->shards[i].word_count, 0);
+        atomic_init(&totals->shards[i].character_count, 0);
+
+        for (int c = 0; c < MAX_ASCII_CHAR; c++)
+        {
+            atomic_init(&totals->shards[i].character_frequency[c], 0);
+        }
+    }
+
+    return 0;
+}
+
+static void server_totals_destroy(ServerTotals *totals)
+{
+    free(totals->shards);
+    totals->shards = NULL;
+}
+
+static void stats_shard_count(_Atomic unsigned long long *counter, unsigned long long amount)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+// Adds one finished upload. Only the shard's reactor calls this.
+static void stats_shard_add(StatsShard *shard, const TextStatistics *stats)
+{
+    stats_shard_count(&shard->word_count, stats->word_count);
+    stats_shard_count(&shard->character_count, stats->character_count);
+
+    for (int c = 0; c < MAX_ASCII_CHAR; c++)
+    {
+        if (stats->character_frequency[c] != 0)
+        {
+            stats_shard_count(&shard->character_frequency[c], stats->character_frequency[c]);
+        }
+    }
+}
+
+// Sums every shard, and the carried-over base, into total.
+static void server_totals_read(const ServerTotals *totals, TextStatistics *total)
+{
+    *total = totals->base;
+
+    for (size_t i = 0; i < totals->count; i++)
+    {
+        const StatsShard *shard = &totals->shards[i];
+
+        total->word_count += atomic_load_explicit(&shard->word_count, memory_order_relaxed);
+        total->character_count += atomic_load_explicit(&shard->character_count, memory_order_relaxed);
+
+        for (int c = 0; c < MAX_ASCII_CHAR; c++)
+        {
+            total->character_frequency[c] += atomic_load_explicit(&shard->character_frequency[c], memory_order_relaxed);
+        }
+    }
+}
+
+#pragma GCC diagnostic pop
+
+#endif
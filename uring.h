@@ -0,0 +1,282 @@
+#ifndef URING_H
+#define URING_H
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// A minimal io_uring wrapper built directly on the system calls, so the server
+// does not depend on liburing. It covers what the server's io_uring backend
+// uses: one submission and completion ring, and provided-buffer rings for
+// multishot receives.
+
+typedef struct
+{
+    int ring_fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sqe_tail; // Local tail; published to *sq_tail on submit
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t sqes_size;
+} Uring;
+
+typedef struct
+{
+    struct io_uring_buf_ring *ring;
+    uint8_t *buffers;
+    size_t ring_size;
+    unsigned entries;
+    unsigned buffer_size;
+    uint16_t group_id;
+} UringBufferRing;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+
+// Creates a ring with room for sq_entries submissions and cq_entries completions.
+// Returns 0 on success or -1 with errno set, e.g. EINVAL on kernels that predate
+// the setup flags (and with them multishot receive, which arrived in Linux 6.0).
+static int uring_init(Uring *ring, unsigned sq_entries, unsigned cq_entries)
+{
+    struct io_uring_params params;
+    uint8_t *sq_ptr;
+    uint8_t *cq_ptr;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+    params.cq_entries = cq_entries;
+
+    ring->ring_fd = (int)syscall(__NR_io_uring_setup, sq_entries, &params);
+
+    if (ring->ring_fd < 0)
+    {
+        return -1;
+    }
+
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0 || (params.features & IORING_FEAT_NODROP) == 0)
+    {
+        close(ring->ring_fd);
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    // With IORING_FEAT_SINGLE_MMAP both rings live in one mapping.
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+
+    if (params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe) > ring->sq_ring_size)
+    {
+        ring->sq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+
+    if (ring->sq_ring == MAP_FAILED)
+    {
+        close(ring->ring_fd);
+        return -1;
+    }
+
+    ring->cq_ring = ring->sq_ring;
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+
+    if (ring->sqes == MAP_FAILED)
+    {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(ring->ring_fd);
+        return -1;
+    }
+
+    sq_ptr = (uint8_t *)ring->sq_ring;
+    cq_ptr = (uint8_t *)ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq_ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq_ptr + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq_ptr + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq_ptr + params.sq_off.array);
+    ring->sqe_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *)(cq_ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq_ptr + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq_ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq_ptr + params.cq_off.cqes);
+
+    // Submission slots map one-to-one onto SQEs.
+    for (unsigned i = 0; i <= ring->sq_mask; i++)
+    {
+        ring->sq_array[i] = i;
+    }
+
+    return 0;
+}
+
+static void uring_exit(Uring *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->ring_fd);
+}
+
+// Publishes queued SQEs and, if wait_nr > 0, waits for that many completions,
+// all in one io_uring_enter call. Returns the number submitted or -1 with errno.
+static int uring_submit_and_wait(Uring *ring, unsigned wait_nr)
+{
+    unsigned to_submit;
+    int result;
+
+    to_submit = ring->sqe_tail - *ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+    if (to_submit == 0 && wait_nr == 0)
+    {
+        return 0;
+    }
+
+    result = (int)syscall(__NR_io_uring_enter, ring->ring_fd, to_submit, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+    return result;
+}
+
+// Returns a zeroed SQE, submitting the queued ones first if the ring is full.
+static struct io_uring_sqe *uring_get_sqe(Uring *ring)
+{
+    struct io_uring_sqe *sqe;
+
+    if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) > ring->sq_mask)
+    {
+        if (uring_submit_and_wait(ring, 0) < 0)
+        {
+            return NULL;
+        }
+
+        if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) > ring->sq_mask)
+        {
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+
+    sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+    ring->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+
+    return sqe;
+}
+
+// Makes sure count SQEs can be taken without an intermediate submit, submitting
+// the queued ones if necessary. Returns 0 or -1 with errno set.
+static int uring_reserve(Uring *ring, unsigned count)
+{
+    if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) + count > ring->sq_mask + 1)
+    {
+        if (uring_submit_and_wait(ring, 0) < 0)
+        {
+            return -1;
+        }
+
+        if (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) + count > ring->sq_mask + 1)
+        {
+            errno = EBUSY;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Returns the next completion without waiting, or NULL if there is none.
+static struct io_uring_cqe *uring_peek_cqe(Uring *ring)
+{
+    unsigned head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+static void uring_cqe_seen(Uring *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// Hands buffer id bid back to the kernel so it can be selected by a later receive.
+static void uring_buffer_ring_recycle(UringBufferRing *buffers, uint16_t bid)
+{
+    struct io_uring_buf *buf;
+    uint16_t tail;
+
+    tail = buffers->ring->tail;
+    buf = &buffers->ring->bufs[tail & (buffers->entries - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(buffers->buffers + (size_t)bid * buffers->buffer_size);
+    buf->len = buffers->buffer_size;
+    buf->bid = bid;
+    __atomic_store_n(&buffers->ring->tail, (uint16_t)(tail + 1), __ATOMIC_RELEASE);
+}
+
+// Allocates entries buffers of buffer_size bytes and registers them as provided-buffer
+// group group_id. entries must be a power of two. Returns 0 or -1 with errno set.
+static int uring_buffer_ring_init(Uring *ring, UringBufferRing *buffers, uint16_t group_id, unsigned entries, unsigned buffer_size)
+{
+    struct io_uring_buf_reg reg;
+    void *mapping;
+
+    memset(buffers, 0, sizeof(*buffers));
+    buffers->entries = entries;
+    buffers->buffer_size = buffer_size;
+    buffers->group_id = group_id;
+    buffers->ring_size = entries * sizeof(struct io_uring_buf) + (size_t)entries * buffer_size;
+
+    // The ring must be page aligned, so the buffers share its anonymous mapping.
+    mapping = mmap(NULL, buffers->ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (mapping == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    buffers->ring = (struct io_uring_buf_ring *)mapping;
+    buffers->buffers = (uint8_t *)mapping + entries * sizeof(struct io_uring_buf);
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)buffers->ring;
+    reg.ring_entries = entries;
+    reg.bgid = group_id;
+
+    if (syscall(__NR_io_uring_register, ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        munmap(mapping, buffers->ring_size);
+        return -1;
+    }
+
+    for (unsigned i = 0; i < entries; i++)
+    {
+        uring_buffer_ring_recycle(buffers, (uint16_t)i);
+    }
+
+    return 0;
+}
+
+static void uring_buffer_ring_free(UringBufferRing *buffers)
+{
+    munmap(buffers->ring, buffers->ring_size);
+}
+
+#pragma GCC diagnostic pop
+
+#endif
@@ -0,0 +1,648 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "protocol.h"
+
+// UTF-8 statistics: words are validated and decoded, and every code point is
+// counted. ASCII is by far the most common input and its counts are the byte
+// histogram's, so ASCII runs are only skipped over, 16 or 32 bytes at a time
+// with SSE2 or AVX2, and the histogram supplies their frequencies. Only the
+// bytes from the first non-ASCII byte of a run on are decoded, one code point
+// at a time, since each one has to be looked up in the table anyway.
+//
+// U+0080..U+00FF are counted in a dense table, case-folded like the byte
+// histogram folds ASCII. Code points above that go into a sparse open-addressing
+// table that grows up to UTF8_SPARSE_MAX entries; further new code points are
+// counted as untracked. Ill-formed sequences are counted the way a decoder that
+// replaces them with U+FFFD would count the replacements: one per maximal
+// subpart, as Unicode recommends.
+//
+// Code points reply, in network byte order:
+//   u32     length of the body that follows, big-endian
+//   u8      format version, REPLY_VERSION
+//   u8      reply type, REPLY_CODE_POINTS
+//   varint  code point count
+//   varint  ill-formed sequence count
+//   varint  code points not listed below
+//   varint  number of entries
+//   entries of (varint code point, varint count), in increasing code point order
+// Every code point up to U+00FF that occurred is listed, then the UTF8_REPLY_SPARSE
+// most frequent of the others.
+
+#define UTF8_DENSE_SIZE 256
+#define UTF8_SPARSE_INITIAL 64  // Slots in a new sparse table, a power of two
+#define UTF8_SPARSE_MAX 16384   // Distinct code points above U+00FF kept per connection
+#define UTF8_REPLY_SPARSE 256   // Of those, the most frequent sent back
+#define UTF8_CODE_POINT_LEN 3   // Varint bytes of the largest code point
+#define CODE_POINTS_REPLY_MAX_BODY (2 + 4 * VARINT_MAX_LEN + (UTF8_DENSE_SIZE + UTF8_REPLY_SPARSE) * (UTF8_CODE_POINT_LEN + VARINT_MAX_LEN))
+#define CODE_POINTS_REPLY_MAX_SIZE (REPLY_HEADER_SIZE + CODE_POINTS_REPLY_MAX_BODY)
+
+typedef struct
+{
+    uint32_t code_point; // 0 for a free slot; code points in the table are above U+00FF
+    uint32_t unused;
+    uint64_t count;
+} Utf8Entry;
+
+typedef struct
+{
+    uint64_t code_points;
+    uint64_t invalid;   // Ill-formed sequences
+    uint64_t untracked; // Code points that found the sparse table full
+    unsigned long long dense[UTF8_DENSE_SIZE]; // Folded; on the server, ASCII is left to the byte histogram
+    Utf8Entry *sparse;
+    size_t sparse_capacity;
+    size_t sparse_count;
+    uint32_t partial;   // Bits so far of a sequence that continues in the next chunk
+    uint8_t needed;     // Continuation bytes that sequence still needs
+    uint8_t low;        // Bounds of the next continuation byte
+    uint8_t high;
+} Utf8Stats;
+
+typedef size_t (*Utf8AsciiRun)(const uint8_t *data, size_t length);
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+
+static void utf8_stats_init(Utf8Stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+static void utf8_stats_free(Utf8Stats *stats)
+{
+    free(stats->sparse);
+    stats->sparse = NULL;
+}
+
+// Folds U+00C0..U+00DE, bar U+00D7, to lower case as ASCII letters are folded.
+static uint32_t utf8_fold(uint32_t code_point)
+{
+    if (code_point >= 0xc0 && code_point <= 0xde && code_point != 0xd7)
+    {
+        return code_point + 0x20;
+    }
+
+    return code_point;
+}
+
+// Returns how many bytes at the start of data are ASCII, eight at a time.
+static size_t utf8_ascii_run_swar(const uint8_t *data, size_t length)
+{
+    size_t i = 0;
+
+    for (; i + 8 <= length; i += 8)
+    {
+        uint64_t bytes;
+
+        memcpy(&bytes, data + i, sizeof(bytes));
+        bytes &= 0x8080808080808080ULL;
+
+        if (bytes != 0)
+        {
+            // Little-endian: the lowest set bit is in the first non-ASCII byte.
+            return i + (size_t)__builtin_ctzll(bytes) / 8;
+        }
+    }
+
+    while (i < length && data[i] < 0x80)
+    {
+        i++;
+    }
+
+    return i;
+}
+
+#if defined(__x86_64__)
+static size_t utf8_ascii_run_sse2(const uint8_t *data, size_t length)
+{
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16)
+    {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(data + i)));
+
+        if (mask != 0)
+        {
+            return i + (size_t)__builtin_ctz((unsigned)mask);
+        }
+    }
+
+    return i + utf8_ascii_run_swar(data + i, length - i);
+}
+
+__attribute__((target("avx2"))) static size_t utf8_ascii_run_avx2(const uint8_t *data, size_t length)
+{
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32)
+    {
+        int mask = _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(data + i)));
+
+        if (mask != 0)
+        {
+            return i + (size_t)__builtin_ctz((unsigned)mask);
+        }
+    }
+
+    return i + utf8_ascii_run_sse2(data + i, length - i);
+}
+#endif
+
+// Picks the widest scan the CPU supports.
+static Utf8AsciiRun utf8_select_ascii_run(void)
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return utf8_ascii_run_avx2;
+    }
+
+    return utf8_ascii_run_sse2;
+#else
+    return utf8_ascii_run_swar;
+#endif
+}
+
+// Most words are shorter than a vector, so they are scanned in place.
+static size_t utf8_ascii_run(const uint8_t *data, size_t length)
+{
+    if (length < 32)
+    {
+        return utf8_ascii_run_swar(data, length);
+    }
+
+    return utf8_select_ascii_run()(data, length);
+}
+
+static size_t utf8_sparse_slot(uint32_t code_point, size_t capacity)
+{
+    return (size_t)((code_point * 0x9e3779b1U) >> 7) & (capacity - 1);
+}
+
+// Doubles the sparse table. Returns 0, or -1 if it is at its limit or out of memory.
+static int utf8_sparse_grow(Utf8Stats *stats)
+{
+    size_t capacity = stats->sparse_capacity == 0 ? UTF8_SPARSE_INITIAL : stats->sparse_capacity * 2;
+    Utf8Entry *entries;
+
+    if (capacity > UTF8_SPARSE_MAX * 2)
+    {
+        return -1;
+    }
+
+    entries = (Utf8Entry *)calloc(capacity, sizeof(Utf8Entry));
+
+    if (entries == NULL)
+    {
+        return -1;
+    }
+
+    for (size_t i = 0; i < stats->sparse_capacity; i++)
+    {
+        const Utf8Entry *entry = &stats->sparse[i];
+        size_t slot;
+
+        if (entry->code_point == 0)
+        {
+            continue;
+        }
+
+        slot = utf8_sparse_slot(entry->code_point, capacity);
+
+        while (entries[slot].code_point != 0)
+        {
+            slot = (slot + 1) & (capacity - 1);
+        }
+
+        entries[slot] = *entry;
+    }
+
+    free(stats->sparse);
+    stats->sparse = entries;
+    stats->sparse_capacity = capacity;
+
+    return 0;
+}
+
+// Returns the slot that holds a code point, or the free slot where it would go.
+static size_t utf8_sparse_find(const Utf8Stats *stats, uint32_t code_point)
+{
+    size_t slot = utf8_sparse_slot(code_point, stats->sparse_capacity);
+
+    while (stats->sparse[slot].code_point != 0 && stats->sparse[slot].code_point != code_point)
+    {
+        slot = (slot + 1) & (stats->sparse_capacity - 1);
+    }
+
+    return slot;
+}
+
+// Adds count occurrences of a code point to the tables, folded. The caller
+// counts it in code_points.
+static void utf8_add(Utf8Stats *stats, uint32_t code_point, uint64_t count)
+{
+    size_t slot;
+
+    if (code_point < UTF8_DENSE_SIZE)
+    {
+        stats->dense[utf8_fold(code_point)] += count;
+        return;
+    }
+
+    // The table is kept at most half full, so probes stay short and end.
+    if (stats->sparse_capacity > 0)
+    {
+        slot = utf8_sparse_find(stats, code_point);
+
+        if (stats->sparse[slot].code_point == code_point)
+        {
+            stats->sparse[slot].count += count;
+            return;
+        }
+    }
+
+    if (stats->sparse_count * 2 >= stats->sparse_capacity)
+    {
+        if (stats->sparse_count >= UTF8_SPARSE_MAX || utf8_sparse_grow(stats) == -1)
+        {
+            stats->untracked += count;
+            return;
+        }
+    }
+
+    slot = utf8_sparse_find(stats, code_point);
+    stats->sparse[slot].code_point = code_point;
+    stats->sparse[slot].count = count;
+    stats->sparse_count++;
+}
+
+// Adds the counts in from to stats.
+static void utf8_merge(Utf8Stats *stats, const Utf8Stats *from)
+{
+    stats->code_points += from->code_points;
+    stats->invalid += from->invalid;
+    stats->untracked += from->untracked;
+
+    for (uint32_t c = 0; c < UTF8_DENSE_SIZE; c++)
+    {
+        stats->dense[c] += from->dense[c];
+    }
+
+    for (size_t i = 0; i < from->sparse_capacity; i++)
+    {
+        if (from->sparse[i].code_point != 0)
+        {
+            utf8_add(stats, from->sparse[i].code_point, from->sparse[i].count);
+        }
+    }
+}
+
+// Starts a sequence at a byte that is not ASCII. Returns 1 if the byte can
+// start one, or 0 if it is ill-formed on its own.
+static int utf8_start(Utf8Stats *stats, uint8_t byte)
+{
+    stats->low = 0x80;
+    stats->high = 0xbf;
+
+    if (byte >= 0xc2 && byte <= 0xdf)
+    {
+        stats->partial = byte & 0x1f;
+        stats->needed = 1;
+    }
+    else if (byte >= 0xe0 && byte <= 0xef)
+    {
+        // No overlong forms and no surrogates.
+        stats->low = byte == 0xe0 ? 0xa0 : 0x80;
+        stats->high = byte == 0xed ? 0x9f : 0xbf;
+        stats->partial = byte & 0x0f;
+        stats->needed = 2;
+    }
+    else if (byte >= 0xf0 && byte <= 0xf4)
+    {
+        // No overlong forms and nothing past U+10FFFF.
+        stats->low = byte == 0xf0 ? 0x90 : 0x80;
+        stats->high = byte == 0xf4 ? 0x8f : 0xbf;
+        stats->partial = byte & 0x07;
+        stats->needed = 3;
+    }
+    else
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+// Counts the code points in the next piece of a word. A sequence may continue
+// in the next piece; utf8_end_word ends it.
+static void utf8_count(Utf8Stats *stats, const uint8_t *data, size_t length)
+{
+    size_t i = 0;
+
+    while (i < length)
+    {
+        uint8_t byte;
+
+        if (stats->needed == 0)
+        {
+            size_t run = utf8_ascii_run(data + i, length - i);
+
+            stats->code_points += run;
+            i += run;
+
+            if (i == length)
+            {
+                return;
+            }
+
+            if (!utf8_start(stats, data[i]))
+            {
+                stats->invalid++;
+            }
+
+            i++;
+            continue;
+        }
+
+        byte = data[i];
+
+        if (byte < stats->low || byte > stats->high)
+        {
+            // The sequence breaks off; the byte is looked at afresh.
+            stats->invalid++;
+            stats->needed = 0;
+            continue;
+        }
+
+        stats->partial = stats->partial << 6 | (byte & 0x3f);
+        stats->low = 0x80;
+        stats->high = 0xbf;
+        i++;
+
+        if (--stats->needed == 0)
+        {
+            stats->code_points++;
+            utf8_add(stats, stats->partial, 1);
+        }
+    }
+}
+
+// A sequence cannot run from one word into the next.
+static void utf8_end_word(Utf8Stats *stats)
+{
+    if (stats->needed > 0)
+    {
+        stats->invalid++;
+        stats->needed = 0;
+    }
+}
+
+static int utf8_compare_count(const void *a, const void *b)
+{
+    const Utf8Entry *left = (const Utf8Entry *)a;
+    const Utf8Entry *right = (const Utf8Entry *)b;
+
+    if (left->count != right->count)
+    {
+        return left->count > right->count ? -1 : 1;
+    }
+
+    return left->code_point < right->code_point ? -1 : left->code_point > right->code_point;
+}
+
+static int utf8_compare_code_point(const void *a, const void *b)
+{
+    const Utf8Entry *left = (const Utf8Entry *)a;
+    const Utf8Entry *right = (const Utf8Entry *)b;
+
+    return left->code_point < right->code_point ? -1 : left->code_point > right->code_point;
+}
+
+// Copies the sparse entries into a new array sorted by code point, keeping only
+// the limit most frequent. Returns the array, or NULL with *count 0 if there
+// are none or memory runs out.
+static Utf8Entry *utf8_sparse_sorted(const Utf8Stats *stats, size_t limit, size_t *count)
+{
+    Utf8Entry *entries;
+    size_t found = 0;
+
+    *count = 0;
+
+    if (stats->sparse_count == 0 || (entries = (Utf8Entry *)malloc(stats->sparse_count * sizeof(Utf8Entry))) == NULL)
+    {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < stats->sparse_capacity; i++)
+    {
+        if (stats->sparse[i].code_point != 0)
+        {
+            entries[found++] = stats->sparse[i];
+        }
+    }
+
+    if (found > limit)
+    {
+        qsort(entries, found, sizeof(Utf8Entry), utf8_compare_count);
+        found = limit;
+    }
+
+    qsort(entries, found, sizeof(Utf8Entry), utf8_compare_code_point);
+    *count = found;
+
+    return entries;
+}
+
+// Serializes a code points reply into buffer, which must hold
+// CODE_POINTS_REPLY_MAX_SIZE bytes. ascii holds the folded byte counts, whose
+// first 128 are the ASCII code point counts. Returns the number of bytes written.
+static size_t encode_code_points(const Utf8Stats *stats, const unsigned long long *ascii, uint8_t *buffer)
+{
+    uint64_t unlisted = stats->untracked;
+    size_t length = REPLY_HEADER_SIZE;
+    size_t dense_entries = 0;
+    Utf8Entry *sparse;
+    size_t sparse_count;
+
+    sparse = utf8_sparse_sorted(stats, UTF8_REPLY_SPARSE, &sparse_count);
+
+    for (size_t i = 0; i < stats->sparse_capacity; i++)
+    {
+        unlisted += stats->sparse[i].count;
+    }
+
+    for (size_t i = 0; i < sparse_count; i++)
+    {
+        unlisted -= sparse[i].count;
+    }
+
+    for (uint32_t c = 0; c < UTF8_DENSE_SIZE; c++)
+    {
+        dense_entries += (c < 0x80 ? ascii[c] : stats->dense[c]) != 0;
+    }
+
+    buffer[length++] = REPLY_VERSION;
+    buffer[length++] = REPLY_CODE_POINTS;
+    length += varint_encode(stats->code_points, buffer + length);
+    length += varint_encode(stats->invalid, buffer + length);
+    length += varint_encode(unlisted, buffer + length);
+    length += varint_encode(dense_entries + sparse_count, buffer + length);
+
+    for (uint32_t c = 0; c < UTF8_DENSE_SIZE; c++)
+    {
+        unsigned long long count = c < 0x80 ? ascii[c] : stats->dense[c];
+
+        if (count != 0)
+        {
+            length += varint_encode(c, buffer + length);
+            length += varint_encode(count, buffer + length);
+        }
+    }
+
+    for (size_t i = 0; i < sparse_count; i++)
+    {
+        length += varint_encode(sparse[i].code_point, buffer + length);
+        length += varint_encode(sparse[i].count, buffer + length);
+    }
+
+    free(sparse);
+    put_u32_be(buffer, (uint32_t)(length - REPLY_HEADER_SIZE));
+
+    return length;
+}
+
+// Checks a code points reply body and adds it to stats, so the replies of
+// several connections sum up. Returns 0, or -1 if the body is truncated or
+// malformed.
+static int decode_code_points(const uint8_t *body, size_t length, Utf8Stats *stats)
+{
+    uint64_t code_points;
+    uint64_t invalid;
+    uint64_t unlisted;
+    uint64_t entries;
+    size_t offset = 2;
+    int64_t previous = -1;
+
+    if (length < 2 || body[0] != REPLY_VERSION || body[1] != REPLY_CODE_POINTS)
+    {
+        return -1;
+    }
+
+    if (varint_decode(body, length, &offset, &code_points) != 1 || varint_decode(body, length, &offset, &invalid) != 1 || varint_decode(body, length, &offset, &unlisted) != 1 || varint_decode(body, length, &offset, &entries) != 1 || entries > UTF8_DENSE_SIZE + UTF8_REPLY_SPARSE)
+    {
+        return -1;
+    }
+
+    stats->code_points += code_points;
+    stats->invalid += invalid;
+    stats->untracked += unlisted;
+
+    for (uint64_t i = 0; i < entries; i++)
+    {
+        uint64_t code_point;
+        uint64_t count;
+
+        if (varint_decode(body, length, &offset, &code_point) != 1 || varint_decode(body, length, &offset, &count) != 1 || code_point > 0x10ffff || (int64_t)code_point <= previous)
+        {
+            return -1;
+        }
+
+        utf8_add(stats, (uint32_t)code_point, count);
+        previous = (int64_t)code_point;
+    }
+
+    return offset == length ? 0 : -1;
+}
+
+// Writes a code point as UTF-8 to out, which must have 4 bytes of room, and
+// returns its length.
+static size_t utf8_encode_code_point(uint32_t code_point, char *out)
+{
+    if (code_point < 0x80)
+    {
+        out[0] = (char)code_point;
+        return 1;
+    }
+
+    if (code_point < 0x800)
+    {
+        out[0] = (char)(0xc0 | code_point >> 6);
+        out[1] = (char)(0x80 | (code_point & 0x3f));
+        return 2;
+    }
+
+    if (code_point < 0x10000)
+    {
+        out[0] = (char)(0xe0 | code_point >> 12);
+        out[1] = (char)(0x80 | ((code_point >> 6) & 0x3f));
+        out[2] = (char)(0x80 | (code_point & 0x3f));
+        return 3;
+    }
+
+    out[0] = (char)(0xf0 | code_point >> 18);
+    out[1] = (char)(0x80 | ((code_point >> 12) & 0x3f));
+    out[2] = (char)(0x80 | ((code_point >> 6) & 0x3f));
+    out[3] = (char)(0x80 | (code_point & 0x3f));
+    return 4;
+}
+
+static void print_code_point(uint32_t code_point, uint64_t count)
+{
+    char text[4];
+    size_t length = 0;
+
+    // Control characters are only shown by number.
+    if (code_point >= 0x20 && code_point != 0x7f && (code_point < 0x80 || code_point >= 0xa0))
+    {
+        length = utf8_encode_code_point(code_point, text);
+    }
+
+    printf("Code Point: U+%04" PRIX32 " %.*s Frequency: %" PRIu64 "\n", code_point, (int)length, text, count);
+}
+
+static void print_code_points(const Utf8Stats *stats)
+{
+    Utf8Entry *sparse;
+    size_t sparse_count;
+
+    printf("Code Point Count: %" PRIu64 "\n", stats->code_points);
+    printf("Ill-formed Sequences: %" PRIu64 "\n", stats->invalid);
+
+    for (uint32_t c = 0; c < UTF8_DENSE_SIZE; c++)
+    {
+        if (stats->dense[c] != 0)
+        {
+            print_code_point(c, stats->dense[c]);
+        }
+    }
+
+    sparse = utf8_sparse_sorted(stats, stats->sparse_count, &sparse_count);
+
+    for (size_t i = 0; i < sparse_count; i++)
+    {
+        print_code_point(sparse[i].code_point, sparse[i].count);
+    }
+
+    free(sparse);
+
+    if (stats->untracked > 0)
+    {
+        printf("Other Code Points: %" PRIu64 "\n", stats->untracked);
+    }
+}
+
+#pragma GCC diagnostic pop
+
+#endif
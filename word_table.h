@@ -0,0 +1,606 @@
+#ifndef WORD_TABLE_H
+#define WORD_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "histogram.h"
+#include "protocol.h"
+
+// Per-connection word frequencies. An open-addressing table with linear probing
+// holds 16-byte entries, four to a cache line, so a lookup usually touches one
+// line. Each entry has the count, the key's length, a tag of hash bits that
+// rules out most mismatches without a compare, and the key's offset in an arena.
+// Keys are case-folded like the character frequencies, eight bytes at a time,
+// and copied into the arena when they are first seen, zero-padded to a multiple
+// of eight so they are compared and rehashed eight bytes at a time too. The
+// table and the arena grow by doubling, so an insert allocates nothing except
+// on those rare doublings, and each frame can make room for several times the
+// words seen so far in one resize. Together they stay within
+// WORD_TABLE_MAX_BYTES, half for each, like a connection's other buffers.
+//
+// Words longer than WORD_TABLE_MAX_KEY bytes, and new words once the table or
+// the arena is full, are still counted by the parser but are not tracked here;
+// the table counts them as untracked.
+
+#define WORD_TABLE_MAX_KEY 255
+#define WORD_TABLE_INITIAL_CAPACITY 256 // Fewest slots in a table, a power of two
+#define WORD_TABLE_INITIAL_ARENA 8192
+#define WORD_TABLE_RESERVE_GROWTH 4 // Most a frame's reserve multiplies the distinct words by
+#define WORD_TABLE_MAX_BYTES (512 * 1024) // Slots and arena of a connection's table together
+#define WORD_TABLE_MAX_CAPACITY (WORD_TABLE_MAX_BYTES / 2 / sizeof(WordEntry)) // 16384 slots, for 12288 words
+#define WORD_TABLE_MAX_ARENA (WORD_TABLE_MAX_BYTES / 2)
+#define WORD_TOP_K 10                     // Words sent back in the top words reply
+
+// Top words reply body, sent after the stats reply to clients that speak
+// protocol version 3 or later:
+//   u8      format version, REPLY_VERSION
+//   u8      reply type, REPLY_TOP_WORDS
+//   varint  distinct words tracked
+//   varint  words not tracked
+//   varint  number of entries, at most WORD_TOP_K
+//   entries of (varint count, u8 length, bytes), most frequent first
+#define TOP_WORDS_REPLY_MAX_BODY (2 + 3 * VARINT_MAX_LEN + WORD_TOP_K * (VARINT_MAX_LEN + 1 + WORD_TABLE_MAX_KEY))
+#define TOP_WORDS_REPLY_MAX_SIZE (REPLY_HEADER_SIZE + TOP_WORDS_REPLY_MAX_BODY)
+
+typedef struct
+{
+    uint64_t count;  // 0 while the slot is empty
+    uint32_t key;    // Offset of the key in the arena, a multiple of eight
+    uint16_t tag;    // The top bits of the key's hash
+    uint8_t length;  // Key length, 1 to WORD_TABLE_MAX_KEY
+} WordEntry;
+
+typedef struct
+{
+    WordEntry *entries;
+    size_t capacity; // Slots, a power of two, or 0 until the first word
+    size_t size;
+    uint8_t *arena;
+    size_t arena_len;
+    size_t arena_capacity;
+    uint64_t untracked;
+} WordTable;
+
+// A decoded top words reply, or several merged.
+typedef struct
+{
+    uint64_t distinct;
+    uint64_t untracked;
+    size_t count;
+    struct
+    {
+        uint64_t count;
+        uint8_t length;
+        char word[WORD_TABLE_MAX_KEY];
+    } words[WORD_TOP_K];
+} TopWords;
+
+_Static_assert(sizeof(WordEntry) == 16, "Word table entries must pack four to a cache line");
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+
+static void word_table_init(WordTable *table)
+{
+    memset(table, 0, sizeof(*table));
+}
+
+static void word_table_free(WordTable *table)
+{
+    free(table->entries);
+    free(table->arena);
+    word_table_init(table);
+}
+
+// Hashes a key eight bytes at a time. The key must be readable, and zero, up to
+// the next multiple of eight bytes past its length.
+static uint64_t word_hash(const uint8_t *key, size_t length)
+{
+    uint64_t hash = (uint64_t)length * 0x9e3779b97f4a7c15ULL;
+
+    for (size_t i = 0; i < length; i += 8)
+    {
+        uint64_t chunk;
+
+        memcpy(&chunk, key + i, sizeof(chunk));
+        hash = (hash ^ chunk) * 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 32;
+    }
+
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 29;
+
+    return hash;
+}
+
+// Moves the entries into a table of the given capacity, a power of two. Returns
+// 0, or -1 if out of memory.
+static int word_table_resize(WordTable *table, size_t capacity)
+{
+    WordEntry *entries;
+
+    entries = (WordEntry *)calloc(capacity, sizeof(WordEntry));
+
+    if (entries == NULL)
+    {
+        return -1;
+    }
+
+    // Tags are the top hash bits and slots come from the bottom ones, so entries
+    // have to be rehashed from their keys.
+    for (size_t i = 0; i < table->capacity; i++)
+    {
+        const WordEntry *entry = &table->entries[i];
+        size_t slot;
+
+        if (entry->count == 0)
+        {
+            continue;
+        }
+
+        slot = word_hash(table->arena + entry->key, entry->length) & (capacity - 1);
+
+        while (entries[slot].count != 0)
+        {
+            slot = (slot + 1) & (capacity - 1);
+        }
+
+        entries[slot] = *entry;
+    }
+
+    free(table->entries);
+    table->entries = entries;
+    table->capacity = capacity;
+
+    return 0;
+}
+
+// Doubles the table, or makes the first one. Returns 0, or -1 if out of memory.
+static int word_table_grow(WordTable *table)
+{
+    return word_table_resize(table, table->capacity == 0 ? WORD_TABLE_INITIAL_CAPACITY : table->capacity * 2);
+}
+
+// Makes room for up to words more distinct words, within the table's limit,
+// with a single resize rather than one rehash per doubling. The parser calls it
+// with each frame's word count, but most of those words repeat, so it reserves
+// for at most WORD_TABLE_RESERVE_GROWTH times the distinct words seen so far: a
+// table whose vocabulary keeps growing skips doublings, and a small one stays
+// small. Returns 0, or -1 if out of memory.
+static int word_table_reserve(WordTable *table, uint64_t words)
+{
+    size_t capacity = table->capacity == 0 ? WORD_TABLE_INITIAL_CAPACITY : table->capacity;
+    uint64_t wanted;
+
+    if (words > (uint64_t)table->size * (WORD_TABLE_RESERVE_GROWTH - 1))
+    {
+        words = (uint64_t)table->size * (WORD_TABLE_RESERVE_GROWTH - 1);
+    }
+
+    wanted = table->size + words;
+
+    while (wanted * 4 > capacity * 3 && capacity < WORD_TABLE_MAX_CAPACITY)
+    {
+        capacity *= 2;
+    }
+
+    if (capacity == table->capacity)
+    {
+        return 0;
+    }
+
+    return word_table_resize(table, capacity);
+}
+
+// Rounds a key length up to the bytes it takes in the arena.
+static size_t word_padded_length(size_t length)
+{
+    return (length + 7) & ~(size_t)7;
+}
+
+// Copies a key made by word_key into the arena with its padding. Returns its
+// offset, or -1 if the arena is full or out of memory.
+static int64_t word_table_store_key(WordTable *table, const uint8_t *key, size_t length)
+{
+    size_t offset = table->arena_len;
+
+    length = word_padded_length(length);
+
+    if (table->arena_len + length > table->arena_capacity)
+    {
+        size_t capacity = table->arena_capacity == 0 ? WORD_TABLE_INITIAL_ARENA : table->arena_capacity * 2;
+        uint8_t *arena;
+
+        if (table->arena_len + length > WORD_TABLE_MAX_ARENA)
+        {
+            return -1;
+        }
+
+        if (capacity > WORD_TABLE_MAX_ARENA)
+        {
+            capacity = WORD_TABLE_MAX_ARENA;
+        }
+
+        arena = (uint8_t *)realloc(table->arena, capacity);
+
+        if (arena == NULL)
+        {
+            return -1;
+        }
+
+        table->arena = arena;
+        table->arena_capacity = capacity;
+    }
+
+    memcpy(table->arena + offset, key, length);
+    table->arena_len += length;
+
+    return (int64_t)offset;
+}
+
+// Case-folds eight bytes at once as case_fold_table does: 'A' to 'Z' gain 0x20
+// and every other byte is left as it is.
+static uint64_t word_fold8(uint64_t chunk)
+{
+    uint64_t low = chunk & 0x7f7f7f7f7f7f7f7fULL;
+    uint64_t from_a = low + 0x3f3f3f3f3f3f3f3fULL; // Top bit set from 'A' up
+    uint64_t past_z = low + 0x2525252525252525ULL; // Top bit set past 'Z'
+    uint64_t upper = from_a & ~past_z & ~chunk & 0x8080808080808080ULL;
+
+    return chunk | upper >> 2;
+}
+
+// Reads the last, partial chunk of a word, the bytes from offset to length,
+// zero-padded. The word may end where its buffer does, so nothing past it is
+// read; overlapping loads cover the tail instead of a loop over its bytes, whose
+// exit would be mispredicted as word lengths vary.
+static uint64_t word_load_tail(const uint8_t *word, size_t offset, size_t length)
+{
+    size_t tail = length - offset; // 1 to 7
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t chunk;
+
+    if (length >= 8)
+    {
+        memcpy(&chunk, word + length - 8, sizeof(chunk));
+        return chunk >> (8 * (8 - tail));
+    }
+
+    if (tail >= 4)
+    {
+        uint32_t low;
+        uint32_t high;
+
+        memcpy(&low, word, sizeof(low));
+        memcpy(&high, word + tail - 4, sizeof(high));
+        return (uint64_t)low | (uint64_t)high << (8 * (tail - 4));
+    }
+
+    return (uint64_t)word[0] | (uint64_t)word[tail / 2] << (8 * (tail / 2)) | (uint64_t)word[tail - 1] << (8 * (tail - 1));
+#else
+    uint8_t bytes[8] = {0};
+    uint64_t chunk;
+
+    for (size_t i = 0; i < tail; i++)
+    {
+        bytes[i] = word[offset + i];
+    }
+
+    memcpy(&chunk, bytes, sizeof(chunk));
+    return chunk;
+#endif
+}
+
+// Case-folds a word of at most WORD_TABLE_MAX_KEY bytes into key, which must
+// hold WORD_TABLE_MAX_KEY + 8 bytes, zero-padded to a multiple of eight.
+// Returns its hash, the same as word_hash of the key.
+static uint64_t word_key(const uint8_t *word, size_t length, uint8_t *key)
+{
+    uint64_t hash = (uint64_t)length * 0x9e3779b97f4a7c15ULL;
+
+    for (size_t i = 0; i < length; i += 8)
+    {
+        uint64_t chunk = 0;
+
+        if (length - i >= 8)
+        {
+            memcpy(&chunk, word + i, sizeof(chunk));
+        }
+        else
+        {
+            chunk = word_load_tail(word, i, length);
+        }
+
+        chunk = word_fold8(chunk);
+        memcpy(key + i, &chunk, sizeof(chunk));
+        hash = (hash ^ chunk) * 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 32;
+    }
+
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 29;
+
+    return hash;
+}
+
+// Compares two keys of the same length, both zero-padded to a multiple of eight.
+static int word_key_equal(const uint8_t *left, const uint8_t *right, size_t length)
+{
+    for (size_t i = 0; i < length; i += 8)
+    {
+        uint64_t a;
+        uint64_t b;
+
+        memcpy(&a, left + i, sizeof(a));
+        memcpy(&b, right + i, sizeof(b));
+
+        if (a != b)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Counts one occurrence of a key made by word_key.
+static void word_table_add_key(WordTable *table, const uint8_t *key, size_t length, uint64_t hash)
+{
+    uint16_t tag;
+    size_t slot;
+
+    // Keep the load factor at or below three quarters, while there is room to grow.
+    if ((table->size + 1) * 4 > table->capacity * 3 && table->capacity < WORD_TABLE_MAX_CAPACITY)
+    {
+        word_table_grow(table);
+    }
+
+    if (table->capacity == 0)
+    {
+        table->untracked++;
+        return;
+    }
+
+    tag = (uint16_t)(hash >> 48);
+    slot = hash & (table->capacity - 1);
+
+    for (;;)
+    {
+        WordEntry *entry = &table->entries[slot];
+        int64_t offset;
+
+        if (entry->count == 0)
+        {
+            // A full table still counts the words it has, and never fills every slot.
+            if ((table->size + 1) * 4 > table->capacity * 3 || (offset = word_table_store_key(table, key, length)) < 0)
+            {
+                table->untracked++;
+                return;
+            }
+
+            entry->count = 1;
+            entry->key = (uint32_t)offset;
+            entry->tag = tag;
+            entry->length = (uint8_t)length;
+            table->size++;
+            return;
+        }
+
+        if (entry->tag == tag && entry->length == length && word_key_equal(table->arena + entry->key, key, length))
+        {
+            entry->count++;
+            return;
+        }
+
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+}
+
+// Counts one occurrence of a word. Empty words are not tracked.
+static void word_table_add(WordTable *table, const uint8_t *word, size_t length)
+{
+    uint8_t key[WORD_TABLE_MAX_KEY + 8];
+    uint64_t hash;
+
+    if (length == 0)
+    {
+        return;
+    }
+
+    if (length > WORD_TABLE_MAX_KEY)
+    {
+        table->untracked++;
+        return;
+    }
+
+    hash = word_key(word, length, key);
+    word_table_add_key(table, key, length, hash);
+}
+
+// Fills top with up to WORD_TOP_K of the most frequent words, most frequent first.
+static void word_table_top(const WordTable *table, TopWords *top)
+{
+    const WordEntry *best[WORD_TOP_K];
+    size_t count = 0;
+
+    for (size_t i = 0; i < table->capacity; i++)
+    {
+        const WordEntry *entry = &table->entries[i];
+        size_t position;
+
+        if (entry->count == 0 || (count == WORD_TOP_K && entry->count <= best[count - 1]->count))
+        {
+            continue;
+        }
+
+        position = count < WORD_TOP_K ? count++ : count - 1;
+
+        while (position > 0 && best[position - 1]->count < entry->count)
+        {
+            best[position] = best[position - 1];
+            position--;
+        }
+
+        best[position] = entry;
+    }
+
+    top->distinct = table->size;
+    top->untracked = table->untracked;
+    top->count = count;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        top->words[i].count = best[i]->count;
+        top->words[i].length = best[i]->length;
+        memcpy(top->words[i].word, table->arena + best[i]->key, best[i]->length);
+    }
+}
+
+// Serializes a top words reply into buffer, which must hold
+// TOP_WORDS_REPLY_MAX_SIZE bytes. Returns the number of bytes written.
+static size_t encode_top_words(const TopWords *top, uint8_t *buffer)
+{
+    size_t length = REPLY_HEADER_SIZE;
+
+    buffer[length++] = REPLY_VERSION;
+    buffer[length++] = REPLY_TOP_WORDS;
+    length += varint_encode(top->distinct, buffer + length);
+    length += varint_encode(top->untracked, buffer + length);
+    length += varint_encode(top->count, buffer + length);
+
+    for (size_t i = 0; i < top->count; i++)
+    {
+        length += varint_encode(top->words[i].count, buffer + length);
+        buffer[length++] = top->words[i].length;
+        memcpy(buffer + length, top->words[i].word, top->words[i].length);
+        length += top->words[i].length;
+    }
+
+    put_u32_be(buffer, (uint32_t)(length - REPLY_HEADER_SIZE));
+
+    return length;
+}
+
+// Checks and decodes a top words reply body. Returns 0, or -1 if it is truncated
+// or malformed.
+static int decode_top_words(const uint8_t *body, size_t length, TopWords *top)
+{
+    uint64_t count;
+    size_t offset = 2;
+
+    if (length < 2 || body[0] != REPLY_VERSION || body[1] != REPLY_TOP_WORDS)
+    {
+        return -1;
+    }
+
+    if (varint_decode(body, length, &offset, &top->distinct) != 1 || varint_decode(body, length, &offset, &top->untracked) != 1 || varint_decode(body, length, &offset, &count) != 1 || count > WORD_TOP_K)
+    {
+        return -1;
+    }
+
+    top->count = (size_t)count;
+
+    for (size_t i = 0; i < top->count; i++)
+    {
+        uint8_t word_len;
+
+        if (varint_decode(body, length, &offset, &top->words[i].count) != 1 || offset >= length)
+        {
+            return -1;
+        }
+
+        word_len = body[offset++];
+
+        if (word_len == 0 || word_len > length - offset)
+        {
+            return -1;
+        }
+
+        top->words[i].length = word_len;
+        memcpy(top->words[i].word, body + offset, word_len);
+        offset += word_len;
+    }
+
+    return offset == length ? 0 : -1;
+}
+
+// Adds the words in part to total, keeping the WORD_TOP_K most frequent. Each
+// connection only reports its own top words, so after a merge the counts are
+// exact for words that made every list and lower bounds otherwise. Distinct
+// words can be shared between connections, so the largest count is kept.
+static void merge_top_words(TopWords *total, const TopWords *part)
+{
+    TopWords merged = *total;
+
+    for (size_t i = 0; i < part->count; i++)
+    {
+        size_t position = merged.count;
+
+        for (size_t j = 0; j < merged.count; j++)
+        {
+            if (merged.words[j].length == part->words[i].length && memcmp(merged.words[j].word, part->words[i].word, part->words[i].length) == 0)
+            {
+                position = j;
+                break;
+            }
+        }
+
+        if (position < merged.count)
+        {
+            merged.words[position].count += part->words[i].count;
+            continue;
+        }
+
+        // Replace the least frequent word if the list is full and this one beats it.
+        if (merged.count == WORD_TOP_K)
+        {
+            size_t lowest = 0;
+
+            for (size_t j = 1; j < merged.count; j++)
+            {
+                if (merged.words[j].count < merged.words[lowest].count)
+                {
+                    lowest = j;
+                }
+            }
+
+            if (merged.words[lowest].count >= part->words[i].count)
+            {
+                continue;
+            }
+
+            position = lowest;
+        }
+        else
+        {
+            merged.count++;
+        }
+
+        merged.words[position].count = part->words[i].count;
+        merged.words[position].length = part->words[i].length;
+        memcpy(merged.words[position].word, part->words[i].word, part->words[i].length);
+    }
+
+    // Most frequent first again.
+    for (size_t i = 1; i < merged.count; i++)
+    {
+        for (size_t j = i; j > 0 && merged.words[j - 1].count < merged.words[j].count; j--)
+        {
+            __typeof__(merged.words[0]) swap = merged.words[j];
+
+            merged.words[j] = merged.words[j - 1];
+            merged.words[j - 1] = swap;
+        }
+    }
+
+    merged.distinct = total->distinct > part->distinct ? total->distinct : part->distinct;
+    merged.untracked = total->untracked + part->untracked;
+    *total = merged;
+}
+
+#pragma GCC diagnostic pop
+
+#endif